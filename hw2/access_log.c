@@ -0,0 +1,202 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "access_log.h"
+#include "metrics.h"
+
+#define ACCESS_LOG_BATCH_SIZE (64 * 1024)
+#define ACCESS_LOG_LINE_SIZE (ACCESS_LOG_PATH_SIZE + 160)
+
+/* HEAD is only written by the owning thread, TAIL only by the drain thread;
+ * each sits on its own cache line. A ring outlives its thread: when that
+ * exits, the ring goes on the free list with whatever it still holds, the
+ * drain thread keeps draining it, and the next thread to start takes it
+ * over, so there are only as many rings as threads ever alive at once. */
+struct access_log_ring {
+  size_t head;
+  char pad0[64 - sizeof(size_t)];
+  size_t tail;
+  char pad1[64 - sizeof(size_t)];
+  unsigned int requests;    /* Seen by the owner, for sampling. */
+  struct access_log_ring *next;
+  struct access_log_ring *next_free;
+  struct access_log_entry entries[ACCESS_LOG_RING_SIZE];
+} __attribute__((aligned(64)));
+
+static int log_fd = -1;
+static int log_sample_rate = 1;
+static struct access_log_ring *rings;
+static __thread struct access_log_ring *local_ring;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t ring_key;
+static pthread_mutex_t free_rings_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct access_log_ring *free_rings;
+
+static void access_log_ring_release(void *data) {
+  struct access_log_ring *ring = data;
+  local_ring = NULL;
+  pthread_mutex_lock(&free_rings_mutex);
+  ring->next_free = free_rings;
+  free_rings = ring;
+  pthread_mutex_unlock(&free_rings_mutex);
+}
+
+static void access_log_ring_key_create() {
+  pthread_key_create(&ring_key, access_log_ring_release);
+}
+
+static struct access_log_ring *access_log_ring() {
+  if (local_ring != NULL) return local_ring;
+  pthread_once(&ring_key_once, access_log_ring_key_create);
+
+  pthread_mutex_lock(&free_rings_mutex);
+  struct access_log_ring *ring = free_rings;
+  if (ring != NULL) free_rings = ring->next_free;
+  pthread_mutex_unlock(&free_rings_mutex);
+
+  if (ring == NULL) {
+    if (posix_memalign((void **) &ring, 64, sizeof(struct access_log_ring)) != 0) return NULL;
+    memset(ring, 0, sizeof(struct access_log_ring));
+    ring->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&rings, &ring->next, ring, 1, __ATOMIC_RELEASE,
+          __ATOMIC_RELAXED));
+  }
+  pthread_setspecific(ring_key, ring);
+  return local_ring = ring;
+}
+
+int access_log_enabled() {
+  return log_fd != -1;
+}
+
+/* Copies SLICE into BUFFER of SIZE bytes, truncated and null-terminated, or
+ * "-" if there is none. */
+static void access_log_copy(char *buffer, size_t size, struct http_slice *slice) {
+  if (slice == NULL || slice->length == 0) {
+    strcpy(buffer, "-");
+    return;
+  }
+  size_t length = slice->length < size - 1 ? slice->length : size - 1;
+  memcpy(buffer, slice->data, length);
+  buffer[length] = '\0';
+}
+
+int access_log_start(struct access_log_entry *entry, struct sockaddr_in *peer,
+    struct http_slice *method, struct http_slice *path) {
+  if (log_fd == -1) return 0;
+  struct access_log_ring *ring = access_log_ring();
+  if (ring == NULL || ring->requests++ % log_sample_rate != 0) return 0;
+
+  entry->time = time(NULL);
+  entry->start_us = metrics_now_us();
+  entry->peer.s_addr = peer != NULL ? peer->sin_addr.s_addr : INADDR_ANY;
+  access_log_copy(entry->method, sizeof(entry->method), method);
+  access_log_copy(entry->path, sizeof(entry->path), path);
+  return 1;
+}
+
+void access_log_finish(struct access_log_entry *entry, int status_code, size_t bytes_sent) {
+  struct access_log_ring *ring = access_log_ring();
+  if (ring == NULL) return;
+
+  size_t head = ring->head;
+  if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == ACCESS_LOG_RING_SIZE) {
+    metrics_count(METRICS_ACCESS_LOG_DROPPED, 1);
+    return;
+  }
+  entry->status_code = status_code;
+  entry->bytes_sent = bytes_sent;
+  entry->latency_us = metrics_now_us() - entry->start_us;
+  ring->entries[head & (ACCESS_LOG_RING_SIZE - 1)] = *entry;
+  __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+static size_t access_log_format(struct access_log_entry *entry, char *buffer, size_t size) {
+  char peer[INET_ADDRSTRLEN];
+  char status[12] = "-";
+  char time_string[32];
+  struct tm tm;
+
+  inet_ntop(AF_INET, &entry->peer, peer, sizeof(peer));
+  if (entry->status_code != 0) snprintf(status, sizeof(status), "%d", entry->status_code);
+  gmtime_r(&entry->time, &tm);
+  strftime(time_string, sizeof(time_string), "%d/%b/%Y:%H:%M:%S +0000", &tm);
+
+  int length = snprintf(buffer, size, "%s [%s] \"%s %s\" %s %zu %ldus\n", peer, time_string,
+      entry->method, entry->path, status, entry->bytes_sent, entry->latency_us);
+  if (length < 0) return 0;
+  return (size_t) length < size ? (size_t) length : size - 1;
+}
+
+static void access_log_write(char *buffer, size_t length) {
+  while (length > 0) {
+    ssize_t bytes_written = write(log_fd, buffer, length);
+    if (bytes_written < 0) {
+      if (errno == EINTR) continue;
+      return;
+    }
+    buffer += bytes_written;
+    length -= bytes_written;
+  }
+}
+
+static void *access_log_drain(void *args) {
+  char *batch = args;
+  struct timespec interval = { 0, ACCESS_LOG_DRAIN_MS * 1000000L };
+
+  size_t drained = 0;
+  while (1) {
+    if (drained < ACCESS_LOG_RING_SIZE / 4) nanosleep(&interval, NULL);
+
+    size_t length = 0;
+    drained = 0;
+    struct access_log_ring *ring;
+    for (ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); ring != NULL; ring = ring->next) {
+      size_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+      size_t tail = ring->tail;
+      drained += head - tail;
+      for (; tail != head; tail++) {
+        if (ACCESS_LOG_BATCH_SIZE - length < ACCESS_LOG_LINE_SIZE) {
+          access_log_write(batch, length);
+          length = 0;
+        }
+        length += access_log_format(&ring->entries[tail & (ACCESS_LOG_RING_SIZE - 1)],
+            batch + length, ACCESS_LOG_BATCH_SIZE - length);
+      }
+      /* Hands the drained slots back to the owner. */
+      __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+    }
+    if (length > 0) access_log_write(batch, length);
+  }
+
+  return NULL;
+}
+
+int access_log_init(char *file_name, int sample_rate) {
+  if (file_name == NULL) return 0;
+
+  char *batch = malloc(ACCESS_LOG_BATCH_SIZE);
+  if (batch == NULL) return -1;
+  log_fd = open(file_name, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+  if (log_fd == -1) {
+    free(batch);
+    return -1;
+  }
+  log_sample_rate = sample_rate > 0 ? sample_rate : 1;
+
+  pthread_t thread;
+  errno = pthread_create(&thread, NULL, access_log_drain, batch);
+  if (errno != 0) {
+    close(log_fd);
+    log_fd = -1;
+    free(batch);
+    return -1;
+  }
+  return 0;
+}
@@ -0,0 +1,54 @@
+#ifndef __ACCESS_LOG__
+#define __ACCESS_LOG__
+
+#include <netinet/in.h>
+#include <stddef.h>
+#include <time.h>
+
+#include "libhttp.h"
+
+/* ACCESS_LOG writes one line per request (peer, method, path, status, bytes
+ * sent and latency) to a file, without the serving threads ever touching
+ * the file or a lock. Every thread appends fixed-size entries to its own
+ * single-producer ring, and a background thread drains all rings every
+ * ACCESS_LOG_DRAIN_MS (straight away again after a busy pass), formats them
+ * and writes them out in large batches.
+ *
+ * A ring that is full when an entry comes in drops it and counts the drop
+ * (see METRICS_ACCESS_LOG_DROPPED); serving never waits for the disk. With a
+ * sample rate of N, each thread logs one request out of every N. */
+
+#define ACCESS_LOG_RING_SIZE 2048 /* Entries per thread; a power of two. */
+#define ACCESS_LOG_DRAIN_MS 50
+#define ACCESS_LOG_METHOD_SIZE 16
+#define ACCESS_LOG_PATH_SIZE 192
+
+struct access_log_entry {
+  time_t time;              /* Wall clock, when the request came in. */
+  long start_us;            /* metrics_now_us, ditto. */
+  long latency_us;
+  struct in_addr peer;
+  int status_code;          /* 0 if unknown (proxied requests). */
+  size_t bytes_sent;
+  char method[ACCESS_LOG_METHOD_SIZE];
+  char path[ACCESS_LOG_PATH_SIZE];    /* Truncated if longer. */
+};
+
+/* Starts logging to FILE_NAME (appending), sampling one request in every
+ * SAMPLE_RATE. Without a call, or with a NULL FILE_NAME, nothing is logged.
+ * Returns -1 (with errno set) if the file cannot be opened. */
+int access_log_init(char *file_name, int sample_rate);
+
+int access_log_enabled();
+
+/* Fills ENTRY for a request from PEER (NULL if unknown) for PATH with
+ * METHOD (either NULL for a request that did not parse). Returns 0 if the
+ * request is not to be logged, in which case access_log_finish must not be
+ * called. */
+int access_log_start(struct access_log_entry *entry, struct sockaddr_in *peer,
+    struct http_slice *method, struct http_slice *path);
+
+/* Completes ENTRY once its response has been sent and queues it. */
+void access_log_finish(struct access_log_entry *entry, int status_code, size_t bytes_sent);
+
+#endif
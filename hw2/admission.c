@@ -0,0 +1,130 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "admission.h"
+#include "metrics.h"
+
+#define ADMISSION_RESPONSE_SIZE 512
+
+#define TOO_MANY_REQUESTS_PAGE "<center><h1>429 Too Many Requests</h1><hr></center>"
+#define SERVICE_UNAVAILABLE_PAGE "<center><h1>503 Service Unavailable</h1><hr></center>"
+
+/* Tokens are counted in thousandths, so that a refill of RATE per second
+ * can be credited every millisecond without rounding it away. */
+struct admission_bucket {
+  uint32_t address;
+  long tokens;
+  long refilled_ms;
+};
+
+struct admission_shard {
+  pthread_mutex_t mutex;
+  struct admission_bucket buckets[ADMISSION_TABLE_SIZE / ADMISSION_NUM_SHARDS];
+};
+
+static long admission_rate;
+static long admission_burst;
+static struct admission_shard shards[ADMISSION_NUM_SHARDS];
+
+static char too_many_requests[ADMISSION_RESPONSE_SIZE];
+static int too_many_requests_length;
+static char service_unavailable[ADMISSION_RESPONSE_SIZE];
+static int service_unavailable_length;
+
+static long now_ms() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+  return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static int admission_render(char *buffer, int status_code, char *body) {
+  struct http_builder builder;
+  http_builder_init(&builder, buffer, ADMISSION_RESPONSE_SIZE);
+  http_builder_start(&builder, status_code);
+  http_builder_header(&builder, "Content-Type", "text/html");
+  http_builder_headerf(&builder, "Content-Length", "%zu", strlen(body));
+  http_builder_headerf(&builder, "Retry-After", "%d", ADMISSION_RETRY_AFTER_S);
+  http_builder_header(&builder, "Connection", "close");
+  http_builder_end(&builder);
+  http_builder_append(&builder, body, strlen(body));
+  return builder.overflow ? 0 : builder.length;
+}
+
+void admission_init(int rate, int burst) {
+  admission_rate = rate;
+  admission_burst = burst > 0 ? burst : rate;
+
+  int i;
+  for (i = 0; i < ADMISSION_NUM_SHARDS; i++) {
+    pthread_mutex_init(&shards[i].mutex, NULL);
+    memset(shards[i].buckets, 0, sizeof(shards[i].buckets));
+  }
+
+  too_many_requests_length = admission_render(too_many_requests, 429, TOO_MANY_REQUESTS_PAGE);
+  service_unavailable_length = admission_render(service_unavailable, 503,
+      SERVICE_UNAVAILABLE_PAGE);
+}
+
+int admission_enabled() {
+  return admission_rate > 0;
+}
+
+int admission_allow(struct sockaddr_in *peer) {
+  if (admission_rate <= 0) return 1;
+
+  uint32_t address = peer->sin_addr.s_addr;
+  /* Fibonacci hashing: the top bits of the product are well mixed even for
+   * addresses that differ only in their last octet. */
+  uint32_t hash = address * 2654435769u;
+  int index = hash >> (32 - __builtin_ctz(ADMISSION_TABLE_SIZE));
+  struct admission_shard *shard = &shards[index % ADMISSION_NUM_SHARDS];
+  struct admission_bucket *bucket = &shard->buckets[index / ADMISSION_NUM_SHARDS];
+  long now = now_ms();
+  int allowed;
+
+  pthread_mutex_lock(&shard->mutex);
+  if (bucket->address != address || bucket->refilled_ms == 0) {
+    bucket->address = address;
+    bucket->tokens = admission_burst * 1000;
+  } else {
+    bucket->tokens += (now - bucket->refilled_ms) * admission_rate;
+    if (bucket->tokens > admission_burst * 1000) bucket->tokens = admission_burst * 1000;
+  }
+  bucket->refilled_ms = now > 0 ? now : 1;
+  allowed = bucket->tokens >= 1000;
+  if (allowed) bucket->tokens -= 1000;
+  pthread_mutex_unlock(&shard->mutex);
+  return allowed;
+}
+
+void admission_reject(int fd, int status_code) {
+  char *response = status_code == 429 ? too_many_requests : service_unavailable;
+  int length = status_code == 429 ? too_many_requests_length : service_unavailable_length;
+  char discard[LIBHTTP_REQUEST_MAX_SIZE];
+
+  metrics_count(status_code == 429 ? METRICS_RATE_LIMITED : METRICS_SHED, 1);
+  metrics_count_status(status_code);
+  /* Whatever the client has sent already is read first: closing a socket
+   * with unread data resets the connection, and the response with it. */
+  recv(fd, discard, sizeof(discard), MSG_DONTWAIT);
+  send(fd, response, length, MSG_DONTWAIT | MSG_NOSIGNAL);
+  shutdown(fd, SHUT_WR);
+  close(fd);
+}
+
+int admission_allow_request(struct sockaddr_in *peer, struct http_response *response) {
+  if (admission_allow(peer)) return 1;
+
+  metrics_count(METRICS_RATE_LIMITED, 1);
+  metrics_count_status(429);
+  /* The rendered response is shared, and without a body nothing is freed. */
+  http_response_init(response);
+  response->status_code = 429;
+  response->header = too_many_requests;
+  response->header_length = too_many_requests_length;
+  return 0;
+}
@@ -0,0 +1,49 @@
+#ifndef __ADMISSION__
+#define __ADMISSION__
+
+#include <netinet/in.h>
+
+#include "libhttp.h"
+
+/* ADMISSION decides which connections and requests the server takes on at
+ * all. Every client address gets a token bucket, refilled at a fixed number
+ * of requests per second up to a burst. A connection is charged a token
+ * when it is accepted, which pays for its first request, and every further
+ * request on it one more, so keep-alive does not get around the limit. A
+ * connection that finds its bucket empty is turned away with "429 Too Many
+ * Requests"; a later request is answered with it, and the connection
+ * closed. Proxied connections are charged per request only while the proxy
+ * cache answers them: once relayed, their bytes are tunnelled without
+ * telling requests apart. Buckets live in a fixed
+ * table indexed by a hash of the address, so memory does not grow with the
+ * number of clients: two addresses that collide share a slot, and the newer
+ * one takes it over with a full bucket.
+ *
+ * The work queues shed load through admission_reject as well (see pool.h),
+ * with "503 Service Unavailable". Both responses are rendered once, up
+ * front, and sent without blocking, so turning a connection away costs a
+ * write and a close. */
+
+#define ADMISSION_TABLE_SIZE 4096    /* Must be a power of two. */
+#define ADMISSION_NUM_SHARDS 16
+#define ADMISSION_RETRY_AFTER_S 1
+
+/* Allows each client address RATE requests per second, up to BURST at once.
+ * A RATE of 0 disables the limit. */
+void admission_init(int rate, int burst);
+
+/* Whether requests are rate limited at all. */
+int admission_enabled();
+
+/* Takes a token from PEER's bucket. Returns 0 if there was none left. */
+int admission_allow(struct sockaddr_in *peer);
+
+/* Answers FD with STATUS_CODE (429 or 503) and closes it. */
+void admission_reject(int fd, int status_code);
+
+/* Takes a token from PEER's bucket for a request after the first on a
+ * connection. Returns 0 if there was none left, having filled RESPONSE with
+ * a 429 that closes the connection. */
+int admission_allow_request(struct sockaddr_in *peer, struct http_response *response);
+
+#endif
@@ -0,0 +1,104 @@
+#define _GNU_SOURCE
+#include <linux/filter.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "affinity.h"
+
+static int cpus[CPU_SETSIZE];     /* The CPUs threads are pinned to, ascending. */
+static int num_cpus;
+
+int affinity_init(char *cpu_list) {
+  cpu_set_t allowed, listed;
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1) return -1;
+
+  if (strcmp(cpu_list, "all") == 0) {
+    listed = allowed;
+  } else {
+    CPU_ZERO(&listed);
+    char *range = cpu_list;
+    while (*range != '\0') {
+      char *end;
+      long first = strtol(range, &end, 10), last = first;
+      if (end == range) return -1;
+      if (*end == '-') {
+        range = end + 1;
+        last = strtol(range, &end, 10);
+        if (end == range) return -1;
+      }
+      if (first < 0 || last < first || last >= CPU_SETSIZE) return -1;
+      for (; first <= last; first++) {
+        if (!CPU_ISSET(first, &allowed)) return -1;
+        CPU_SET(first, &listed);
+      }
+      if (*end == ',') end++;
+      else if (*end != '\0') return -1;
+      range = end;
+    }
+  }
+
+  num_cpus = 0;
+  int cpu;
+  for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+    if (CPU_ISSET(cpu, &listed)) cpus[num_cpus++] = cpu;
+  return num_cpus > 0 ? 0 : -1;
+}
+
+int affinity_num_cpus() {
+  return num_cpus;
+}
+
+/* Share I of N takes every N-th CPU of the list, starting at the I-th; the
+ * shares go round the list when there are more of them than CPUs. */
+void affinity_share(int share, int num_shares, cpu_set_t *share_cpus) {
+  CPU_ZERO(share_cpus);
+  if (num_cpus == 0) return;
+  if (num_shares >= num_cpus) {
+    CPU_SET(cpus[share % num_cpus], share_cpus);
+    return;
+  }
+  int i;
+  for (i = share; i < num_cpus; i += num_shares)
+    CPU_SET(cpus[i], share_cpus);
+}
+
+void affinity_pin(int share, int num_shares) {
+  if (num_cpus == 0) return;
+  cpu_set_t share_cpus;
+  affinity_share(share, num_shares, &share_cpus);
+  pthread_setaffinity_np(pthread_self(), sizeof(share_cpus), &share_cpus);
+}
+
+/* The program maps the receiving CPU to the index of a socket in the group,
+ * which is the order the sockets started listening in. A CPU outside the
+ * list gets an index past the end, and the kernel falls back to hashing. */
+int affinity_steer(int *sockets, int num_sockets) {
+  if (num_cpus == 0 || num_sockets < 1) return -1;
+
+  struct sock_filter *code = malloc(sizeof(struct sock_filter) * (2 * num_cpus + 2));
+  if (code == NULL) return -1;
+  int length = 0;
+  code[length++] = (struct sock_filter)
+      BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_CPU);
+  int i;
+  for (i = 0; i < num_cpus; i++) {
+    code[length++] = (struct sock_filter) BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, cpus[i], 0, 1);
+    code[length++] = (struct sock_filter) BPF_STMT(BPF_RET | BPF_K, i % num_sockets);
+  }
+  code[length++] = (struct sock_filter) BPF_STMT(BPF_RET | BPF_K, num_sockets);
+  struct sock_fprog program = { length, code };
+
+  int result = setsockopt(sockets[0], SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &program,
+      sizeof(program));
+  free(code);
+
+  /* SO_INCOMING_CPU is only a hint here, for lookups that do not go through
+   * the program: the first CPU of each socket's share. */
+  for (i = 0; result == 0 && i < num_sockets; i++) {
+    int cpu = cpus[i % num_cpus];
+    setsockopt(sockets[i], SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu));
+  }
+  return result;
+}
@@ -0,0 +1,45 @@
+#ifndef __AFFINITY__
+#define __AFFINITY__
+
+#include <sched.h>
+
+/* AFFINITY places the server's threads on CPUs. Left alone, the scheduler
+ * moves a thread to whichever core is free, and the connections it serves
+ * (their socket buffers, request buffers and connection structs) have to
+ * follow it from one L2 cache to the next.
+ *
+ * Once a CPU list is given, the threads of every kind (acceptors, worker
+ * pools, event loops, relays) are split into shares: thread or pool I of N
+ * gets the I-th of N slices of the list, a single CPU when there are at
+ * least as many threads as CPUs. Event loops and acceptors set themselves
+ * up only once they run where they belong, and workers are created on
+ * their CPUs, so under the kernel's default first-touch policy their
+ * buffers are allocated on the local NUMA node, without libnuma.
+ *
+ * Steering goes one step further: with a listening socket per share, the
+ * kernel is told to hand each connection to the socket of the share that
+ * includes the CPU that received its packets (the CPU RSS picked for the
+ * flow), so that the connection is served where it came in. */
+
+/* Pins threads to the CPUs in CPU_LIST ("0-3,8,10-11"), or to all the CPUs
+ * the process may run on with "all". Returns -1 if the list is malformed or
+ * names a CPU the process may not run on. */
+int affinity_init(char *cpu_list);
+
+/* How many CPUs threads are pinned to; 0 if they are not pinned. */
+int affinity_num_cpus();
+
+/* The CPUs of share SHARE of NUM_SHARES. */
+void affinity_share(int share, int num_shares, cpu_set_t *cpus);
+
+/* Pins the calling thread to share SHARE of NUM_SHARES, if threads are
+ * pinned. */
+void affinity_pin(int share, int num_shares);
+
+/* Has the kernel hand connections on the SO_REUSEPORT group of SOCKETS to
+ * the socket whose share (of NUM_SOCKETS) includes the CPU that received
+ * them. The sockets must have been put in listening state in order. Returns
+ * -1 on failure. */
+int affinity_steer(int *sockets, int num_sockets);
+
+#endif
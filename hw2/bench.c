@@ -0,0 +1,675 @@
+/*
+ * httpbench: a load generator for httpserver, and a stub upstream for
+ * benchmarking it in --proxy mode.
+ *
+ *   ./httpbench --port 8000 [--host 127.0.0.1] [--path /] [--threads 4]
+ *               [--connections 64] [--duration-s 10] [--warmup-s 1]
+ *               [--rate 0] [--label name] [--format json|text]
+ *   ./httpbench --stub-upstream 8001 [--body-size 1024] [--threads 2]
+ *
+ * Every connection is kept alive and has at most one request outstanding.
+ * With --rate 0 the load is a closed loop: a connection sends its next
+ * request as soon as the last response is in, so the server sets the pace.
+ * With --rate RPS it is an open loop: requests are due at fixed intervals
+ * whatever the server does, and a request that has to wait for a free
+ * connection is timed from when it was due, so a stalled server shows up in
+ * the latencies instead of just slowing the generator down.
+ *
+ * Latencies are kept in log-linear histograms (about 3% precision) per
+ * thread and merged at the end. The report is a single JSON object per run,
+ * or a human-readable summary with --format text.
+ */
+
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_HEADER_MAX_SIZE 8192
+#define BENCH_READ_SIZE 65536
+#define BENCH_MAX_EVENTS 64
+
+/* Values below 2^HISTOGRAM_PRECISION are counted exactly, larger ones in
+ * 2^HISTOGRAM_PRECISION sub-buckets per power of two. */
+#define HISTOGRAM_PRECISION 5
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_PRECISION)
+#define HISTOGRAM_SIZE (64 * HISTOGRAM_SUB_BUCKETS)
+
+struct histogram {
+  unsigned long counts[HISTOGRAM_SIZE];
+  unsigned long total;
+  double sum;
+  long max;
+};
+
+enum {
+  BODY_NONE,
+  BODY_LENGTH,              /* BODY_LEFT more bytes. */
+  BODY_CHUNK_SIZE,          /* In a chunk size line. */
+  BODY_CHUNK_DATA,          /* BODY_LEFT more bytes of chunk, then its CRLF. */
+  BODY_CHUNK_LAST,          /* After the last chunk, until the empty line. */
+  BODY_UNTIL_CLOSE,
+};
+
+struct bench_connection {
+  int fd;
+  int busy;                 /* A request is outstanding. */
+  long start_us;            /* When it was due (open loop) or sent. */
+  char header[BENCH_HEADER_MAX_SIZE];
+  size_t header_length;
+  size_t head_length;       /* Of the complete head, up to the empty line. */
+  int header_done;
+  int status_code;
+  int keep_alive;
+  int body_state;
+  size_t body_left;
+  size_t chunk_line;        /* Characters seen on a chunk size line. */
+};
+
+struct bench_thread {
+  pthread_t thread;
+  struct bench_connection *connections;
+  int num_connections;
+  long interval_us;         /* Between due requests in the open loop, or 0. */
+  struct histogram histogram;
+  unsigned long requests;
+  unsigned long errors;
+  unsigned long bytes;
+};
+
+/* Configuration, set from the command line. */
+char *bench_host = "127.0.0.1";
+int bench_port;
+char *bench_path = "/";
+int bench_threads = 4;
+int bench_connections = 64;
+long bench_duration_s = 10;
+long bench_warmup_s = 1;
+long bench_rate;
+char *bench_label = "bench";
+int bench_text_format;
+int stub_port;
+size_t stub_body_size = 1024;
+
+struct sockaddr_in bench_address;
+char bench_request[1024];
+size_t bench_request_length;
+long bench_measure_from_us;
+long bench_end_us;
+
+static long now_us() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static int histogram_index(long value) {
+  if (value < HISTOGRAM_SUB_BUCKETS) return value < 0 ? 0 : value;
+  int exponent = 63 - __builtin_clzl(value);
+  int sub_bucket = (value >> (exponent - HISTOGRAM_PRECISION)) & (HISTOGRAM_SUB_BUCKETS - 1);
+  return (exponent - HISTOGRAM_PRECISION + 1) * HISTOGRAM_SUB_BUCKETS + sub_bucket;
+}
+
+/* The largest value that falls in bucket INDEX. */
+static long histogram_bucket_value(int index) {
+  if (index < HISTOGRAM_SUB_BUCKETS) return index;
+  int exponent = index / HISTOGRAM_SUB_BUCKETS + HISTOGRAM_PRECISION - 1;
+  long sub_bucket = index % HISTOGRAM_SUB_BUCKETS;
+  return ((HISTOGRAM_SUB_BUCKETS + sub_bucket + 1) << (exponent - HISTOGRAM_PRECISION)) - 1;
+}
+
+static void histogram_record(struct histogram *histogram, long value) {
+  histogram->counts[histogram_index(value)]++;
+  histogram->total++;
+  histogram->sum += value;
+  if (value > histogram->max) histogram->max = value;
+}
+
+static void histogram_merge(struct histogram *into, struct histogram *from) {
+  int i;
+  for (i = 0; i < HISTOGRAM_SIZE; i++) into->counts[i] += from->counts[i];
+  into->total += from->total;
+  into->sum += from->sum;
+  if (from->max > into->max) into->max = from->max;
+}
+
+static long histogram_percentile(struct histogram *histogram, double percentile) {
+  unsigned long rank = (unsigned long) (percentile / 100 * histogram->total + 0.5);
+  if (rank == 0) rank = 1;
+  unsigned long seen = 0;
+  int i;
+  for (i = 0; i < HISTOGRAM_SIZE; i++) {
+    seen += histogram->counts[i];
+    if (seen >= rank) {
+      long value = histogram_bucket_value(i);
+      return value < histogram->max ? value : histogram->max;
+    }
+  }
+  return histogram->max;
+}
+
+/* Opens a keep-alive connection to the server. Returns 0 on failure. */
+static int connection_open(struct bench_connection *connection, int epoll_fd) {
+  connection->fd = socket(PF_INET, SOCK_STREAM, 0);
+  if (connection->fd == -1) return 0;
+  int one = 1;
+  setsockopt(connection->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  if (connect(connection->fd, (struct sockaddr *) &bench_address, sizeof(bench_address)) == -1
+      || fcntl(connection->fd, F_SETFL, O_NONBLOCK) == -1) {
+    close(connection->fd);
+    connection->fd = -1;
+    return 0;
+  }
+  struct epoll_event event = { .events = EPOLLIN, .data.ptr = connection };
+  epoll_ctl(epoll_fd, EPOLL_CTL_ADD, connection->fd, &event);
+  connection->busy = 0;
+  return 1;
+}
+
+static void connection_reopen(struct bench_connection *connection, int epoll_fd) {
+  close(connection->fd);
+  connection->fd = -1;
+  connection->busy = 0;
+  connection_open(connection, epoll_fd);
+}
+
+/* Sends the request, due at START_US. Returns 0 on failure. */
+static int connection_send(struct bench_connection *connection, long start_us) {
+  if (connection->fd == -1) return 0;
+  connection->busy = 1;
+  connection->start_us = start_us;
+  connection->header_length = 0;
+  connection->header_done = 0;
+  connection->body_state = BODY_NONE;
+  return send(connection->fd, bench_request, bench_request_length, MSG_NOSIGNAL)
+      == (ssize_t) bench_request_length;
+}
+
+/* Parses the response head once it is complete. Returns 0 if it is not. */
+static int connection_parse_head(struct bench_connection *connection) {
+  char *end = memmem(connection->header, connection->header_length, "\r\n\r\n", 4);
+  if (end == NULL) return 0;
+  connection->head_length = end + 4 - connection->header;
+  *end = '\0';
+
+  connection->status_code = 0;
+  sscanf(connection->header, "HTTP/%*d.%*d %d", &connection->status_code);
+  connection->keep_alive = strncmp(connection->header, "HTTP/1.1", 8) == 0;
+  connection->body_state = BODY_UNTIL_CLOSE;
+  if (connection->status_code == 204 || connection->status_code == 304)
+    connection->body_state = BODY_NONE;
+
+  char *save_pointer;
+  char *line = strtok_r(connection->header, "\r\n", &save_pointer);
+  while ((line = strtok_r(NULL, "\r\n", &save_pointer)) != NULL) {
+    if (strncasecmp(line, "Content-Length:", 15) == 0
+        && connection->body_state == BODY_UNTIL_CLOSE) {
+      connection->body_left = strtoul(line + 15, NULL, 10);
+      connection->body_state = connection->body_left > 0 ? BODY_LENGTH : BODY_NONE;
+    } else if (strncasecmp(line, "Transfer-Encoding:", 18) == 0 && strcasestr(line, "chunked")) {
+      connection->body_state = BODY_CHUNK_SIZE;
+      connection->body_left = 0;
+      connection->chunk_line = 0;
+    } else if (strncasecmp(line, "Connection:", 11) == 0) {
+      if (strcasestr(line, "close")) connection->keep_alive = 0;
+      if (strcasestr(line, "keep-alive")) connection->keep_alive = 1;
+    }
+  }
+  return 1;
+}
+
+/* Feeds LENGTH body bytes at DATA to the body parser. Returns 1 once the
+ * body is complete. */
+static int connection_consume_body(struct bench_connection *connection, char *data,
+    size_t length) {
+  while (length > 0 || connection->body_state == BODY_NONE) {
+    switch (connection->body_state) {
+      case BODY_NONE:
+        return 1;
+
+      case BODY_LENGTH: {
+        size_t taken = length < connection->body_left ? length : connection->body_left;
+        connection->body_left -= taken;
+        data += taken;
+        length -= taken;
+        if (connection->body_left == 0) connection->body_state = BODY_NONE;
+        break;
+      }
+
+      case BODY_CHUNK_SIZE:
+        if (*data == '\n') {
+          connection->body_state = connection->body_left > 0 ? BODY_CHUNK_DATA : BODY_CHUNK_LAST;
+          connection->body_left += 2;   /* The CRLF after the data. */
+          connection->chunk_line = 0;
+        } else if (connection->chunk_line++ < 16 && ((*data >= '0' && *data <= '9')
+              || (*data >= 'a' && *data <= 'f') || (*data >= 'A' && *data <= 'F'))) {
+          int digit = *data <= '9' ? *data - '0' : (*data | 0x20) - 'a' + 10;
+          connection->body_left = connection->body_left * 16 + digit;
+        } else {
+          /* Extensions and the CR; the digits are over. */
+          connection->chunk_line = 16;
+        }
+        data++;
+        length--;
+        break;
+
+      case BODY_CHUNK_DATA: {
+        size_t taken = length < connection->body_left ? length : connection->body_left;
+        connection->body_left -= taken;
+        data += taken;
+        length -= taken;
+        if (connection->body_left == 0) connection->body_state = BODY_CHUNK_SIZE;
+        break;
+      }
+
+      case BODY_CHUNK_LAST: {
+        /* The empty line that ends the (assumed empty) trailer. */
+        size_t taken = length < connection->body_left ? length : connection->body_left;
+        connection->body_left -= taken;
+        data += taken;
+        length -= taken;
+        if (connection->body_left == 0) connection->body_state = BODY_NONE;
+        break;
+      }
+
+      case BODY_UNTIL_CLOSE:
+        return 0;
+    }
+  }
+  return 0;
+}
+
+static void connection_complete(struct bench_thread *thread,
+    struct bench_connection *connection, long now) {
+  int ok = connection->status_code >= 200 && connection->status_code < 400;
+  if (connection->start_us >= bench_measure_from_us) {
+    if (ok) {
+      thread->requests++;
+      histogram_record(&thread->histogram, now - connection->start_us);
+    } else {
+      thread->errors++;
+    }
+  }
+  connection->busy = 0;
+}
+
+/* Reads whatever arrived on CONNECTION. */
+static void connection_read(struct bench_thread *thread, struct bench_connection *connection,
+    int epoll_fd, char *buffer) {
+  ssize_t bytes_read = recv(connection->fd, buffer, BENCH_READ_SIZE, 0);
+  if (bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+  long now = now_us();
+
+  if (bytes_read <= 0) {
+    if (connection->busy && connection->header_done
+        && connection->body_state == BODY_UNTIL_CLOSE) {
+      connection_complete(thread, connection, now);
+    } else if (connection->busy && connection->start_us >= bench_measure_from_us) {
+      thread->errors++;
+    }
+    connection_reopen(connection, epoll_fd);
+    return;
+  }
+  if (connection->start_us >= bench_measure_from_us) thread->bytes += bytes_read;
+  if (!connection->busy) return;
+
+  char *data = buffer;
+  size_t length = bytes_read;
+  if (!connection->header_done) {
+    size_t room = BENCH_HEADER_MAX_SIZE - 1 - connection->header_length;
+    size_t copied = length < room ? length : room;
+    size_t old_length = connection->header_length;
+    memcpy(connection->header + old_length, data, copied);
+    connection->header_length += copied;
+    if (!connection_parse_head(connection)) {
+      if (connection->header_length == BENCH_HEADER_MAX_SIZE - 1) {
+        thread->errors++;
+        connection_reopen(connection, epoll_fd);
+      }
+      return;
+    }
+    connection->header_done = 1;
+    data += connection->head_length - old_length;
+    length -= connection->head_length - old_length;
+  }
+
+  if (connection_consume_body(connection, data, length)) {
+    connection_complete(thread, connection, now);
+    if (!connection->keep_alive) connection_reopen(connection, epoll_fd);
+  }
+}
+
+static void *bench_thread_run(void *argument) {
+  struct bench_thread *thread = argument;
+  char *buffer = malloc(BENCH_READ_SIZE);
+  int epoll_fd = epoll_create1(0);
+  int timer_fd = -1;
+  if (buffer == NULL || epoll_fd == -1) {
+    perror("Failed to set up a load generator thread");
+    exit(errno);
+  }
+
+  int i;
+  for (i = 0; i < thread->num_connections; i++) {
+    if (!connection_open(&thread->connections[i], epoll_fd)) {
+      perror("Failed to connect to the server");
+      exit(errno);
+    }
+  }
+
+  /* The open loop wakes up whenever the next request is due. */
+  long next_due_us = now_us();
+  if (thread->interval_us > 0) {
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    struct epoll_event event = { .events = EPOLLIN, .data.ptr = NULL };
+    epoll_ctl(epoll_fd, EPOLL_CTL_ADD, timer_fd, &event);
+  }
+
+  struct epoll_event events[BENCH_MAX_EVENTS];
+  long now;
+  while ((now = now_us()) < bench_end_us) {
+    for (i = 0; i < thread->num_connections; i++) {
+      struct bench_connection *connection = &thread->connections[i];
+      if (connection->busy || connection->fd == -1) continue;
+      long start_us = now;
+      if (thread->interval_us > 0) {
+        if (next_due_us > now) break;
+        start_us = next_due_us;
+        next_due_us += thread->interval_us;
+      }
+      if (!connection_send(connection, start_us)) {
+        if (start_us >= bench_measure_from_us) thread->errors++;
+        connection_reopen(connection, epoll_fd);
+      }
+    }
+
+    if (timer_fd != -1) {
+      long due_in_us = next_due_us > now ? next_due_us - now : 1;
+      struct itimerspec timer = {
+        .it_value = { .tv_sec = due_in_us / 1000000, .tv_nsec = due_in_us % 1000000 * 1000 },
+      };
+      timerfd_settime(timer_fd, 0, &timer, NULL);
+    }
+
+    long timeout_ms = (bench_end_us - now) / 1000 + 1;
+    int num_events = epoll_wait(epoll_fd, events, BENCH_MAX_EVENTS, timeout_ms);
+    for (i = 0; i < num_events; i++) {
+      if (events[i].data.ptr == NULL) {
+        unsigned long long expirations;
+        if (read(timer_fd, &expirations, sizeof(expirations)) < 0) continue;
+        continue;
+      }
+      connection_read(thread, events[i].data.ptr, epoll_fd, buffer);
+    }
+  }
+
+  for (i = 0; i < thread->num_connections; i++)
+    if (thread->connections[i].fd != -1) close(thread->connections[i].fd);
+  if (timer_fd != -1) close(timer_fd);
+  close(epoll_fd);
+  free(buffer);
+  return NULL;
+}
+
+static void bench_report(struct bench_thread *threads) {
+  static struct histogram histogram;
+  unsigned long requests = 0, errors = 0, bytes = 0;
+  int i;
+  for (i = 0; i < bench_threads; i++) {
+    histogram_merge(&histogram, &threads[i].histogram);
+    requests += threads[i].requests;
+    errors += threads[i].errors;
+    bytes += threads[i].bytes;
+  }
+
+  double seconds = (bench_end_us - bench_measure_from_us) / 1e6;
+  double mean = histogram.total > 0 ? histogram.sum / histogram.total : 0;
+  long p50 = histogram_percentile(&histogram, 50);
+  long p90 = histogram_percentile(&histogram, 90);
+  long p99 = histogram_percentile(&histogram, 99);
+  long p999 = histogram_percentile(&histogram, 99.9);
+
+  if (bench_text_format) {
+    printf("%s: %s loop, %d connections, %d threads, %.1fs\n", bench_label,
+        bench_rate > 0 ? "open" : "closed", bench_connections, bench_threads, seconds);
+    printf("  %lu requests, %lu errors, %.1f requests/s, %.1f MB/s\n", requests, errors,
+        requests / seconds, bytes / seconds / 1e6);
+    printf("  latency us: mean %.1f, p50 %ld, p90 %ld, p99 %ld, p999 %ld, max %ld\n",
+        mean, p50, p90, p99, p999, histogram.max);
+    return;
+  }
+  printf("{\"label\": \"%s\", \"loop\": \"%s\", \"rate\": %ld, \"connections\": %d, "
+      "\"threads\": %d, \"path\": \"%s\", \"duration_s\": %.3f, \"requests\": %lu, "
+      "\"errors\": %lu, \"throughput_rps\": %.1f, \"bytes_per_s\": %.0f, "
+      "\"latency_us\": {\"mean\": %.1f, \"p50\": %ld, \"p90\": %ld, \"p99\": %ld, "
+      "\"p999\": %ld, \"max\": %ld}}\n",
+      bench_label, bench_rate > 0 ? "open" : "closed", bench_rate, bench_connections,
+      bench_threads, bench_path, seconds, requests, errors, requests / seconds,
+      bytes / seconds, mean, p50, p90, p99, p999, histogram.max);
+}
+
+static void bench_run() {
+  struct hostent *host = gethostbyname(bench_host);
+  if (host == NULL) {
+    fprintf(stderr, "Cannot find host: %s\n", bench_host);
+    exit(ENXIO);
+  }
+  memset(&bench_address, 0, sizeof(bench_address));
+  bench_address.sin_family = AF_INET;
+  bench_address.sin_port = htons(bench_port);
+  memcpy(&bench_address.sin_addr, host->h_addr_list[0], sizeof(bench_address.sin_addr));
+
+  bench_request_length = snprintf(bench_request, sizeof(bench_request),
+      "GET %s HTTP/1.1\r\nHost: %s:%d\r\nUser-Agent: httpbench\r\n\r\n",
+      bench_path, bench_host, bench_port);
+
+  if (bench_connections < bench_threads) bench_threads = bench_connections;
+  struct bench_thread *threads = calloc(bench_threads, sizeof(struct bench_thread));
+  struct bench_connection *connections = calloc(bench_connections,
+      sizeof(struct bench_connection));
+  if (threads == NULL || connections == NULL) {
+    perror("Failed to allocate the load generator");
+    exit(errno);
+  }
+
+  long start_us = now_us();
+  bench_measure_from_us = start_us + bench_warmup_s * 1000000;
+  bench_end_us = bench_measure_from_us + bench_duration_s * 1000000;
+
+  int i, assigned = 0;
+  for (i = 0; i < bench_threads; i++) {
+    struct bench_thread *thread = &threads[i];
+    thread->num_connections = (bench_connections - assigned) / (bench_threads - i);
+    thread->connections = connections + assigned;
+    assigned += thread->num_connections;
+    if (bench_rate > 0) thread->interval_us = 1000000L * bench_threads / bench_rate;
+    if (thread->interval_us == 0 && bench_rate > 0) thread->interval_us = 1;
+    pthread_create(&thread->thread, NULL, bench_thread_run, thread);
+  }
+  for (i = 0; i < bench_threads; i++) pthread_join(threads[i].thread, NULL);
+
+  bench_report(threads);
+}
+
+/*
+ * The stub upstream answers every request it reads with the same
+ * stub_body_size bytes, over kept-alive connections, so that a proxy
+ * benchmark measures the proxy and not its backend.
+ */
+char *stub_response;
+size_t stub_response_length;
+
+struct stub_connection {
+  int fd;
+  int matched;              /* Characters of "\r\n\r\n" seen last. */
+};
+
+static void *stub_thread_run(void *argument) {
+  int server_fd = socket(PF_INET, SOCK_STREAM, 0);
+  int one = 1;
+  setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+  struct sockaddr_in address = {
+    .sin_family = AF_INET,
+    .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    .sin_port = htons(stub_port),
+  };
+  int epoll_fd = epoll_create1(0);
+  if (bind(server_fd, (struct sockaddr *) &address, sizeof(address)) == -1
+      || listen(server_fd, 1024) == -1 || epoll_fd == -1) {
+    perror("Failed to start the stub upstream");
+    exit(errno);
+  }
+  struct epoll_event event = { .events = EPOLLIN, .data.ptr = NULL };
+  epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_fd, &event);
+
+  char buffer[BENCH_READ_SIZE];
+  struct epoll_event events[BENCH_MAX_EVENTS];
+  while (1) {
+    int num_events = epoll_wait(epoll_fd, events, BENCH_MAX_EVENTS, -1);
+    int i;
+    for (i = 0; i < num_events; i++) {
+      if (events[i].data.ptr == NULL) {
+        int client_fd = accept(server_fd, NULL, NULL);
+        struct stub_connection *connection = calloc(1, sizeof(struct stub_connection));
+        if (client_fd == -1 || connection == NULL) {
+          if (client_fd != -1) close(client_fd);
+          free(connection);
+          continue;
+        }
+        setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        connection->fd = client_fd;
+        struct epoll_event client_event = { .events = EPOLLIN, .data.ptr = connection };
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_fd, &client_event);
+        continue;
+      }
+
+      /* Responses are small, so they are written with blocking sends. */
+      struct stub_connection *connection = events[i].data.ptr;
+      ssize_t bytes_read = recv(connection->fd, buffer, sizeof(buffer), 0);
+      if (bytes_read <= 0) {
+        close(connection->fd);
+        free(connection);
+        continue;
+      }
+      ssize_t j;
+      for (j = 0; j < bytes_read; j++) {
+        char expected = "\r\n\r\n"[connection->matched];
+        if (buffer[j] == expected) {
+          connection->matched++;
+        } else {
+          connection->matched = buffer[j] == '\r';
+        }
+        if (connection->matched == 4) {
+          connection->matched = 0;
+          send(connection->fd, stub_response, stub_response_length, MSG_NOSIGNAL);
+        }
+      }
+    }
+  }
+  return NULL;
+}
+
+static void stub_run() {
+  char header[256];
+  int header_length = snprintf(header, sizeof(header),
+      "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nContent-Length: %zu\r\n"
+      "Connection: keep-alive\r\n\r\n", stub_body_size);
+  stub_response_length = header_length + stub_body_size;
+  stub_response = malloc(stub_response_length);
+  if (stub_response == NULL) {
+    perror("Failed to allocate the stub response");
+    exit(errno);
+  }
+  memcpy(stub_response, header, header_length);
+  memset(stub_response + header_length, 'x', stub_body_size);
+
+  pthread_t *threads = calloc(bench_threads, sizeof(pthread_t));
+  int i;
+  for (i = 0; i < bench_threads; i++) pthread_create(&threads[i], NULL, stub_thread_run, NULL);
+  for (i = 0; i < bench_threads; i++) pthread_join(threads[i], NULL);
+}
+
+char *USAGE =
+  "Usage: ./httpbench --port 8000 [--host 127.0.0.1] [--path /] [--threads 4]\n"
+  "                   [--connections 64] [--duration-s 10] [--warmup-s 1]\n"
+  "                   [--rate 0] [--label name] [--format json|text]\n"
+  "       ./httpbench --stub-upstream 8001 [--body-size 1024] [--threads 2]\n";
+
+void exit_with_usage() {
+  fprintf(stderr, "%s", USAGE);
+  exit(EXIT_SUCCESS);
+}
+
+/* Parses the integer after option ARGV[I], which must be at least MINIMUM. */
+static long parse_number(char **argv, int i, long minimum) {
+  char *end;
+  long value = argv[i + 1] != NULL ? strtol(argv[i + 1], &end, 10) : 0;
+  if (argv[i + 1] == NULL || *end != '\0' || value < minimum) {
+    fprintf(stderr, "Expected an integer of at least %ld after %s\n", minimum, argv[i]);
+    exit_with_usage();
+  }
+  return value;
+}
+
+int main(int argc, char **argv) {
+  signal(SIGPIPE, SIG_IGN);
+
+  int i;
+  for (i = 1; i < argc; i++) {
+    if (strcmp("--host", argv[i]) == 0 && argv[i + 1] != NULL) {
+      bench_host = argv[++i];
+    } else if (strcmp("--port", argv[i]) == 0) {
+      bench_port = parse_number(argv, i++, 1);
+    } else if (strcmp("--path", argv[i]) == 0 && argv[i + 1] != NULL) {
+      bench_path = argv[++i];
+    } else if (strcmp("--threads", argv[i]) == 0) {
+      bench_threads = parse_number(argv, i++, 1);
+    } else if (strcmp("--connections", argv[i]) == 0) {
+      bench_connections = parse_number(argv, i++, 1);
+    } else if (strcmp("--duration-s", argv[i]) == 0) {
+      bench_duration_s = parse_number(argv, i++, 1);
+    } else if (strcmp("--warmup-s", argv[i]) == 0) {
+      bench_warmup_s = parse_number(argv, i++, 0);
+    } else if (strcmp("--rate", argv[i]) == 0) {
+      bench_rate = parse_number(argv, i++, 0);
+    } else if (strcmp("--label", argv[i]) == 0 && argv[i + 1] != NULL) {
+      bench_label = argv[++i];
+    } else if (strcmp("--format", argv[i]) == 0 && argv[i + 1] != NULL) {
+      bench_text_format = strcmp(argv[++i], "text") == 0;
+    } else if (strcmp("--stub-upstream", argv[i]) == 0) {
+      stub_port = parse_number(argv, i++, 1);
+    } else if (strcmp("--body-size", argv[i]) == 0) {
+      stub_body_size = parse_number(argv, i++, 0);
+    } else if (strcmp("--help", argv[i]) == 0) {
+      exit_with_usage();
+    } else {
+      fprintf(stderr, "Unrecognized option: %s\n", argv[i]);
+      exit_with_usage();
+    }
+  }
+
+  if (stub_port != 0) {
+    stub_run();
+  } else if (bench_port != 0) {
+    bench_run();
+  } else {
+    exit_with_usage();
+  }
+  return EXIT_SUCCESS;
+}
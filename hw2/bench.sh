@@ -0,0 +1,92 @@
+#!/bin/bash
+#
+# Benchmarks httpserver with httpbench (see bench.c): a closed-loop and an
+# open-loop run against --files, then the same against --proxy in front of
+# httpbench's stub upstream. Prints one JSON object per run, so the output
+# of two trees can be diffed or compared by a script.
+#
+# With BENCH_AFFINITY set, every run is repeated with those arguments added
+# to httpserver's ("make bench-affinity" passes "--cpus all --incoming-cpu")
+# and "+affinity" added to its label, so that the p99 of each pair shows
+# what pinning threads and steering connections does to the tail. The load
+# generator competes for the same CPUs unless the two are kept apart with
+# BENCH_SERVER_CPUS and BENCH_CLIENT_CPUS.
+#
+# Settings come from the environment:
+#   BENCH_SERVER_ARGS   extra httpserver arguments ("--num-threads 4 --mode epoll";
+#                       in threads mode a kept-alive connection holds a worker)
+#   BENCH_DURATION_S    measured seconds per run (5)
+#   BENCH_CONNECTIONS   concurrent connections (32)
+#   BENCH_THREADS       load generator threads (2)
+#   BENCH_RATE          requests/s of the open-loop runs (2000)
+#   BENCH_PATH          file requested in --files mode (/index.html)
+#   BENCH_PORT          first of the three local ports used (8180)
+#   BENCH_AFFINITY      httpserver arguments of the repeated runs (unset)
+#   BENCH_SERVER_CPUS   CPUs httpserver runs on, for taskset ("0-3"; all)
+#   BENCH_CLIENT_CPUS   CPUs httpbench runs on, for taskset ("4-7"; all)
+
+cd "$(dirname "$0")"
+
+SERVER_ARGS=${BENCH_SERVER_ARGS:---num-threads 4 --mode epoll}
+DURATION_S=${BENCH_DURATION_S:-5}
+CONNECTIONS=${BENCH_CONNECTIONS:-32}
+THREADS=${BENCH_THREADS:-2}
+RATE=${BENCH_RATE:-2000}
+FILE_PATH=${BENCH_PATH:-/index.html}
+FILES_PORT=${BENCH_PORT:-8180}
+STUB_PORT=$((FILES_PORT + 1))
+PROXY_PORT=$((FILES_PORT + 2))
+SERVER=(./httpserver)
+CLIENT=(./httpbench)
+[ -n "$BENCH_SERVER_CPUS" ] && SERVER=(taskset -c "$BENCH_SERVER_CPUS" ./httpserver)
+[ -n "$BENCH_CLIENT_CPUS" ] && CLIENT=(taskset -c "$BENCH_CLIENT_CPUS" ./httpbench)
+
+trap 'kill $(jobs -p) 2>/dev/null' EXIT
+
+wait_for_port() {
+  for i in $(seq 50); do
+    (exec 3<>/dev/tcp/127.0.0.1/$1) 2>/dev/null && return 0
+    sleep 0.1
+  done
+  echo "Nothing is listening on port $1" >&2
+  exit 1
+}
+
+# run LABEL PORT PATH [httpbench arguments...]
+run() {
+  local label=$1 port=$2 path=$3
+  shift 3
+  "${CLIENT[@]}" --port "$port" --path "$path" --label "$label" --threads "$THREADS" \
+      --connections "$CONNECTIONS" --duration-s "$DURATION_S" "$@" || exit 1
+}
+
+# round LABEL_SUFFIX [httpserver arguments...]
+round() {
+  local suffix=$1 servers
+  shift
+
+  "${SERVER[@]}" --files files/ --port "$FILES_PORT" $SERVER_ARGS "$@" > /dev/null &
+  servers=$!
+  wait_for_port "$FILES_PORT"
+  run "files-closed$suffix" "$FILES_PORT" "$FILE_PATH"
+  run "files-open$suffix" "$FILES_PORT" "$FILE_PATH" --rate "$RATE"
+
+  "${SERVER[@]}" --proxy "127.0.0.1:$STUB_PORT" --port "$PROXY_PORT" $SERVER_ARGS "$@" \
+      > /dev/null &
+  servers="$servers $!"
+  wait_for_port "$PROXY_PORT"
+  run "proxy-closed$suffix" "$PROXY_PORT" /
+  run "proxy-open$suffix" "$PROXY_PORT" / --rate "$RATE"
+
+  kill $servers
+  wait $servers 2>/dev/null
+  return 0
+}
+
+"${CLIENT[@]}" --stub-upstream "$STUB_PORT" --threads 2 &
+wait_for_port "$STUB_PORT"
+
+round ""
+if [ -n "$BENCH_AFFINITY" ]; then
+  round "+affinity" $BENCH_AFFINITY
+fi
@@ -0,0 +1,143 @@
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "dir_listing.h"
+#include "file_cache.h"
+#include "gzip.h"
+
+#define DIR_LISTING_INITIAL_SIZE 4096
+
+struct dir_listing {
+  DIR *directory;
+  char *directory_name;
+  int header_rendered;
+  int finished;             /* readdir has run out of entries. */
+  struct dirent *pending;   /* Read, but did not fit in the last buffer. */
+};
+
+static void dir_listing_free(void *data) {
+  struct dir_listing *listing = data;
+  if (listing->directory != NULL) closedir(listing->directory);
+  free(listing->directory_name);
+  free(listing);
+}
+
+/* Renders as many whole lines as fit in BUFFER and returns their length,
+ * which is 0 only once the listing is complete (or if not even one line
+ * fits, which a LIBHTTP_CHUNK_SIZE buffer always does). */
+static size_t dir_listing_produce(void *data, char *buffer, size_t size) {
+  struct dir_listing *listing = data;
+  size_t length = 0;
+  int line_length;
+
+  if (!listing->header_rendered) {
+    line_length = snprintf(buffer, size, " Directory: %s <br> ", listing->directory_name);
+    if (line_length < 0 || (size_t) line_length >= size) return 0;
+    length = line_length;
+    listing->header_rendered = 1;
+  }
+
+  while (!listing->finished) {
+    struct dirent *entry = listing->pending != NULL
+        ? listing->pending : readdir(listing->directory);
+    listing->pending = NULL;
+    if (entry == NULL) {
+      listing->finished = 1;
+      break;
+    }
+
+    line_length = snprintf(buffer + length, size - length, " <a href=\"%s\"> %s </a> <br> ",
+        entry->d_name, strcmp(entry->d_name, "..") ? entry->d_name : "parent");
+    if (line_length < 0 || (size_t) line_length >= size - length) {
+      /* The dirent stays valid until the next readdir. */
+      listing->pending = entry;
+      break;
+    }
+    length += line_length;
+  }
+  return length;
+}
+
+/* Renders the whole listing into one buffer, unless it grows beyond LIMIT. */
+static char *dir_listing_render(struct dir_listing *listing, size_t limit, size_t *length) {
+  size_t capacity = DIR_LISTING_INITIAL_SIZE;
+  char *body = malloc(capacity);
+  *length = 0;
+
+  while (body != NULL) {
+    *length += dir_listing_produce(listing, body + *length, capacity - *length);
+    if (listing->finished) return body;
+    if (capacity >= limit) break;
+
+    char *grown = realloc(body, capacity * 2);
+    if (grown == NULL) break;
+    body = grown;
+    capacity *= 2;
+  }
+  free(body);
+  return NULL;
+}
+
+int dir_listing_respond(char *key, char *directory_name, int gzip, int chunked,
+    struct http_response *response) {
+  struct dir_listing *listing = calloc(1, sizeof(struct dir_listing));
+  if (listing == NULL) return 0;
+
+  /* The directory is stat'ed before it is read, so a listing that races
+   * with a change is cached under the old mtime and soon dropped. */
+  struct stat directory_stat;
+  listing->directory = opendir(directory_name);
+  listing->directory_name = strdup(directory_name);
+  if (listing->directory == NULL || listing->directory_name == NULL
+      || fstat(dirfd(listing->directory), &directory_stat) == -1) {
+    dir_listing_free(listing);
+    return 0;
+  }
+
+  response->status_code = 200;
+  response->content_type = "text/html";
+
+  size_t length;
+  char *body = dir_listing_render(listing, FILE_CACHE_MAX_ENTRY_SIZE, &length);
+  if (body != NULL) {
+    dir_listing_free(listing);
+    char *content_encoding = NULL;
+    if (gzip) {
+      size_t compressed_length;
+      char *compressed = gzip_compress(body, length, &compressed_length);
+      if (compressed != NULL) {
+        free(body);
+        body = compressed;
+        length = compressed_length;
+        content_encoding = "gzip";
+      }
+    }
+
+    /* A listing that could not be compressed is not cached under the gzip
+     * key: the plain one has its own entry. */
+    if ((gzip && content_encoding == NULL)
+        || !file_cache_insert_body(key, directory_name, &directory_stat, "text/html",
+          content_encoding, body, length, response)) {
+      response->body = body;
+      response->body_length = length;
+      response->content_encoding = content_encoding;
+      response->size = directory_stat.st_size;
+      response->last_modified = directory_stat.st_mtim;
+    }
+    return 1;
+  }
+
+  /* Too large to keep around: start over and stream it. */
+  rewinddir(listing->directory);
+  listing->header_rendered = listing->finished = 0;
+  listing->pending = NULL;
+  response->produce = dir_listing_produce;
+  response->chunked = chunked;
+  if (!chunked) response->keep_alive = 0;
+  response->release = dir_listing_free;
+  response->release_data = listing;
+  return 1;
+}
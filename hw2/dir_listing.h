@@ -0,0 +1,21 @@
+#ifndef __DIR_LISTING__
+#define __DIR_LISTING__
+
+#include "libhttp.h"
+
+/* DIR_LISTING renders the page that lists a directory without an index.html.
+ * Lines are rendered straight from readdir into a buffer that grows by
+ * doubling, so a listing costs time linear in the number of entries. A
+ * listing that fits in a file cache entry is kept there, pre-rendered, until
+ * the directory's mtime changes, gzip-compressed for clients that accept
+ * it; a larger one is never held in memory as a whole but streamed in chunks
+ * as readdir yields entries, as it is. */
+
+/* Fills RESPONSE with the listing of DIRECTORY_NAME, cached under KEY.
+ * GZIP says whether the client accepts gzip (KEY must then be the gzip
+ * key), CHUNKED whether it understands chunked transfer encoding. Returns 0
+ * if the directory cannot be read. */
+int dir_listing_respond(char *key, char *directory_name, int gzip, int chunked,
+    struct http_response *response);
+
+#endif
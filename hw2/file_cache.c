@@ -0,0 +1,255 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "file_cache.h"
+#include "utlist.h"
+
+#define FILE_CACHE_NUM_BUCKETS 256
+
+struct file_cache_entry {
+  char *key;
+  char *file_name;
+  unsigned int hash;
+
+  char *body;
+  size_t body_length;
+  char *headers[2];         /* Pre-rendered, indexed by keep-alive. */
+  size_t header_lengths[2];
+  char *content_type;
+  char *content_encoding;
+
+  struct timespec mtime;
+  off_t size;
+  long validated_ms;
+
+  int refcount;             /* One for the shard, one per response using it. */
+  int cached;               /* Still reachable from its shard. */
+  struct file_cache_entry *bucket_next;
+  struct file_cache_entry *prev, *next;   /* LRU order, newest last. */
+};
+
+struct file_cache_shard {
+  pthread_mutex_t mutex;
+  struct file_cache_entry *buckets[FILE_CACHE_NUM_BUCKETS];
+  struct file_cache_entry *lru;
+  size_t size;
+};
+
+static struct file_cache_shard shards[FILE_CACHE_NUM_SHARDS];
+static size_t shard_capacity;
+static long revalidate_interval_ms;
+
+/* CLOCK_MONOTONIC_COARSE is served from the vDSO, so this is not a syscall. */
+static long now_ms() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+  return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static unsigned int hash_string(char *string) {
+  unsigned int hash = 2166136261u;
+  while (*string) {
+    hash ^= (unsigned char) *string++;
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static size_t entry_cost(struct file_cache_entry *entry) {
+  return entry->header_lengths[0] + entry->header_lengths[1] + entry->body_length;
+}
+
+static void entry_release(void *release_data) {
+  struct file_cache_entry *entry = release_data;
+  if (__atomic_sub_fetch(&entry->refcount, 1, __ATOMIC_ACQ_REL) > 0) return;
+  free(entry->key);
+  free(entry->file_name);
+  free(entry->body);
+  free(entry->headers[0]);
+  free(entry->headers[1]);
+  free(entry);
+}
+
+static void entry_fill_response(struct file_cache_entry *entry, struct http_response *response) {
+  response->status_code = 200;
+  response->content_type = entry->content_type;
+  response->content_encoding = entry->content_encoding;
+  response->header = entry->headers[response->keep_alive != 0];
+  response->header_length = entry->header_lengths[response->keep_alive != 0];
+  response->body = entry->body;
+  response->body_length = entry->body_length;
+  response->size = entry->size;
+  response->last_modified = entry->mtime;
+  response->release = entry_release;
+  response->release_data = entry;
+}
+
+static int entry_matches(struct file_cache_entry *entry, struct stat *file_stat) {
+  return entry->size == file_stat->st_size
+      && entry->mtime.tv_sec == file_stat->st_mtim.tv_sec
+      && entry->mtime.tv_nsec == file_stat->st_mtim.tv_nsec;
+}
+
+/* Drops ENTRY from SHARD and releases the shard's reference. Must be called
+ * with the shard locked. */
+static void shard_remove(struct file_cache_shard *shard, struct file_cache_entry *entry) {
+  struct file_cache_entry **bucket = &shard->buckets[entry->hash % FILE_CACHE_NUM_BUCKETS];
+  LL_DELETE2(*bucket, entry, bucket_next);
+  DL_DELETE(shard->lru, entry);
+  shard->size -= entry_cost(entry);
+  entry->cached = 0;
+  entry_release(entry);
+}
+
+static struct file_cache_entry *shard_find(struct file_cache_shard *shard, char *key,
+    unsigned int hash) {
+  struct file_cache_entry *entry = shard->buckets[hash % FILE_CACHE_NUM_BUCKETS];
+  while (entry != NULL && (entry->hash != hash || strcmp(entry->key, key) != 0))
+    entry = entry->bucket_next;
+  return entry;
+}
+
+void file_cache_init(size_t capacity, long revalidate_ms) {
+  shard_capacity = capacity / FILE_CACHE_NUM_SHARDS;
+  revalidate_interval_ms = revalidate_ms;
+
+  int i;
+  for (i = 0; i < FILE_CACHE_NUM_SHARDS; i++) {
+    memset(&shards[i], 0, sizeof(shards[i]));
+    pthread_mutex_init(&shards[i].mutex, NULL);
+  }
+}
+
+int file_cache_lookup(char *key, struct http_response *response) {
+  if (shard_capacity == 0) return 0;
+
+  unsigned int hash = hash_string(key);
+  struct file_cache_shard *shard = &shards[hash % FILE_CACHE_NUM_SHARDS];
+
+  pthread_mutex_lock(&shard->mutex);
+  struct file_cache_entry *entry = shard_find(shard, key, hash);
+  if (entry == NULL) {
+    pthread_mutex_unlock(&shard->mutex);
+    return 0;
+  }
+  DL_DELETE(shard->lru, entry);
+  DL_APPEND(shard->lru, entry);
+  __atomic_add_fetch(&entry->refcount, 1, __ATOMIC_RELAXED);
+  long now = now_ms();
+  int stale = now - entry->validated_ms >= revalidate_interval_ms;
+  pthread_mutex_unlock(&shard->mutex);
+
+  if (stale) {
+    /* Revalidate outside the lock; only this path touches the filesystem. */
+    struct stat file_stat;
+    int fresh = stat(entry->file_name, &file_stat) == 0 && entry_matches(entry, &file_stat);
+
+    pthread_mutex_lock(&shard->mutex);
+    if (fresh) {
+      entry->validated_ms = now;
+    } else if (entry->cached) {
+      shard_remove(shard, entry);
+    }
+    pthread_mutex_unlock(&shard->mutex);
+
+    if (!fresh) {
+      entry_release(entry);
+      return 0;
+    }
+  }
+
+  entry_fill_response(entry, response);
+  return 1;
+}
+
+int file_cache_insert_body(char *key, char *file_name, struct stat *file_stat,
+    char *content_type, char *content_encoding, char *body, size_t body_length,
+    struct http_response *response) {
+  if (shard_capacity == 0 || body_length > FILE_CACHE_MAX_ENTRY_SIZE) return 0;
+
+  struct file_cache_entry *entry = calloc(1, sizeof(struct file_cache_entry));
+  if (entry == NULL) return 0;
+  entry->refcount = 1;
+  entry->content_type = content_type;
+  entry->content_encoding = content_encoding;
+  entry->body_length = body_length;
+
+  struct http_response header_response;
+  char header[LIBHTTP_HEADER_MAX_SIZE];
+  http_response_init(&header_response);
+  header_response.status_code = 200;
+  header_response.content_type = entry->content_type;
+  header_response.content_encoding = entry->content_encoding;
+  header_response.body_length = body_length;
+  header_response.size = file_stat->st_size;
+  header_response.last_modified = file_stat->st_mtim;
+  int keep_alive;
+  for (keep_alive = 0; keep_alive < 2; keep_alive++) {
+    header_response.keep_alive = keep_alive;
+    int header_length = http_format_headers(&header_response, header, sizeof(header));
+    if (header_length < 0) {
+      entry_release(entry);
+      return 0;
+    }
+    entry->headers[keep_alive] = malloc(header_length);
+    if (entry->headers[keep_alive] == NULL) {
+      entry_release(entry);
+      return 0;
+    }
+    memcpy(entry->headers[keep_alive], header, header_length);
+    entry->header_lengths[keep_alive] = header_length;
+  }
+  if (entry_cost(entry) > shard_capacity) {
+    entry_release(entry);
+    return 0;
+  }
+
+  /* From here on the entry owns BODY. */
+  entry->body = body;
+  entry->key = strdup(key);
+  entry->file_name = strdup(file_name);
+  entry->hash = hash_string(key);
+  entry->mtime = file_stat->st_mtim;
+  entry->size = file_stat->st_size;
+  entry->validated_ms = now_ms();
+  entry->refcount = 2;
+  entry->cached = 1;
+
+  struct file_cache_shard *shard = &shards[entry->hash % FILE_CACHE_NUM_SHARDS];
+  pthread_mutex_lock(&shard->mutex);
+  struct file_cache_entry *existing = shard_find(shard, key, entry->hash);
+  if (existing != NULL) shard_remove(shard, existing);
+  while (shard->lru != NULL && shard->size + entry_cost(entry) > shard_capacity)
+    shard_remove(shard, shard->lru);
+  LL_PREPEND2(shard->buckets[entry->hash % FILE_CACHE_NUM_BUCKETS], entry, bucket_next);
+  DL_APPEND(shard->lru, entry);
+  shard->size += entry_cost(entry);
+  pthread_mutex_unlock(&shard->mutex);
+
+  entry_fill_response(entry, response);
+  return 1;
+}
+
+int file_cache_insert(char *key, char *file_name, int file_fd, struct stat *file_stat,
+    char *content_type, char *content_encoding, struct http_response *response) {
+  size_t body_length = file_stat->st_size;
+  if (shard_capacity == 0 || body_length > FILE_CACHE_MAX_ENTRY_SIZE) return 0;
+
+  char *body = malloc(body_length);
+  size_t bytes_read = 0;
+  while (body != NULL && bytes_read < body_length) {
+    ssize_t result = pread(file_fd, body + bytes_read, body_length - bytes_read, bytes_read);
+    if (result <= 0) break;
+    bytes_read += result;
+  }
+  if (body == NULL || bytes_read < body_length
+      || !file_cache_insert_body(key, file_name, file_stat, content_type, content_encoding,
+        body, body_length, response)) {
+    free(body);
+    return 0;
+  }
+  return 1;
+}
@@ -0,0 +1,41 @@
+#ifndef __FILE_CACHE__
+#define __FILE_CACHE__
+
+#include <stddef.h>
+#include <sys/stat.h>
+
+#include "libhttp.h"
+
+/* FILE_CACHE keeps small, frequently requested files in memory together with
+ * their MIME type, validators and a pre-rendered "200 OK" header block, so a
+ * repeat hit is answered with a single write. Entries are keyed by the requested path
+ * (before index.html resolution) and spread over independently locked
+ * shards. An entry is re-checked against the file's mtime and size at most
+ * once per revalidation interval; in between, hits make no syscalls. */
+
+#define FILE_CACHE_NUM_SHARDS 16
+#define FILE_CACHE_DEFAULT_SIZE (32 * 1024 * 1024)
+#define FILE_CACHE_MAX_ENTRY_SIZE (256 * 1024)
+#define FILE_CACHE_DEFAULT_REVALIDATE_MS 1000
+
+/* Sizes the cache. A CAPACITY of 0 disables it. */
+void file_cache_init(size_t capacity, long revalidate_ms);
+
+/* Fills RESPONSE from the cache entry for KEY. Returns 0 on a miss. */
+int file_cache_lookup(char *key, struct http_response *response);
+
+/* Caches the regular file FILE_NAME (already open as FILE_FD and described by
+ * FILE_STAT) under KEY, to be served as CONTENT_TYPE and CONTENT_ENCODING
+ * (NULL for none), and fills RESPONSE from the new entry. Returns 0 if the
+ * file is not cacheable, leaving RESPONSE and FILE_FD untouched. */
+int file_cache_insert(char *key, char *file_name, int file_fd, struct stat *file_stat,
+    char *content_type, char *content_encoding, struct http_response *response);
+
+/* Like file_cache_insert, for a BODY that was generated from FILE_NAME (a
+ * directory listing, say) and goes stale when FILE_NAME changes. On success
+ * the cache takes ownership of BODY, which must come from malloc. */
+int file_cache_insert_body(char *key, char *file_name, struct stat *file_stat,
+    char *content_type, char *content_encoding, char *body, size_t body_length,
+    struct http_response *response);
+
+#endif
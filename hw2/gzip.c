@@ -0,0 +1,37 @@
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "gzip.h"
+
+char *gzip_compress(char *data, size_t length, size_t *compressed_length) {
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  /* 16 on top of the window bits asks for a gzip header and trailer. */
+  if (deflateInit2(&stream, GZIP_LEVEL, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+    return NULL;
+
+  /* deflateBound is enough for a single Z_FINISH call. */
+  size_t bound = deflateBound(&stream, length);
+  char *compressed = malloc(bound);
+  if (compressed == NULL) {
+    deflateEnd(&stream);
+    return NULL;
+  }
+
+  stream.next_in = (Bytef *) data;
+  stream.avail_in = length;
+  stream.next_out = (Bytef *) compressed;
+  stream.avail_out = bound;
+  int status = deflate(&stream, Z_FINISH);
+  *compressed_length = stream.total_out;
+  deflateEnd(&stream);
+  if (status != Z_STREAM_END) {
+    free(compressed);
+    return NULL;
+  }
+
+  /* The body may stay cached for a long time; give back the slack. */
+  char *shrunk = realloc(compressed, *compressed_length > 0 ? *compressed_length : 1);
+  return shrunk != NULL ? shrunk : compressed;
+}
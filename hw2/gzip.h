@@ -0,0 +1,17 @@
+#ifndef __GZIP__
+#define __GZIP__
+
+#include <stddef.h>
+
+/* GZIP compresses response bodies for clients that accept gzip. Bodies are
+ * compressed whole, so only files up to GZIP_MAX_SOURCE_SIZE are; larger
+ * ones are sent as they are, with sendfile. */
+
+#define GZIP_MAX_SOURCE_SIZE (1024 * 1024)
+#define GZIP_LEVEL 6
+
+/* Returns LENGTH bytes of DATA as a gzip stream in a new buffer from malloc,
+ * and its length in *COMPRESSED_LENGTH, or NULL on failure. */
+char *gzip_compress(char *data, size_t length, size_t *compressed_length);
+
+#endif
@@ -1,9 +1,12 @@
+#define _GNU_SOURCE
+
 #include <arpa/inet.h>
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <poll.h>
 #include <pthread.h>
 #include <signal.h>
 #include <stdio.h>
@@ -14,15 +17,28 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#include "access_log.h"
+#include "admission.h"
+#include "affinity.h"
+#include "dir_listing.h"
+#include "file_cache.h"
+#include "gzip.h"
 #include "libhttp.h"
-#include "wq.h"
-// for debug
-int finished;
-pthread_mutex_t mutex; 	
-
-struct proxy_node {
-  int from;
-  int to;
+#include "metrics.h"
+#include "mime.h"
+#include "pool.h"
+#include "proxy_cache.h"
+#include "reactor.h"
+#include "relay.h"
+#include "timer_wheel.h"
+#include "upstream.h"
+#include "uring.h"
+
+struct acceptor {
+  int socket_number;
+  pool_t *pool;
+  int index;
+  int cpu;              /* CPU the acceptor thread is pinned to, or -1. */
 };
 
 /*
@@ -31,30 +47,141 @@ struct proxy_node {
  * handle_proxy_request. Their values are set up in main() using the
  * command line arguments (already implemented for you).
  */
-wq_t work_queue;
+#define SERVER_MODE_THREADS 0
+#define SERVER_MODE_EPOLL 1
+#define SERVER_MODE_URING 2
+
+pool_t **work_pools;
+int pool_balance;
+size_t queue_limit;
+long queue_target_ms;
+long queue_interval_ms;
+int rate_limit;
+int rate_burst;
+int num_acceptors;
+char *cpu_list;
+int incoming_cpu;
+int num_relay_threads;
+int server_mode;
 int num_threads;
+int min_threads;
+int max_threads;
+long pool_idle_ms;
 int server_port;
 char *server_files_directory;
-char *server_proxy_hostname;
-int server_proxy_port;
+char *mime_types_file;
+char *access_log_file;
+int access_log_sample_rate;
+size_t file_cache_size;
+long file_cache_revalidate_ms;
+int upstream_balance;
+long upstream_dns_ttl_ms;
+int upstream_pool_size;
+long upstream_max_latency_ms;
+long upstream_eject_ms;
+size_t proxy_cache_size;
+char *proxy_cache_directory;
+size_t proxy_cache_disk_size;
+
 
 
+#define NOT_FOUND_PAGE \
+    "<center>" \
+    "<h1> 404 </h1>" \
+    "<hr>" \
+    "<p> File Not Found </p>" \
+    "</center>"
+
+#define BAD_REQUEST_PAGE "<center><h1>400 Bad Request</h1><hr></center>"
+
+#define BAD_GATEWAY_PAGE "<center><h1>502 Bad Gateway</h1><hr></center>"
+
+void not_found_error(struct http_response *response) {
+  response->status_code = 404;
+  response->content_type = "text/html";
+  response->body = strdup(NOT_FOUND_PAGE);
+  response->body_length = strlen(response->body);
+}
 
-void not_found_error(int fd) {
-	http_start_response(fd, 404);
-	http_send_header(fd, "Content-Type", "text/html");
-	http_end_headers(fd);
-  http_send_string(fd,
-    "<center>"
-    "<h1> 404 </h1>"
-    "<hr>"
-    "<p> File Not Found </p>"
-    "</center>");
+void bad_request_error(struct http_response *response) {
+  response->status_code = 400;
+  response->content_type = "text/html";
+  response->body = strdup(BAD_REQUEST_PAGE);
+  response->body_length = strlen(response->body);
 }
 
 /*
- * Reads an HTTP request from stream (fd), and writes an HTTP response
- * containing:
+ * Serves FILE_NAME gzip-compressed to a client that accepts it: from a
+ * precompressed FILE_NAME.gz sibling if there is one, and otherwise
+ * compressed here, in which case the result is cached under KEY until
+ * FILE_NAME changes. Returns 0 if the file has to go out as it is.
+ */
+int build_gzip_response(char *key, char *file_name, struct http_response *response) {
+  char *content_type = http_get_mime_type(file_name);
+  struct stat file_stat;
+
+  char *gzip_file_name = concat_strings(file_name, ".gz");
+  int file_fd = open(gzip_file_name, O_RDONLY);
+  if (file_fd != -1 && (fstat(file_fd, &file_stat) == -1 || !S_ISREG(file_stat.st_mode))) {
+    close(file_fd);
+    file_fd = -1;
+  }
+  if (file_fd != -1) {
+    if (file_cache_insert(key, gzip_file_name, file_fd, &file_stat, content_type, "gzip",
+          response)) {
+      close(file_fd);
+    } else {
+      response->body_fd = file_fd;
+      response->body_length = file_stat.st_size;
+      response->content_type = content_type;
+      response->content_encoding = "gzip";
+      response->size = file_stat.st_size;
+      response->last_modified = file_stat.st_mtim;
+    }
+    free(gzip_file_name);
+    response->status_code = 200;
+    return 1;
+  }
+  free(gzip_file_name);
+
+  file_fd = open(file_name, O_RDONLY);
+  if (file_fd == -1) return 0;
+  if (fstat(file_fd, &file_stat) == -1 || file_stat.st_size > GZIP_MAX_SOURCE_SIZE) {
+    close(file_fd);
+    return 0;
+  }
+
+  size_t length = file_stat.st_size;
+  size_t bytes_read = 0;
+  char *data = malloc(length > 0 ? length : 1);
+  while (data != NULL && bytes_read < length) {
+    ssize_t result = pread(file_fd, data + bytes_read, length - bytes_read, bytes_read);
+    if (result <= 0) break;
+    bytes_read += result;
+  }
+  close(file_fd);
+
+  size_t compressed_length;
+  char *compressed = data != NULL && bytes_read == length
+      ? gzip_compress(data, length, &compressed_length) : NULL;
+  free(data);
+  if (compressed == NULL) return 0;
+
+  if (!file_cache_insert_body(key, file_name, &file_stat, content_type, "gzip", compressed,
+        compressed_length, response)) {
+    response->body = compressed;
+    response->body_length = compressed_length;
+    response->content_type = content_type;
+    response->content_encoding = "gzip";
+    response->size = file_stat.st_size;
+    response->last_modified = file_stat.st_mtim;
+  }
+  response->status_code = 200;
+  return 1;
+}
+
+/*
+ * Builds the response for FULL_PATH, which missed the cache under CACHE_KEY:
  *
  *   1) If user requested an existing file, respond with the file
  *   2) If user requested a directory and index.html exists in the directory,
@@ -62,236 +189,511 @@ void not_found_error(int fd) {
  *   3) If user requested a directory and index.html doesn't exist, send a list
  *      of files in the directory with links to each.
  *   4) Send a 404 Not Found response.
+ *
+ * Files and listings go out gzip-compressed if GZIP is set and they can be
+ * (see build_gzip_response and dir_listing.h).
  */
-void handle_files_request(int fd) {
-  printf("handle_files_request\n");
-  struct http_request *request = http_request_parse(fd);
-  
-  char * full_path;
-  full_path = concat_strings(server_files_directory, request->path);
-
-  char * content;
+void build_path_response(struct http_request *request, char *full_path, char *cache_key,
+    int gzip, struct http_response *response) {
   char* full_file_name = NULL;
 
   if(full_path[strlen(full_path) - 1] == '/') {
     if((is_directory(full_path) == 0)) {
-      not_found_error(fd);
-      free(full_path);
-      close(fd);
+      not_found_error(response);
       return;
     }
 
     if(contains_index_html(full_path)) {
       full_file_name = concat_strings(full_path, "index.html");
-      content = get_content(full_file_name);
     } else {
-      content = generate_content_from_directory(full_path);
+      int chunked = request->version.length == 8
+          && strncmp(request->version.data, "HTTP/1.1", 8) == 0;
+      if (!dir_listing_respond(cache_key, full_path, gzip, chunked, response))
+        not_found_error(response);
+      return;
     }
   } else if(is_file(full_path)) {
     full_file_name = strdup(full_path);
-    content = get_content(full_file_name);
   } else {
-    not_found_error(fd);
-    free(full_path);
-    close(fd);
+    not_found_error(response);
     return;
   }
-  
-  size_t content_length;
-  content_length = full_file_name == NULL ? strlen(content) : get_content_length(full_file_name);
-  char content_length_str[100];
-  snprintf(content_length_str, sizeof(content_length_str), "%zu", content_length);
-
-  http_start_response(fd, 200);
-  http_send_header(fd, "Content-Type", full_file_name == NULL ? "text/html" : http_get_mime_type(full_file_name));
-  http_send_header(fd, "Content-Length", content_length_str);
-  http_end_headers(fd);
-  http_send_string(fd, content);
-  
-  free(content);
-  free(full_path);
-  
-  if (full_file_name != NULL) {
+
+  if (gzip && build_gzip_response(cache_key, full_file_name, response)) {
     free(full_file_name);
+    return;
   }
-  close(fd);
-}
 
+  struct stat file_stat;
+  int file_fd = open(full_file_name, O_RDONLY);
+  if (file_fd == -1 || fstat(file_fd, &file_stat) == -1) {
+    if (file_fd != -1) close(file_fd);
+    not_found_error(response);
+    free(full_file_name);
+    return;
+  }
 
-void * proxy_thread_job(void * args) {
-  struct proxy_node * node;
-  node = (struct proxy_node *)args;
-  char * buffer[100000];
+  char *content_type = http_get_mime_type(full_file_name);
+  if (file_cache_insert(cache_key, full_file_name, file_fd, &file_stat, content_type, NULL,
+        response)) {
+    close(file_fd);
+  } else {
+    /* Too large to cache: stream it with sendfile, never read into memory. */
+    response->body_fd = file_fd;
+    response->content_type = content_type;
+    response->body_length = file_stat.st_size;
+    response->size = file_stat.st_size;
+    response->last_modified = file_stat.st_mtim;
+  }
+  free(full_file_name);
 
-  int read_bytes_size, write_bytes_size;
-  while (1) {
-    read_bytes_size = read(node->from, buffer, sizeof(buffer) - 1);
-    if (read_bytes_size <= 0) break;
-    
-    write_bytes_size = write(node->to, buffer, read_bytes_size);
-    if (write_bytes_size <= 0) break;
-  }
-
-  shutdown(node->from, SHUT_WR);
-  // for debug
-  // pthread_mutex_lock(&mutex);
-  // finished++;
-  // printf("finished: %ld %ld %ld \n", finished, node->from, node->to);
-  // pthread_mutex_unlock(&mutex);
-  return NULL;
+  response->status_code = 200;
 }
 
 /*
- * Opens a connection to the proxy target (hostname=server_proxy_hostname and
- * port=server_proxy_port) and relays traffic to/from the stream fd and the
- * proxy target. HTTP requests from the client (fd) should be sent to the
- * proxy target, and HTTP responses from the proxy target should be sent to
- * the client (fd).
+ * Builds the response for an already parsed files request, from the cache
+ * if possible and otherwise with build_path_response, and then answers
+ * conditional and Range requests with 304, 206 or 416 from it.
  *
- *   +--------+     +------------+     +--------------+
- *   | client | <-> | httpserver | <-> | proxy target |
- *   +--------+     +------------+     +--------------+
+ * Clients that accept gzip get compressible files compressed. What they are
+ * sent is cached under the path plus " gzip", which no request path can
+ * contain, so the two kinds of clients never see each other's entries.
+ *
+ * METRICS_PATH is answered with a metrics report instead of a file. Every
+ * response is counted by status, and the time taken to build it recorded.
+ *
+ * Shared by the threaded server and the epoll reactor.
  */
-void handle_proxy_request(int fd) {
-  /*
-  * The code below does a DNS lookup of server_proxy_hostname and 
-  * opens a connection to it. Please do not modify.
-  */
+void build_files_response(struct http_request *request, struct http_response *response) {
+  long start_us = metrics_now_us();
+  http_response_init(response);
+  if (request == NULL) {
+    bad_request_error(response);
+    metrics_count_status(response->status_code);
+    return;
+  }
+  response->keep_alive = request->keep_alive;
 
-  struct sockaddr_in target_address;
-  memset(&target_address, 0, sizeof(target_address));
-  target_address.sin_family = AF_INET;
-  target_address.sin_port = htons(server_proxy_port);
+  enum metrics_format stats_format = metrics_stats_format(request->path.data,
+      request->path.length);
+  if (stats_format != METRICS_NOT_STATS) {
+    metrics_respond(stats_format, response);
+    metrics_count_status(response->status_code);
+    return;
+  }
 
-  struct hostent *target_dns_entry = gethostbyname2(server_proxy_hostname, AF_INET);
+  char *full_path = concat_strings(server_files_directory, request->path.data);
 
-  int client_socket_fd = socket(PF_INET, SOCK_STREAM, 0);
-  if (client_socket_fd == -1) {
-    fprintf(stderr, "Failed to create a new socket: error %d: %s\n", errno, strerror(errno));
-    exit(errno);
+  /* A path ending in / serves index.html, or a listing, both HTML. */
+  int gzip = http_request_accepts_encoding(request, "gzip")
+      && (full_path[strlen(full_path) - 1] == '/'
+        || http_mime_type_compressible(http_get_mime_type(full_path)));
+  char *cache_key = gzip ? concat_strings(full_path, " gzip") : full_path;
+
+  if (file_cache_lookup(cache_key, response)) {
+    metrics_count(METRICS_CACHE_HITS, 1);
+  } else {
+    metrics_count(METRICS_CACHE_MISSES, 1);
+    build_path_response(request, full_path, cache_key, gzip, response);
   }
+  http_response_apply_conditions(request, response);
+
+  if (cache_key != full_path) free(cache_key);
+  free(full_path);
+  metrics_count_status(response->status_code);
+  metrics_record(METRICS_HANDLER_US, metrics_now_us() - start_us);
+}
 
-  if (target_dns_entry == NULL) {
-    fprintf(stderr, "Cannot find host: %s\n", server_proxy_hostname);
-    exit(ENXIO);
+/*
+ * Waits up to http_keep_alive_timeout_ms for the next request on the idle
+ * connection FD to start arriving (or for the client to close it). Returns 0
+ * if it did not. From then on, a deadline (see timer_wheel.h) bounds the
+ * head, so that one trickling in a byte at a time cannot hold a worker.
+ */
+int await_next_request(int fd) {
+  struct pollfd pollfd = { .fd = fd, .events = POLLIN };
+  int ready;
+  do {
+    ready = poll(&pollfd, 1, http_keep_alive_timeout_ms);
+  } while (ready == -1 && errno == EINTR);
+  return ready > 0;
+}
+
+/*
+ * Reads HTTP requests from stream (fd) and writes the HTTP responses built by
+ * build_files_response, for as long as the client keeps the connection alive
+ * (up to http_keep_alive_max_requests requests, each of which has to start
+ * arriving within http_keep_alive_timeout_ms and be complete within
+ * http_header_timeout_ms from then, and none of whose responses may stall
+ * for http_body_timeout_ms). A request that times out is not answered.
+ */
+void handle_files_request(int fd) {
+  struct http_request_buffer buffer;
+  struct http_request request;
+  struct http_response response;
+  enum http_parse_status status;
+  int requests_served = 0;
+  int keep_alive = 1;
+  struct access_log_entry log_entry;
+  struct sockaddr_in peer;
+  socklen_t peer_length = sizeof(peer);
+  int have_peer = (access_log_enabled() || admission_enabled())
+      && getpeername(fd, (struct sockaddr *) &peer, &peer_length) == 0;
+  struct timer_deadline deadline;
+
+  buffer.length = 0;
+  http_request_init(&request);
+  while (keep_alive) {
+    if (requests_served > 0 && buffer.length == 0 && !await_next_request(fd)) break;
+    timer_deadline_arm(&deadline, fd, http_header_timeout_ms);
+    status = http_request_read(fd, &buffer, &request);
+    if (timer_deadline_cancel(&deadline) || status == HTTP_PARSE_NEED_MORE) break;
+
+    if (status == HTTP_PARSE_COMPLETE && ++requests_served >= http_keep_alive_max_requests)
+      request.keep_alive = 0;
+
+    int parsed = status == HTTP_PARSE_COMPLETE;
+    int logging = access_log_start(&log_entry, have_peer ? &peer : NULL,
+        parsed ? &request.method : NULL, parsed ? &request.path : NULL);
+    /* The first request was paid for when the connection was admitted. */
+    if (!parsed || requests_served == 1 || !have_peer
+        || admission_allow_request(&peer, &response))
+      build_files_response(parsed ? &request : NULL, &response);
+    timer_deadline_arm_send(&deadline, fd, http_body_timeout_ms);
+    size_t bytes_sent = http_send_response(fd, &response);
+    timer_deadline_cancel(&deadline);
+    metrics_count(METRICS_BYTES_SENT, bytes_sent);
+    if (logging) access_log_finish(&log_entry, response.status_code, bytes_sent);
+    keep_alive = response.keep_alive;
+
+    http_response_free(&response);
+    http_request_consume(&buffer, &request);
   }
+  close(fd);
+}
 
-  char *dns_address = target_dns_entry->h_addr_list[0];
 
-  memcpy(&target_address.sin_addr, dns_address, sizeof(target_address.sin_addr));
-  int connection_status = connect(client_socket_fd, (struct sockaddr*) &target_address,
-      sizeof(target_address));
+/*
+ * Answers the requests on FD that the proxy cache can take (see
+ * proxy_cache.h), for as long as the client keeps the connection alive.
+ * Returns 0 once the connection is done with, or 1 if RAW holds the start
+ * of a request that is to be relayed to a backend as it is.
+ */
+int serve_from_proxy_cache(int fd, struct http_request_buffer *raw) {
+  struct http_request_buffer parsed;
+  struct http_request request;
+  enum http_parse_status status;
+  int requests_served = 0;
+  struct access_log_entry log_entry;
+  struct sockaddr_in peer;
+  socklen_t peer_length = sizeof(peer);
+  int have_peer = (access_log_enabled() || admission_enabled())
+      && getpeername(fd, (struct sockaddr *) &peer, &peer_length) == 0;
+  struct timer_deadline deadline;
+
+  while (1) {
+    if (requests_served > 0 && raw->length == 0 && !await_next_request(fd)) return 0;
 
-  if (connection_status < 0) {
-    /* Dummy request parsing, just to be compliant. */
-    http_request_parse(fd);
+    /* The parser null-terminates in place, and the relay needs the bytes as
+     * they came, so every attempt parses a copy. A head that times out or
+     * fails to read is dropped; one the client ends by closing its side is
+     * relayed as it is. */
+    ssize_t bytes_read = 1;
+    timer_deadline_arm(&deadline, fd, http_header_timeout_ms);
+    while (1) {
+      memcpy(parsed.data, raw->data, raw->length);
+      http_request_init(&request);
+      status = http_request_parse_more(&request, parsed.data, raw->length);
+      if (status != HTTP_PARSE_NEED_MORE || raw->length == LIBHTTP_REQUEST_MAX_SIZE) break;
+      bytes_read = read(fd, raw->data + raw->length, LIBHTTP_REQUEST_MAX_SIZE - raw->length);
+      if (bytes_read == -1 && errno == EINTR) continue;
+      if (bytes_read <= 0) break;
+      raw->length += bytes_read;
+    }
+    if (timer_deadline_cancel(&deadline) || bytes_read == -1) return 0;
+    if (status == HTTP_PARSE_NEED_MORE && raw->length < LIBHTTP_REQUEST_MAX_SIZE)
+      return raw->length > 0;
+    if (status != HTTP_PARSE_COMPLETE || !proxy_cache_eligible(&request)
+        || metrics_stats_format(request.path.data, request.path.length) != METRICS_NOT_STATS)
+      return 1;
+    if (++requests_served >= http_keep_alive_max_requests) request.keep_alive = 0;
 
-    http_start_response(fd, 502);
-    http_send_header(fd, "Content-Type", "text/html");
-    http_end_headers(fd);
-    http_send_string(fd, "<center><h1>502 Bad Gateway</h1><hr></center>");
+    int logging = access_log_start(&log_entry, have_peer ? &peer : NULL, &request.method,
+        &request.path);
+    int status_code;
+    size_t bytes_sent;
+    struct http_response response;
+    if (requests_served > 1 && have_peer && !admission_allow_request(&peer, &response)) {
+      bytes_sent = http_send_response(fd, &response);
+      metrics_count(METRICS_BYTES_SENT, bytes_sent);
+      if (logging) access_log_finish(&log_entry, response.status_code, bytes_sent);
+      return 0;
+    }
+    timer_deadline_arm_send(&deadline, fd, http_body_timeout_ms);
+    int keep_alive = proxy_cache_respond(fd, &request, &status_code, &bytes_sent);
+    timer_deadline_cancel(&deadline);
+    if (keep_alive == -1) {
+      /* The log entry is the relay's to write. */
+      return 1;
+    }
+    metrics_count_status(status_code);
+    metrics_count(METRICS_BYTES_SENT, bytes_sent);
+    if (logging) access_log_finish(&log_entry, status_code, bytes_sent);
+    if (!keep_alive) return 0;
+
+    size_t request_length = http_request_length(&request);
+    if (request_length > raw->length) request_length = raw->length;
+    raw->length -= request_length;
+    memmove(raw->data, raw->data + request_length, raw->length);
+  }
+}
+
+/*
+ * Opens a connection to one of the proxy's backends (see upstream.h) and
+ * relays traffic to/from the stream fd and the backend. HTTP requests from
+ * the client (fd) should be sent to the backend, and HTTP responses from the
+ * backend should be sent to the client (fd).
+ *
+ *   +--------+     +------------+     +--------------+
+ *   | client | <-> | httpserver | <-> | proxy target |
+ *   +--------+     +------------+     +--------------+
+ *
+ * With a proxy cache, the requests it can answer are served first, and the
+ * relay takes over from the first one it cannot.
+ */
+void handle_proxy_request(int fd) {
+  /* The request path picks the backend under hash balancing, and
+   * METRICS_PATH is answered here; whatever is read for it is passed on by
+   * the relay. */
+  struct http_request_buffer buffer;
+  buffer.length = 0;
+  if (proxy_cache_enabled() && !serve_from_proxy_cache(fd, &buffer)) {
+    close(fd);
     return;
+  }
 
+  char *head = buffer.data;
+  struct http_slice path;
+  struct timer_deadline deadline;
+  enum http_parse_status status = http_request_peek_path(head, buffer.length, &path);
+  ssize_t bytes_read = 1;
+  timer_deadline_arm(&deadline, fd, http_header_timeout_ms);
+  while (status == HTTP_PARSE_NEED_MORE) {
+    bytes_read = read(fd, head + buffer.length, LIBHTTP_REQUEST_MAX_SIZE - buffer.length);
+    if (bytes_read == -1 && errno == EINTR) continue;
+    if (bytes_read <= 0) break;
+    buffer.length += bytes_read;
+    status = http_request_peek_path(head, buffer.length, &path);
+  }
+  size_t head_length = buffer.length;
+  if (timer_deadline_cancel(&deadline) || bytes_read == -1 || head_length == 0) {
+    close(fd);
+    return;
   }
 
-  pthread_t * threads;
-  threads = malloc(sizeof(pthread_t) * 2);
+  enum metrics_format stats_format = status == HTTP_PARSE_COMPLETE
+      ? metrics_stats_format(path.data, path.length) : METRICS_NOT_STATS;
+  if (stats_format != METRICS_NOT_STATS) {
+    metrics_send(fd, stats_format);
+    close(fd);
+    return;
+  }
 
-  struct proxy_node * first_node = malloc(sizeof(struct proxy_node));
-  first_node->from = client_socket_fd;
-  first_node->to = fd;
-  pthread_create(&threads[0], NULL, proxy_thread_job, (void*)first_node);
+  /*
+  * Backend addresses are resolved and cached by upstream.c, which usually
+  * also has a connection open already.
+  */
+  int client_socket_fd;
+  upstream_t *upstream = status == HTTP_PARSE_COMPLETE
+      ? upstream_connect(path.data, path.length, &client_socket_fd)
+      : upstream_connect(NULL, 0, &client_socket_fd);
 
-  struct proxy_node * second_node = malloc(sizeof(struct proxy_node));
-  second_node->from = fd;
-  second_node->to = client_socket_fd;  
-  pthread_create(&threads[1], NULL, proxy_thread_job, (void*)second_node);
-}
+  if (upstream == NULL) {
+    char *body = BAD_GATEWAY_PAGE;
+    char header[LIBHTTP_HEADER_MAX_SIZE];
+    struct http_builder builder;
+    http_builder_init(&builder, header, sizeof(header));
+    http_builder_start(&builder, 502);
+    http_builder_header(&builder, "Content-Type", "text/html");
+    http_builder_headerf(&builder, "Content-Length", "%zu", strlen(body));
+    http_builder_header(&builder, "Connection", "close");
+    http_builder_end(&builder);
+    http_builder_send(fd, &builder, body, strlen(body));
+    close(fd);
+    return;
 
-void* thread_job(void * args) {
-  void (*request_handler_for_thread)(int) = args;
-  while (1) {
-    int client_socket_fd;
-    client_socket_fd = wq_pop(&work_queue);
-    request_handler_for_thread(client_socket_fd);
-  } 
+  }
 
-  return NULL;
+  /* The relay threads take over both sockets; this worker is free again. */
+  relay_attach(fd, client_socket_fd, upstream, head, head_length);
 }
 
-
-void init_thread_pool(int num_threads, void (*request_handler)(int)) {
-  pthread_t * threads;
-  threads = malloc(sizeof(pthread_t) * num_threads);
-  pthread_mutex_init(&mutex, NULL);
-  finished = 0;
+/*
+ * Splits min_threads to max_threads workers over one pool per acceptor. With
+ * --cpus, a pool's workers run on the same share of the CPUs as its
+ * acceptor.
+ */
+void init_thread_pool(int min_threads, int max_threads, void (*request_handler)(int)) {
+  work_pools = malloc(sizeof(pool_t *) * num_acceptors);
   int i;
-  for(i = 0; i < num_threads; i++) {
-    pthread_create(&threads[i], NULL, thread_job, request_handler);
+  for (i = 0; i < num_acceptors; i++) {
+    int min_size = min_threads / num_acceptors + (i < min_threads % num_acceptors);
+    int max_size = max_threads / num_acceptors + (i < max_threads % num_acceptors);
+    cpu_set_t cpus;
+    affinity_share(i, num_acceptors, &cpus);
+    work_pools[i] = pool_create(min_size, max_size, pool_idle_ms, pool_balance,
+        affinity_num_cpus() > 0 ? &cpus : NULL, request_handler);
+    pool_set_admission(work_pools[i], queue_limit, queue_target_ms, queue_interval_ms);
   }
 }
 
 /*
- * Opens a TCP stream socket on all interfaces with port number PORTNO. Saves
- * the fd number of the server socket in *socket_number. For each accepted
- * connection, calls request_handler with the accepted fd number.
+ * Opens a TCP stream socket listening on all interfaces with port number
+ * server_port. With REUSE_PORT, several such sockets can be open at once and
+ * the kernel spreads incoming connections over them.
  */
-void serve_forever(int *socket_number, void (*request_handler)(int)) {
-
-  struct sockaddr_in server_address, client_address;
-  size_t client_address_length = sizeof(client_address);
-  int client_socket_number;
-
-  *socket_number = socket(PF_INET, SOCK_STREAM, 0);
-  if (*socket_number == -1) {
+int open_server_socket(int reuse_port) {
+  struct sockaddr_in server_address;
+  int socket_number = socket(PF_INET, SOCK_STREAM, 0);
+  if (socket_number == -1) {
     perror("Failed to create a new socket");
     exit(errno);
   }
 
   int socket_option = 1;
-  if (setsockopt(*socket_number, SOL_SOCKET, SO_REUSEADDR, &socket_option,
+  if (setsockopt(socket_number, SOL_SOCKET, SO_REUSEADDR, &socket_option,
         sizeof(socket_option)) == -1) {
     perror("Failed to set socket options");
     exit(errno);
   }
+  if (reuse_port && setsockopt(socket_number, SOL_SOCKET, SO_REUSEPORT, &socket_option,
+        sizeof(socket_option)) == -1) {
+    perror("Failed to set SO_REUSEPORT");
+    exit(errno);
+  }
 
   memset(&server_address, 0, sizeof(server_address));
   server_address.sin_family = AF_INET;
   server_address.sin_addr.s_addr = INADDR_ANY;
   server_address.sin_port = htons(server_port);
 
-  if (bind(*socket_number, (struct sockaddr *) &server_address,
+  if (bind(socket_number, (struct sockaddr *) &server_address,
         sizeof(server_address)) == -1) {
     perror("Failed to bind on socket");
     exit(errno);
   }
 
-  if (listen(*socket_number, 1024) == -1) {
+  if (listen(socket_number, 1024) == -1) {
     perror("Failed to listen on socket");
     exit(errno);
   }
+  return socket_number;
+}
 
-  printf("Listening on port %d...\n", server_port);
-  
-	wq_init(&work_queue);
-  init_thread_pool(num_threads, request_handler);
+/*
+ * Accept loop of one acceptor: hands every connection accepted on its own
+ * listening socket to its own pool.
+ */
+void* acceptor_job(void * args) {
+  struct acceptor *acceptor = args;
+  int client_socket_number;
+  struct sockaddr_in peer;
+  socklen_t peer_length;
+
+  if (affinity_num_cpus() > 0) {
+    affinity_pin(acceptor->index, num_acceptors);
+  } else if (acceptor->cpu >= 0) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(acceptor->cpu, &cpus);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+  }
 
+  /* Nothing is printed per connection: peers show up in the access log,
+   * which the worker writes without holding up this loop. */
   while (1) {
-    client_socket_number = accept(*socket_number,
-        (struct sockaddr *) &client_address,
-        (socklen_t *) &client_address_length);
+    peer_length = sizeof(peer);
+    client_socket_number = accept(acceptor->socket_number, (struct sockaddr *) &peer,
+        &peer_length);
     if (client_socket_number < 0) {
       perror("Error accepting socket");
       continue;
     }
+    metrics_count(METRICS_CONNECTIONS, 1);
+    if (!admission_allow(&peer)) {
+      admission_reject(client_socket_number, 429);
+      continue;
+    }
+
+    pool_submit(acceptor->pool, client_socket_number);
+  }
 
-    printf("Accepted connection from %s on port %d\n",
-        inet_ntoa(client_address.sin_addr),
-        client_address.sin_port);
+  return NULL;
+}
 
-    wq_push(&work_queue, client_socket_number);    
+/*
+ * Opens a TCP stream socket on all interfaces with port number PORTNO. Saves
+ * the fd number of the server socket in *socket_number. For each accepted
+ * connection, calls request_handler with the accepted fd number.
+ *
+ * With --acceptors N, N sockets share the port through SO_REUSEPORT, each
+ * with its own acceptor thread pinned to a CPU and its own worker pool.
+ * With --incoming-cpu, so do the event loops, and the kernel hands every
+ * connection to the socket on the CPU that received it.
+ */
+void serve_forever(int *socket_number, void (*request_handler)(int)) {
+  /* The uring backend serves files only, and needs a kernel that has
+   * io_uring; otherwise the epoll reactor and relay take over. */
+  if (server_mode == SERVER_MODE_URING
+      && (request_handler != handle_files_request || !uring_available())) {
+    if (request_handler == handle_files_request)
+      fprintf(stderr, "io_uring is not available, falling back to --mode epoll\n");
+    server_mode = SERVER_MODE_EPOLL;
+  }
+
+  /* In the event loop modes --num-threads is the number of loops. */
+  int num_sockets = server_mode == SERVER_MODE_THREADS ? num_acceptors : num_threads;
+  int num_listeners = server_mode == SERVER_MODE_THREADS || incoming_cpu ? num_sockets : 1;
+  int *server_sockets = malloc(sizeof(int) * num_sockets);
+  int i;
+  for (i = 0; i < num_sockets; i++)
+    server_sockets[i] = i < num_listeners ? open_server_socket(num_listeners > 1)
+        : server_sockets[0];
+  *socket_number = server_sockets[0];
+  if (incoming_cpu && affinity_steer(server_sockets, num_listeners) == -1)
+    perror("Failed to steer connections by CPU (ignoring)");
+
+  printf("Listening on port %d...\n", server_port);
+
+  if (request_handler == handle_proxy_request)
+    upstream_init(upstream_balance, upstream_dns_ttl_ms, upstream_pool_size,
+        upstream_max_latency_ms, upstream_eject_ms);
+
+  if (server_mode == SERVER_MODE_URING) {
+    uring_serve_forever(server_sockets, num_threads, build_files_response);
+  } else if (server_mode == SERVER_MODE_EPOLL && request_handler == handle_proxy_request) {
+    relay_serve_forever(server_sockets, num_threads);
+  } else if (server_mode == SERVER_MODE_EPOLL) {
+    reactor_serve_forever(server_sockets, num_threads, build_files_response);
   }
 
+  if (request_handler == handle_proxy_request) relay_init(num_relay_threads);
+  init_thread_pool(min_threads, max_threads, request_handler);
+
+  long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  struct acceptor *acceptors = malloc(sizeof(struct acceptor) * num_acceptors);
+  for (i = 0; i < num_acceptors; i++) {
+    acceptors[i].socket_number = server_sockets[i];
+    acceptors[i].pool = work_pools[i];
+    acceptors[i].index = i;
+    acceptors[i].cpu = num_acceptors > 1 && num_cpus > 0 ? i % num_cpus : -1;
+  }
+  for (i = 1; i < num_acceptors; i++) {
+    pthread_t thread;
+    pthread_create(&thread, NULL, acceptor_job, &acceptors[i]);
+  }
+  acceptor_job(&acceptors[0]);
+
   shutdown(*socket_number, SHUT_RDWR);
   close(*socket_number);
 }
@@ -299,14 +701,36 @@ void serve_forever(int *socket_number, void (*request_handler)(int)) {
 int server_fd;
 void signal_callback_handler(int signum) {
   printf("Caught signal %d: %s\n", signum, strsignal(signum));
+  int i;
+  for (i = 0; work_pools != NULL && i < num_acceptors; i++) {
+    char stats[4096];
+    int length = pool_format_stats(work_pools[i], stats, sizeof(stats));
+    printf("pool %d:\n%.*s", i, length, stats);
+  }
   printf("Closing socket %d\n", server_fd);
   if (close(server_fd) < 0) perror("Failed to close server_fd (ignoring)\n");
   exit(0);
 }
 
 char *USAGE =
-  "Usage: ./httpserver --files www_directory/ --port 8000 [--num-threads 5]\n"
-  "       ./httpserver --proxy inst.eecs.berkeley.edu:80 --port 8000 [--num-threads 5]\n";
+  "Usage: ./httpserver --files www_directory/ --port 8000 [--num-threads 5] [--mode threads|epoll|uring]\n"
+  "                    [--min-threads N] [--max-threads N] [--pool-idle-ms 10000]\n"
+  "                    [--cache-size bytes] [--cache-revalidate-ms 1000]\n"
+  "                    [--keep-alive-timeout-ms 5000] [--keep-alive-max 100]\n"
+  "                    [--header-timeout-ms 10000] [--body-timeout-ms 30000]\n"
+  "                    [--balance round-robin|least-loaded] [--acceptors 1]\n"
+  "                    [--cpus all|0-3,8,...] [--incoming-cpu]\n"
+  "                    [--queue-limit 4096] [--queue-target-ms 0] [--queue-interval-ms 100]\n"
+  "                    [--rate-limit 0] [--rate-burst 0]\n"
+  "                    [--mime-types /etc/mime.types]\n"
+  "                    [--access-log access.log] [--access-log-sample 1]\n"
+  "       ./httpserver --proxy inst.eecs.berkeley.edu:80 --port 8000 [--num-threads 5] [--mode threads|epoll]\n"
+  "       ./httpserver --proxy host1:80,host2:80 ... [--proxy-balance round-robin|least-connections|hash]\n"
+  "                    [--relay-threads 1] [--upstream-pool 8] [--upstream-dns-ttl-ms 30000]\n"
+  "                    [--tunnel-idle-timeout-ms 60000]\n"
+  "                    [--upstream-max-latency-ms 1000] [--upstream-eject-ms 10000]\n"
+  "                    [--proxy-cache-size bytes] [--proxy-cache-dir DIR]\n"
+  "                    [--proxy-cache-disk-size 268435456]\n";
 
 void exit_with_usage() {
   fprintf(stderr, "%s", USAGE);
@@ -315,9 +739,26 @@ void exit_with_usage() {
 
 int main(int argc, char **argv) {
   signal(SIGINT, signal_callback_handler);
+  /* Clients that hang up mid-response must not kill the server. */
+  signal(SIGPIPE, SIG_IGN);
 
   /* Default settings */
   server_port = 8000;
+  file_cache_size = FILE_CACHE_DEFAULT_SIZE;
+  file_cache_revalidate_ms = FILE_CACHE_DEFAULT_REVALIDATE_MS;
+  pool_balance = POOL_BALANCE_LEAST_LOADED;
+  queue_limit = WQ_CAPACITY;
+  queue_interval_ms = POOL_DEFAULT_INTERVAL_MS;
+  pool_idle_ms = POOL_DEFAULT_IDLE_MS;
+  num_acceptors = 1;
+  num_relay_threads = 1;
+  upstream_balance = UPSTREAM_BALANCE_ROUND_ROBIN;
+  upstream_dns_ttl_ms = UPSTREAM_DEFAULT_DNS_TTL_MS;
+  upstream_pool_size = UPSTREAM_DEFAULT_POOL_SIZE;
+  upstream_max_latency_ms = UPSTREAM_DEFAULT_MAX_LATENCY_MS;
+  upstream_eject_ms = UPSTREAM_DEFAULT_EJECT_MS;
+  proxy_cache_disk_size = PROXY_CACHE_DEFAULT_DISK_SIZE;
+  access_log_sample_rate = 1;
   void (*request_handler)(int) = NULL;
 
   int i;
@@ -333,20 +774,23 @@ int main(int argc, char **argv) {
     } else if (strcmp("--proxy", argv[i]) == 0) {
       request_handler = handle_proxy_request;
 
-      char *proxy_target = argv[++i];
-      if (!proxy_target) {
+      char *proxy_targets = argv[++i];
+      if (!proxy_targets) {
         fprintf(stderr, "Expected argument after --proxy\n");
         exit_with_usage();
       }
 
-      char *colon_pointer = strchr(proxy_target, ':');
-      if (colon_pointer != NULL) {
-        *colon_pointer = '\0';
-        server_proxy_hostname = proxy_target;
-        server_proxy_port = atoi(colon_pointer + 1);
-      } else {
-        server_proxy_hostname = proxy_target;
-        server_proxy_port = 80;
+      /* HOSTNAME[:PORT][,HOSTNAME[:PORT]...], and --proxy may be repeated. */
+      char *save_pointer;
+      char *proxy_target = strtok_r(proxy_targets, ",", &save_pointer);
+      for (; proxy_target != NULL; proxy_target = strtok_r(NULL, ",", &save_pointer)) {
+        char *colon_pointer = strchr(proxy_target, ':');
+        if (colon_pointer != NULL) {
+          *colon_pointer = '\0';
+          upstream_add(proxy_target, atoi(colon_pointer + 1));
+        } else {
+          upstream_add(proxy_target, 80);
+        }
       }
     } else if (strcmp("--port", argv[i]) == 0) {
       char *server_port_string = argv[++i];
@@ -361,6 +805,215 @@ int main(int argc, char **argv) {
         fprintf(stderr, "Expected positive integer after --num-threads\n");
         exit_with_usage();
       }
+    } else if (strcmp("--min-threads", argv[i]) == 0) {
+      char *min_threads_str = argv[++i];
+      if (!min_threads_str || (min_threads = atoi(min_threads_str)) < 1) {
+        fprintf(stderr, "Expected positive integer after --min-threads\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--max-threads", argv[i]) == 0) {
+      char *max_threads_str = argv[++i];
+      if (!max_threads_str || (max_threads = atoi(max_threads_str)) < 1) {
+        fprintf(stderr, "Expected positive integer after --max-threads\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--pool-idle-ms", argv[i]) == 0) {
+      char *idle_str = argv[++i];
+      if (!idle_str || (pool_idle_ms = atol(idle_str)) < 1) {
+        fprintf(stderr, "Expected positive integer after --pool-idle-ms\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--mode", argv[i]) == 0) {
+      char *mode_str = argv[++i];
+      if (mode_str && strcmp(mode_str, "threads") == 0) {
+        server_mode = SERVER_MODE_THREADS;
+      } else if (mode_str && strcmp(mode_str, "epoll") == 0) {
+        server_mode = SERVER_MODE_EPOLL;
+      } else if (mode_str && strcmp(mode_str, "uring") == 0) {
+        server_mode = SERVER_MODE_URING;
+      } else {
+        fprintf(stderr, "Expected \"threads\", \"epoll\" or \"uring\" after --mode\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--mime-types", argv[i]) == 0) {
+      mime_types_file = argv[++i];
+      if (!mime_types_file) {
+        fprintf(stderr, "Expected a file name after --mime-types\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--access-log", argv[i]) == 0) {
+      access_log_file = argv[++i];
+      if (!access_log_file) {
+        fprintf(stderr, "Expected a file name after --access-log\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--access-log-sample", argv[i]) == 0) {
+      char *sample_str = argv[++i];
+      if (!sample_str || (access_log_sample_rate = atoi(sample_str)) < 1) {
+        fprintf(stderr, "Expected positive integer after --access-log-sample\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--cache-size", argv[i]) == 0) {
+      char *cache_size_str = argv[++i];
+      if (!cache_size_str || atol(cache_size_str) < 0) {
+        fprintf(stderr, "Expected non-negative integer after --cache-size\n");
+        exit_with_usage();
+      }
+      file_cache_size = atol(cache_size_str);
+    } else if (strcmp("--cache-revalidate-ms", argv[i]) == 0) {
+      char *revalidate_str = argv[++i];
+      if (!revalidate_str || (file_cache_revalidate_ms = atol(revalidate_str)) < 0) {
+        fprintf(stderr, "Expected non-negative integer after --cache-revalidate-ms\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--keep-alive-timeout-ms", argv[i]) == 0) {
+      char *timeout_str = argv[++i];
+      if (!timeout_str || (http_keep_alive_timeout_ms = atoi(timeout_str)) < 1) {
+        fprintf(stderr, "Expected positive integer after --keep-alive-timeout-ms\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--keep-alive-max", argv[i]) == 0) {
+      char *max_str = argv[++i];
+      if (!max_str || (http_keep_alive_max_requests = atoi(max_str)) < 1) {
+        fprintf(stderr, "Expected positive integer after --keep-alive-max\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--header-timeout-ms", argv[i]) == 0) {
+      char *timeout_str = argv[++i];
+      if (!timeout_str || (http_header_timeout_ms = atoi(timeout_str)) < 1) {
+        fprintf(stderr, "Expected positive integer after --header-timeout-ms\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--body-timeout-ms", argv[i]) == 0) {
+      char *timeout_str = argv[++i];
+      if (!timeout_str || (http_body_timeout_ms = atoi(timeout_str)) < 1) {
+        fprintf(stderr, "Expected positive integer after --body-timeout-ms\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--balance", argv[i]) == 0) {
+      char *balance_str = argv[++i];
+      if (balance_str && strcmp(balance_str, "round-robin") == 0) {
+        pool_balance = POOL_BALANCE_ROUND_ROBIN;
+      } else if (balance_str && strcmp(balance_str, "least-loaded") == 0) {
+        pool_balance = POOL_BALANCE_LEAST_LOADED;
+      } else {
+        fprintf(stderr, "Expected \"round-robin\" or \"least-loaded\" after --balance\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--acceptors", argv[i]) == 0) {
+      char *acceptors_str = argv[++i];
+      if (!acceptors_str || (num_acceptors = atoi(acceptors_str)) < 1) {
+        fprintf(stderr, "Expected positive integer after --acceptors\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--cpus", argv[i]) == 0) {
+      cpu_list = argv[++i];
+      if (!cpu_list) {
+        fprintf(stderr, "Expected \"all\" or a list of CPUs after --cpus\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--incoming-cpu", argv[i]) == 0) {
+      incoming_cpu = 1;
+    } else if (strcmp("--queue-limit", argv[i]) == 0) {
+      char *limit_str = argv[++i];
+      if (!limit_str || atol(limit_str) < 1 || atol(limit_str) > WQ_CAPACITY) {
+        fprintf(stderr, "Expected integer between 1 and %d after --queue-limit\n", WQ_CAPACITY);
+        exit_with_usage();
+      }
+      queue_limit = atol(limit_str);
+    } else if (strcmp("--queue-target-ms", argv[i]) == 0) {
+      char *target_str = argv[++i];
+      if (!target_str || (queue_target_ms = atol(target_str)) < 0) {
+        fprintf(stderr, "Expected non-negative integer after --queue-target-ms\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--queue-interval-ms", argv[i]) == 0) {
+      char *interval_str = argv[++i];
+      if (!interval_str || (queue_interval_ms = atol(interval_str)) < 1) {
+        fprintf(stderr, "Expected positive integer after --queue-interval-ms\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--rate-limit", argv[i]) == 0) {
+      char *rate_str = argv[++i];
+      if (!rate_str || (rate_limit = atoi(rate_str)) < 0) {
+        fprintf(stderr, "Expected non-negative integer after --rate-limit\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--rate-burst", argv[i]) == 0) {
+      char *burst_str = argv[++i];
+      if (!burst_str || (rate_burst = atoi(burst_str)) < 0) {
+        fprintf(stderr, "Expected non-negative integer after --rate-burst\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--relay-threads", argv[i]) == 0) {
+      char *relay_threads_str = argv[++i];
+      if (!relay_threads_str || (num_relay_threads = atoi(relay_threads_str)) < 1) {
+        fprintf(stderr, "Expected positive integer after --relay-threads\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--tunnel-idle-timeout-ms", argv[i]) == 0) {
+      char *timeout_str = argv[++i];
+      if (!timeout_str || (relay_idle_timeout_ms = atol(timeout_str)) < 1) {
+        fprintf(stderr, "Expected positive integer after --tunnel-idle-timeout-ms\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--upstream-pool", argv[i]) == 0) {
+      char *pool_size_str = argv[++i];
+      if (!pool_size_str || (upstream_pool_size = atoi(pool_size_str)) < 0) {
+        fprintf(stderr, "Expected non-negative integer after --upstream-pool\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--upstream-dns-ttl-ms", argv[i]) == 0) {
+      char *ttl_str = argv[++i];
+      if (!ttl_str || (upstream_dns_ttl_ms = atol(ttl_str)) < 1) {
+        fprintf(stderr, "Expected positive integer after --upstream-dns-ttl-ms\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--proxy-balance", argv[i]) == 0) {
+      char *balance_str = argv[++i];
+      if (balance_str && strcmp(balance_str, "round-robin") == 0) {
+        upstream_balance = UPSTREAM_BALANCE_ROUND_ROBIN;
+      } else if (balance_str && strcmp(balance_str, "least-connections") == 0) {
+        upstream_balance = UPSTREAM_BALANCE_LEAST_CONNECTIONS;
+      } else if (balance_str && strcmp(balance_str, "hash") == 0) {
+        upstream_balance = UPSTREAM_BALANCE_HASH;
+      } else {
+        fprintf(stderr, "Expected \"round-robin\", \"least-connections\" or \"hash\" "
+            "after --proxy-balance\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--upstream-max-latency-ms", argv[i]) == 0) {
+      char *latency_str = argv[++i];
+      if (!latency_str || (upstream_max_latency_ms = atol(latency_str)) < 1) {
+        fprintf(stderr, "Expected positive integer after --upstream-max-latency-ms\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--upstream-eject-ms", argv[i]) == 0) {
+      char *eject_str = argv[++i];
+      if (!eject_str || (upstream_eject_ms = atol(eject_str)) < 0) {
+        fprintf(stderr, "Expected non-negative integer after --upstream-eject-ms\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--proxy-cache-size", argv[i]) == 0) {
+      char *cache_size_str = argv[++i];
+      if (!cache_size_str || atol(cache_size_str) < 0) {
+        fprintf(stderr, "Expected non-negative integer after --proxy-cache-size\n");
+        exit_with_usage();
+      }
+      proxy_cache_size = atol(cache_size_str);
+    } else if (strcmp("--proxy-cache-dir", argv[i]) == 0) {
+      proxy_cache_directory = argv[++i];
+      if (!proxy_cache_directory) {
+        fprintf(stderr, "Expected a directory after --proxy-cache-dir\n");
+        exit_with_usage();
+      }
+    } else if (strcmp("--proxy-cache-disk-size", argv[i]) == 0) {
+      char *disk_size_str = argv[++i];
+      if (!disk_size_str || atol(disk_size_str) < 1) {
+        fprintf(stderr, "Expected positive integer after --proxy-cache-disk-size\n");
+        exit_with_usage();
+      }
+      proxy_cache_disk_size = atol(disk_size_str);
     } else if (strcmp("--help", argv[i]) == 0) {
       exit_with_usage();
     } else {
@@ -369,12 +1022,84 @@ int main(int argc, char **argv) {
     }
   }
 
-  if (server_files_directory == NULL && server_proxy_hostname == NULL) {
+  if (request_handler == NULL
+      || (request_handler == handle_proxy_request && upstream_count() == 0)) {
     fprintf(stderr, "Please specify either \"--files [DIRECTORY]\" or \n"
                     "                      \"--proxy [HOSTNAME:PORT]\"\n");
     exit_with_usage();
   }
 
+  /* Steering connections to a CPU is of no use unless they are then served
+   * there. */
+  if (incoming_cpu && cpu_list == NULL) cpu_list = "all";
+  if (cpu_list != NULL && affinity_init(cpu_list) == -1) {
+    fprintf(stderr, "Expected \"all\" or a list of CPUs the server may run on after --cpus\n");
+    exit_with_usage();
+  }
+  if (incoming_cpu && server_mode == SERVER_MODE_THREADS && num_acceptors == 1) {
+    fprintf(stderr, "--incoming-cpu needs --acceptors above 1 in --mode threads\n");
+    exit_with_usage();
+  }
+
+  /* --num-threads fixes the size of the pool; without it, the pool adapts
+   * between bounds that suit the host, and an event loop runs per CPU. */
+  if (num_threads > 0 && (min_threads > 0 || max_threads > 0)) {
+    fprintf(stderr, "--num-threads fixes the pool size; drop it to use --min-threads "
+        "and --max-threads\n");
+    exit_with_usage();
+  } else if (num_threads > 0) {
+    min_threads = max_threads = num_threads;
+  } else if (min_threads > 0 && max_threads > 0 && min_threads > max_threads) {
+    fprintf(stderr, "--min-threads is above --max-threads\n");
+    exit_with_usage();
+  } else {
+    int default_min_threads, default_max_threads;
+    pool_default_size(&default_min_threads, &default_max_threads);
+    if (min_threads == 0)
+      min_threads = max_threads > 0 && max_threads < default_min_threads
+          ? max_threads : default_min_threads;
+    if (max_threads == 0)
+      max_threads = min_threads > default_max_threads ? min_threads : default_max_threads;
+    num_threads = affinity_num_cpus() > 0 ? affinity_num_cpus()
+        : sysconf(_SC_NPROCESSORS_ONLN);
+  }
+
+  if (server_mode != SERVER_MODE_THREADS && num_acceptors > 1) {
+    fprintf(stderr, "--acceptors applies to --mode threads only\n");
+    exit_with_usage();
+  }
+
+  /* The reactors and relays accept and serve on the same thread, without a
+   * work queue in between. */
+  if (server_mode != SERVER_MODE_THREADS
+      && (queue_limit != WQ_CAPACITY || queue_target_ms > 0)) {
+    fprintf(stderr, "--queue-limit and --queue-target-ms apply to --mode threads only\n");
+    exit_with_usage();
+  }
+
+  /* The epoll relay moves bytes without parsing them; only the threaded
+   * proxy sees whole requests and responses. */
+  if (server_mode != SERVER_MODE_THREADS && proxy_cache_size > 0) {
+    fprintf(stderr, "--proxy-cache-size applies to --mode threads only\n");
+    exit_with_usage();
+  }
+
+  if (mime_init(mime_types_file) == -1) {
+    perror("Failed to load MIME types");
+    exit(errno);
+  }
+  if (access_log_init(access_log_file, access_log_sample_rate) == -1) {
+    perror("Failed to open access log");
+    exit(errno);
+  }
+  file_cache_init(file_cache_size, file_cache_revalidate_ms);
+  admission_init(rate_limit, rate_burst);
+  if (request_handler == handle_proxy_request
+      && proxy_cache_init(proxy_cache_size, proxy_cache_directory, proxy_cache_disk_size) == -1) {
+    perror("Failed to set up the proxy cache directory");
+    exit(errno);
+  }
+
   serve_forever(&server_fd, request_handler);
 
   return EXIT_SUCCESS;
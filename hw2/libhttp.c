@@ -1,73 +1,359 @@
+#define _GNU_SOURCE
+
 #include <errno.h>
+#include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
 
 #include "libhttp.h"
+#include "mime.h"
 
+#include <sys/sendfile.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
-#include <dirent.h>
+#include <sys/uio.h>
 
-#define LIBHTTP_REQUEST_MAX_SIZE 8192
+int http_keep_alive_timeout_ms = 5000;
+int http_keep_alive_max_requests = 100;
+int http_header_timeout_ms = 10000;
+int http_body_timeout_ms = 30000;
 
 void http_fatal_error(char *message) {
   fprintf(stderr, "%s\n", message);
   exit(ENOBUFS);
 }
 
-struct http_request *http_request_parse(int fd) {
-  struct http_request *request = malloc(sizeof(struct http_request));
-  if (!request) http_fatal_error("Malloc failed");
-
-  char *read_buffer = malloc(LIBHTTP_REQUEST_MAX_SIZE + 1);
-  if (!read_buffer) http_fatal_error("Malloc failed");
-
-  int bytes_read = read(fd, read_buffer, LIBHTTP_REQUEST_MAX_SIZE);
-  read_buffer[bytes_read] = '\0'; /* Always null-terminate. */
-
-  char *read_start, *read_end;
-  size_t read_size;
-
-  do {
-    /* Read in the HTTP method: "[A-Z]*" */
-    read_start = read_end = read_buffer;
-    while (*read_end >= 'A' && *read_end <= 'Z') read_end++;
-    read_size = read_end - read_start;
-    if (read_size == 0) break;
-    request->method = malloc(read_size + 1);
-    memcpy(request->method, read_start, read_size);
-    request->method[read_size] = '\0';
-
-    /* Read in a space character. */
-    read_start = read_end;
-    if (*read_end != ' ') break;
-    read_end++;
-
-    /* Read in the path: "[^ \n]*" */
-    read_start = read_end;
-    while (*read_end != '\0' && *read_end != ' ' && *read_end != '\n') read_end++;
-    read_size = read_end - read_start;
-    if (read_size == 0) break;
-    request->path = malloc(read_size + 1);
-    memcpy(request->path, read_start, read_size);
-    request->path[read_size] = '\0';
-
-    /* Read in HTTP version and rest of request line: ".*" */
-    read_start = read_end;
-    while (*read_end != '\0' && *read_end != '\n') read_end++;
-    if (*read_end != '\n') break;
-    read_end++;
-
-    free(read_buffer);
-    return request;
-  } while (0);
-
-  /* An error occurred. */
-  free(request);
-  free(read_buffer);
+/* Parser states, see http_request_parse_more. */
+enum {
+  PARSE_METHOD,
+  PARSE_PATH,
+  PARSE_VERSION,
+  PARSE_HEADER_START,
+  PARSE_HEADER_END,
+  PARSE_HEADER_NAME,
+  PARSE_HEADER_VALUE_START,
+  PARSE_HEADER_VALUE,
+  PARSE_DONE,
+};
+
+void http_request_init(struct http_request *request) {
+  memset(request, 0, sizeof(*request));
+  request->parse_state = PARSE_METHOD;
+}
+
+/* Updates KEEP_ALIVE from the value of a Connection header. */
+static void http_parse_connection_header(char *value, char *value_end, int *keep_alive) {
+  while (value < value_end) {
+    if (value_end - value >= 5 && strncasecmp(value, "close", 5) == 0) {
+      *keep_alive = 0;
+    } else if (value_end - value >= 10 && strncasecmp(value, "keep-alive", 10) == 0) {
+      *keep_alive = 1;
+    }
+    value++;
+  }
+}
+
+static void http_slice_trim_end(struct http_slice *slice) {
+  while (slice->length > 0 && (slice->data[slice->length - 1] == '\r'
+        || slice->data[slice->length - 1] == ' ' || slice->data[slice->length - 1] == '\t'))
+    slice->length--;
+}
+
+/* Reads a Content-Length value into *BODY_LENGTH. Returns -1 unless it is
+ * all digits and agrees with any Content-Length seen before. */
+static int http_parse_content_length(struct http_slice *value, size_t *body_length,
+    int *seen) {
+  size_t length = 0, i;
+  if (value->data == NULL || value->length == 0) return -1;
+  for (i = 0; i < value->length; i++) {
+    char c = value->data[i];
+    if (c < '0' || c > '9' || length > (SIZE_MAX - 9) / 10) return -1;
+    length = length * 10 + (c - '0');
+  }
+  if (*seen && length != *body_length) return -1;
+  *body_length = length;
+  *seen = 1;
+  return 0;
+}
+
+/* Returns -1 if the header makes the end of the request ambiguous: a body
+ * framed by Transfer-Encoding, which is not supported, or a Content-Length
+ * that cannot be trusted. Skipping either wrongly would have the body parsed
+ * as the next request on the connection. */
+static int http_request_add_header(struct http_request *request, char *value_end) {
+  struct http_header *header = &request->headers[request->num_headers];
+  header->value.length = value_end - header->value.data;
+  http_slice_trim_end(&header->value);
+
+  if (header->name.length == 10 && strncasecmp(header->name.data, "Connection", 10) == 0)
+    http_parse_connection_header(header->value.data, value_end, &request->keep_alive);
+  if (header->name.length == 17
+      && strncasecmp(header->name.data, "Transfer-Encoding", 17) == 0)
+    return -1;
+  if (header->name.length == 14 && strncasecmp(header->name.data, "Content-Length", 14) == 0
+      && http_parse_content_length(&header->value, &request->body_length,
+        &request->has_content_length) == -1)
+    return -1;
+
+  /* Headers that do not fit are still parsed, but not kept. */
+  if (request->num_headers < LIBHTTP_MAX_HEADERS - 1) request->num_headers++;
+  return 0;
+}
+
+/* Ends the head at OFFSET of a buffer holding LENGTH bytes so far. A body
+ * that is not all there yet cannot be skipped without reading on, so the
+ * connection is closed after the response instead. */
+static enum http_parse_status http_request_complete(struct http_request *request,
+    size_t offset, size_t length) {
+  request->parse_state = PARSE_DONE;
+  request->head_length = offset + 1;
+  request->parse_offset = offset + 1;
+  if (request->body_length > length - request->head_length) request->keep_alive = 0;
+  return HTTP_PARSE_COMPLETE;
+}
+
+/*
+ * Parses as much of the request head in BUFFER (LENGTH bytes, of which the
+ * first calls already saw a prefix) as is available, resuming where the
+ * previous call stopped. Nothing is allocated: method, path, version and
+ * headers are slices into BUFFER, which must therefore stay in place until
+ * the request is consumed. The bytes after method and path are overwritten
+ * with NULs so that both can also be used as C strings.
+ */
+enum http_parse_status http_request_parse_more(struct http_request *request, char *buffer,
+    size_t length) {
+  size_t offset;
+  for (offset = request->parse_offset; offset < length; offset++) {
+    char *c = buffer + offset;
+    struct http_header *header = &request->headers[request->num_headers];
+
+    switch (request->parse_state) {
+      case PARSE_METHOD:
+        /* The HTTP method: "[A-Z]+ " */
+        if (request->method.data == NULL) request->method.data = c;
+        if (*c >= 'A' && *c <= 'Z') break;
+        if (*c != ' ' || c == request->method.data) return HTTP_PARSE_ERROR;
+        request->method.length = c - request->method.data;
+        *c = '\0';
+        request->parse_state = PARSE_PATH;
+        break;
+
+      case PARSE_PATH:
+        /* The path: "[^ \n]+", followed by a version or the end of the line. */
+        if (request->path.data == NULL) request->path.data = c;
+        if (*c != ' ' && *c != '\n') break;
+        request->path.length = c - request->path.data;
+        if (request->path.length > 0 && request->path.data[request->path.length - 1] == '\r')
+          request->path.length--;
+        if (request->path.length == 0) return HTTP_PARSE_ERROR;
+        request->parse_state = *c == ' ' ? PARSE_VERSION : PARSE_HEADER_START;
+        request->path.data[request->path.length] = '\0';
+        break;
+
+      case PARSE_VERSION:
+        /* HTTP version and rest of request line: ".*\n" */
+        if (request->version.data == NULL) request->version.data = c;
+        if (*c != '\n') break;
+        request->version.length = c - request->version.data;
+        http_slice_trim_end(&request->version);
+        request->keep_alive = request->version.length == 8
+            && strncmp(request->version.data, "HTTP/1.1", 8) == 0;
+        request->parse_state = PARSE_HEADER_START;
+        break;
+
+      case PARSE_HEADER_START:
+        /* Either an empty line, which ends the head, or a "name: value" line. */
+        if (*c == '\n') return http_request_complete(request, offset, length);
+        if (*c == '\r') {
+          request->parse_state = PARSE_HEADER_END;
+          break;
+        }
+        header->name.data = c;
+        request->parse_state = PARSE_HEADER_NAME;
+        break;
+
+      case PARSE_HEADER_END:
+        if (*c != '\n') return HTTP_PARSE_ERROR;
+        return http_request_complete(request, offset, length);
+
+      case PARSE_HEADER_NAME:
+        if (*c == '\n') {
+          /* Lines without a colon are ignored. */
+          request->parse_state = PARSE_HEADER_START;
+        } else if (*c == ':') {
+          header->name.length = c - header->name.data;
+          header->value.data = NULL;
+          request->parse_state = PARSE_HEADER_VALUE_START;
+        }
+        break;
+
+      case PARSE_HEADER_VALUE_START:
+        if (*c == ' ' || *c == '\t') break;
+        header->value.data = c;
+        request->parse_state = PARSE_HEADER_VALUE;
+        /* Fall through: C may already end the line. */
+
+      case PARSE_HEADER_VALUE:
+        if (*c != '\n') break;
+        if (http_request_add_header(request, c) == -1) return HTTP_PARSE_ERROR;
+        request->parse_state = PARSE_HEADER_START;
+        break;
+
+      case PARSE_DONE:
+        return HTTP_PARSE_COMPLETE;
+    }
+  }
+
+  request->parse_offset = offset;
+  return HTTP_PARSE_NEED_MORE;
+}
+
+/*
+ * Called when no more bytes will arrive. Accepts a head that was cut short
+ * after the path, the way a client that sends only a request line and hangs
+ * up expects it.
+ */
+enum http_parse_status http_request_parse_finish(struct http_request *request, char *buffer,
+    size_t length) {
+  enum http_parse_status status = http_request_parse_more(request, buffer, length);
+  if (status != HTTP_PARSE_NEED_MORE) return status;
+
+  switch (request->parse_state) {
+    case PARSE_METHOD:
+      return HTTP_PARSE_ERROR;
+    case PARSE_PATH:
+      if (request->path.data == NULL) return HTTP_PARSE_ERROR;
+      request->path.length = buffer + length - request->path.data;
+      request->path.data[request->path.length] = '\0';
+      break;
+    case PARSE_VERSION:
+      if (request->version.data != NULL)
+        request->version.length = buffer + length - request->version.data;
+      break;
+  }
+  request->keep_alive = 0;
+  request->parse_state = PARSE_DONE;
+  request->head_length = length;
+  return HTTP_PARSE_COMPLETE;
+}
+
+/*
+ * Looks up the value of header NAME (case-insensitive). Returns NULL if the
+ * request does not have it.
+ */
+struct http_slice *http_request_header(struct http_request *request, char *name) {
+  size_t name_length = strlen(name);
+  int i;
+  for (i = 0; i < request->num_headers; i++) {
+    struct http_header *header = &request->headers[i];
+    if (header->name.length == name_length
+        && strncasecmp(header->name.data, name, name_length) == 0)
+      return &header->value;
+  }
   return NULL;
+}
+
+/*
+ * Whether the Accept-Encoding header of REQUEST lists CODING (or "*")
+ * without ruling it out with q=0.
+ */
+int http_request_accepts_encoding(struct http_request *request, char *coding) {
+  struct http_slice *value = http_request_header(request, "Accept-Encoding");
+  if (value == NULL) return 0;
+
+  size_t coding_length = strlen(coding);
+  char *end = value->data + value->length;
+  char *item = value->data;
+  while (item < end) {
+    char *item_end = memchr(item, ',', end - item);
+    if (item_end == NULL) item_end = end;
+
+    while (item < item_end && (*item == ' ' || *item == '\t')) item++;
+    char *name_end = item;
+    while (name_end < item_end && *name_end != ';' && *name_end != ' ' && *name_end != '\t')
+      name_end++;
+    size_t name_length = name_end - item;
+
+    if ((name_length == coding_length && strncasecmp(item, coding, coding_length) == 0)
+        || (name_length == 1 && *item == '*')) {
+      /* Only an explicit q=0 (or 0.0...) turns it down. */
+      char *q = name_end;
+      while (q < item_end && *q != '=') q++;
+      if (q == item_end) return 1;
+      for (q++; q < item_end && (*q == '0' || *q == '.' || *q == ' '); q++);
+      return q < item_end && *q >= '1' && *q <= '9';
+    }
+    item = item_end + 1;
+  }
+  return 0;
+}
+
+/*
+ * Finds the path in the request line at the start of BUFFER without touching
+ * the buffer, for requests that are passed on as-is (see the proxy). Returns
+ * HTTP_PARSE_NEED_MORE until the whole request line is in BUFFER.
+ */
+enum http_parse_status http_request_peek_path(char *buffer, size_t length,
+    struct http_slice *path) {
+  char *line_end = memchr(buffer, '\n', length);
+  if (line_end == NULL)
+    return length < LIBHTTP_REQUEST_MAX_SIZE ? HTTP_PARSE_NEED_MORE : HTTP_PARSE_ERROR;
+
+  char *method_end = memchr(buffer, ' ', line_end - buffer);
+  if (method_end == NULL || method_end == buffer) return HTTP_PARSE_ERROR;
+  path->data = method_end + 1;
+  char *path_end = memchr(path->data, ' ', line_end - path->data);
+  if (path_end == NULL) path_end = line_end > path->data && line_end[-1] == '\r'
+      ? line_end - 1 : line_end;
+  path->length = path_end - path->data;
+  return path->length > 0 ? HTTP_PARSE_COMPLETE : HTTP_PARSE_ERROR;
+}
 
+/*
+ * Blocks until REQUEST has been parsed out of BUFFER, reading from FD as
+ * needed. Returns HTTP_PARSE_COMPLETE or HTTP_PARSE_ERROR (including a head
+ * that does not fit in the buffer), or HTTP_PARSE_NEED_MORE if the connection
+ * was closed before any request bytes arrived or a read failed (timed out,
+ * say): only a head the client ended by closing its side is parsed as it is.
+ */
+enum http_parse_status http_request_read(int fd, struct http_request_buffer *buffer,
+    struct http_request *request) {
+  enum http_parse_status status;
+  while ((status = http_request_parse_more(request, buffer->data, buffer->length))
+      == HTTP_PARSE_NEED_MORE) {
+    if (buffer->length == LIBHTTP_REQUEST_MAX_SIZE) return HTTP_PARSE_ERROR;
+
+    ssize_t bytes_read = read(fd, buffer->data + buffer->length,
+        LIBHTTP_REQUEST_MAX_SIZE - buffer->length);
+    if (bytes_read == -1 && errno == EINTR) continue;
+    if (bytes_read <= 0) {
+      if (bytes_read == -1 || buffer->length == 0) return HTTP_PARSE_NEED_MORE;
+      return http_request_parse_finish(request, buffer->data, buffer->length);
+    }
+    buffer->length += bytes_read;
+  }
+  return status;
+}
+
+/*
+ * Drops the parsed REQUEST, head and body, from BUFFER, keeping any
+ * pipelined bytes that follow, and resets REQUEST for the next one.
+ */
+void http_request_consume(struct http_request_buffer *buffer, struct http_request *request) {
+  size_t length = http_request_length(request);
+  if (length > buffer->length) length = buffer->length;
+  buffer->length -= length;
+  memmove(buffer->data, buffer->data + length, buffer->length);
+  http_request_init(request);
+}
+
+size_t http_request_length(struct http_request *request) {
+  if (request->parse_state != PARSE_DONE) return request->head_length;
+  return request->head_length + request->body_length;
 }
 
 char* http_get_response_message(int status_code) {
@@ -76,6 +362,8 @@ char* http_get_response_message(int status_code) {
       return "Continue";
     case 200:
       return "OK";
+    case 206:
+      return "Partial Content";
     case 301:
       return "Moved Permanently";
     case 302:
@@ -92,11 +380,105 @@ char* http_get_response_message(int status_code) {
       return "Not Found";
     case 405:
       return "Method Not Allowed";
+    case 416:
+      return "Range Not Satisfiable";
+    case 429:
+      return "Too Many Requests";
+    case 502:
+      return "Bad Gateway";
+    case 503:
+      return "Service Unavailable";
     default:
       return "Internal Server Error";
   }
 }
 
+void http_builder_init(struct http_builder *builder, char *buffer, size_t size) {
+  builder->buffer = buffer;
+  builder->size = size;
+  builder->length = 0;
+  builder->overflow = 0;
+}
+
+static void http_builder_vprintf(struct http_builder *builder, char *format, va_list arguments) {
+  if (builder->overflow) return;
+  int length = vsnprintf(builder->buffer + builder->length, builder->size - builder->length,
+      format, arguments);
+  if (length < 0 || (size_t) length >= builder->size - builder->length) {
+    builder->overflow = 1;
+    return;
+  }
+  builder->length += length;
+}
+
+static void http_builder_printf(struct http_builder *builder, char *format, ...) {
+  va_list arguments;
+  va_start(arguments, format);
+  http_builder_vprintf(builder, format, arguments);
+  va_end(arguments);
+}
+
+void http_builder_start(struct http_builder *builder, int status_code) {
+  http_builder_printf(builder, "HTTP/1.1 %d %s\r\n", status_code,
+      http_get_response_message(status_code));
+}
+
+void http_builder_header(struct http_builder *builder, char *key, char *value) {
+  http_builder_printf(builder, "%s: %s\r\n", key, value);
+}
+
+void http_builder_headerf(struct http_builder *builder, char *key, char *format, ...) {
+  va_list arguments;
+  http_builder_printf(builder, "%s: ", key);
+  va_start(arguments, format);
+  http_builder_vprintf(builder, format, arguments);
+  va_end(arguments);
+  http_builder_printf(builder, "\r\n");
+}
+
+/* Copies LENGTH bytes of ready-made header lines, CRLF-terminated. */
+void http_builder_append(struct http_builder *builder, char *data, size_t length) {
+  if (builder->overflow) return;
+  if (length >= builder->size - builder->length) {
+    builder->overflow = 1;
+    return;
+  }
+  memcpy(builder->buffer + builder->length, data, length);
+  builder->length += length;
+}
+
+/* Ends the head. Returns its length, or -1 if it did not fit. */
+int http_builder_end(struct http_builder *builder) {
+  http_builder_printf(builder, "\r\n");
+  return builder->overflow ? -1 : (int) builder->length;
+}
+
+/* Writes HEAD and then BODY to FD, both in one writev unless the socket
+ * takes only part of them. Returns the number of bytes written. */
+static size_t http_send_head_and_body(int fd, char *head, size_t head_length, char *body,
+    size_t body_length) {
+  struct iovec iov[2] = {
+    { head, head_length },
+    { body, body_length },
+  };
+  ssize_t bytes_sent = writev(fd, iov, 2);
+  if (bytes_sent < 0) return 0;
+  size_t total = bytes_sent;
+  if (total < head_length) {
+    size_t sent = http_send_data(fd, head + total, head_length - total);
+    total += sent;
+    if (total < head_length) return total;
+  }
+  return total + http_send_data(fd, body + (total - head_length),
+      body_length - (total - head_length));
+}
+
+/* Sends the head collected in BUILDER (ended already) and BODY together. */
+size_t http_builder_send(int fd, struct http_builder *builder, char *body, size_t body_length) {
+  if (builder->overflow) return 0;
+  return http_send_head_and_body(fd, builder->buffer, builder->length, body, body_length);
+}
+
 void http_start_response(int fd, int status_code) {
   dprintf(fd, "HTTP/1.0 %d %s\r\n", status_code,
       http_get_response_message(status_code));
@@ -114,67 +496,373 @@ void http_send_string(int fd, char *data) {
   http_send_data(fd, data, strlen(data));
 }
 
-void http_send_data(int fd, char *data, size_t size) {
+/* Like http_send_data, with FLAGS for send. */
+static size_t http_send_flags(int fd, char *data, size_t size, int flags) {
+  size_t total = 0;
   ssize_t bytes_sent;
-  while (size > 0) {
-    bytes_sent = write(fd, data, size);
+  while (total < size) {
+    bytes_sent = send(fd, data + total, size - total, flags);
     if (bytes_sent < 0)
-      return;
-    size -= bytes_sent;
-    data += bytes_sent;
+      break;
+    total += bytes_sent;
   }
+  return total;
 }
 
-char *http_get_mime_type(char *file_name) {
-  char *file_extension = strrchr(file_name, '.');
-  if (file_extension == NULL) {
-    return "text/plain";
-  }
-
-  if (strcmp(file_extension, ".html") == 0 || strcmp(file_extension, ".htm") == 0) {
-    return "text/html";
-  } else if (strcmp(file_extension, ".jpg") == 0 || strcmp(file_extension, ".jpeg") == 0) {
-    return "image/jpeg";
-  } else if (strcmp(file_extension, ".png") == 0) {
-    return "image/png";
-  } else if (strcmp(file_extension, ".css") == 0) {
-    return "text/css";
-  } else if (strcmp(file_extension, ".js") == 0) {
-    return "application/javascript";
-  } else if (strcmp(file_extension, ".pdf") == 0) {
-    return "application/pdf";
-  } else {
-    return "text/plain";
+/* Returns the number of bytes written, which is SIZE unless FD failed. */
+size_t http_send_data(int fd, char *data, size_t size) {
+  size_t total = 0;
+  ssize_t bytes_sent;
+  while (total < size) {
+    bytes_sent = write(fd, data + total, size - total);
+    if (bytes_sent < 0)
+      break;
+    total += bytes_sent;
   }
+  return total;
 }
 
-char* generate_content_from_directory(char* directory_name) {
-  char* result = (char*)malloc(2048);
-  
-  DIR * directory;
-  struct dirent *entry;
-  directory = opendir(directory_name);
-  
-  
-  char * line  = (char *)malloc(1024);
-  sprintf(line, " Directory: %s <br> ", directory_name);
-  strcpy(result, line);
-  free(line);
-  while((entry = readdir(directory))) {
-    
-    line = (char *)malloc(1024);
-    if(strcmp(entry->d_name, "..")) {
-      sprintf(line, " <a href=\"%s\"> %s </a> <br> ", entry->d_name, entry->d_name);
-    } else {
-      sprintf(line, " <a href=\"%s\"> %s </a> <br> ", entry->d_name, "parent");
+/*
+ * Streams SIZE bytes of FILE_FD starting at OFFSET to FD. The data goes from
+ * the page cache straight to the socket, so memory use does not depend on the
+ * file size.
+ */
+size_t http_send_file(int fd, int file_fd, off_t offset, size_t size) {
+  size_t total = 0;
+  ssize_t bytes_sent;
+  while (total < size) {
+    bytes_sent = sendfile(fd, file_fd, &offset, size - total);
+    if (bytes_sent <= 0)
+      break;
+    total += bytes_sent;
+  }
+  return total;
+}
+
+void http_response_init(struct http_response *response) {
+  memset(response, 0, sizeof(*response));
+  response->body_fd = -1;
+}
+
+/* Returns the number of bytes written. */
+size_t http_send_response(int fd, struct http_response *response) {
+  char header_buffer[LIBHTTP_HEADER_MAX_SIZE];
+  char *header = response->header;
+  size_t header_length = response->header_length;
+  if (header == NULL) {
+    int length = http_format_headers(response, header_buffer, sizeof(header_buffer));
+    if (length < 0) return 0;
+    header = header_buffer;
+    header_length = length;
+  }
+
+  /* A header that cannot share a writev with its body is sent with MSG_MORE,
+   * so that it still leaves in the same segment as the first body bytes. */
+  size_t total;
+  if (response->body_fd != -1) {
+    total = http_send_flags(fd, header, header_length, response->body_length > 0 ? MSG_MORE : 0);
+    if (total < header_length) return total;
+    return total + http_send_file(fd, response->body_fd, response->body_offset,
+        response->body_length);
+  }
+
+  if (response->produce != NULL) {
+    char chunk[LIBHTTP_CHUNK_SIZE];
+    size_t chunk_length;
+    total = http_send_flags(fd, header, header_length, MSG_MORE);
+    while (total == header_length
+        && (chunk_length = http_response_next_chunk(response, chunk, sizeof(chunk))) > 0) {
+      size_t sent = http_send_data(fd, chunk, chunk_length);
+      total += sent;
+      header_length += chunk_length;
     }
-    
-    strcat(result, line);
-    free(line);
+    return total;
   }
 
-  closedir(directory);
-  return result;
+  return http_send_head_and_body(fd, header, header_length,
+      response->body + response->body_offset, response->body_length);
+}
+
+/* Renders DATE the way HTTP headers carry it (IMF-fixdate). */
+static int http_format_date(time_t date, char *buffer, size_t size) {
+  struct tm tm;
+  if (gmtime_r(&date, &tm) == NULL) return 0;
+  return strftime(buffer, size, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+}
+
+int http_parse_date(struct http_slice *value, time_t *date) {
+  char text[64];
+  if (value->length >= sizeof(text)) return 0;
+  memcpy(text, value->data, value->length);
+  text[value->length] = '\0';
+
+  struct tm tm;
+  memset(&tm, 0, sizeof(tm));
+  char *end = strptime(text, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+  if (end == NULL || *end != '\0') return 0;
+  *date = timegm(&tm);
+  return 1;
+}
+
+/*
+ * Renders the strong ETag of RESPONSE into BUFFER. It changes whenever the
+ * file the body comes from does, and differs between encodings of the same
+ * file. Returns its length, or -1 if RESPONSE has no validators.
+ */
+int http_format_etag(struct http_response *response, char *buffer, size_t size) {
+  if (response->last_modified.tv_sec == 0) return -1;
+  int length = snprintf(buffer, size, "\"%llx-%llx.%lx%s%s\"",
+      (unsigned long long) response->size, (unsigned long long) response->last_modified.tv_sec,
+      response->last_modified.tv_nsec, response->content_encoding != NULL ? "-" : "",
+      response->content_encoding != NULL ? response->content_encoding : "");
+  if (length < 0 || (size_t) length >= size) return -1;
+  return length;
+}
+
+/*
+ * Renders the status line and headers of RESPONSE into BUFFER. Returns the
+ * number of bytes written, or -1 if they do not fit.
+ */
+int http_format_headers(struct http_response *response, char *buffer, size_t size) {
+  struct http_builder builder;
+  http_builder_init(&builder, buffer, size);
+  http_builder_start(&builder, response->status_code);
+
+  /* A 304 has no body: it only refreshes the metadata of the client's copy. */
+  int not_modified = response->status_code == 304;
+  if (!not_modified) http_builder_header(&builder, "Content-Type", response->content_type);
+  if (response->produce != NULL) {
+    if (response->chunked) http_builder_header(&builder, "Transfer-Encoding", "chunked");
+  } else if (!not_modified) {
+    http_builder_headerf(&builder, "Content-Length", "%zu", response->body_length);
+  }
+  if (response->content_encoding != NULL)
+    http_builder_header(&builder, "Content-Encoding", response->content_encoding);
+
+  if (response->status_code == 206) {
+    http_builder_headerf(&builder, "Content-Range", "bytes %llu-%llu/%zu",
+        (unsigned long long) response->body_offset,
+        (unsigned long long) response->body_offset + response->body_length - 1,
+        response->complete_length);
+  } else if (response->status_code == 416) {
+    http_builder_headerf(&builder, "Content-Range", "bytes */%zu", response->complete_length);
+  } else if (response->last_modified.tv_sec != 0 && response->produce == NULL) {
+    http_builder_header(&builder, "Accept-Ranges", "bytes");
+  }
+
+  char etag[96];
+  char date[64];
+  if (http_format_etag(response, etag, sizeof(etag)) >= 0
+      && http_format_date(response->last_modified.tv_sec, date, sizeof(date)) > 0) {
+    http_builder_header(&builder, "ETag", etag);
+    http_builder_header(&builder, "Last-Modified", date);
+  }
+
+  /* Caches must not hand a compressed body to a client that cannot take it,
+   * nor keep serving the uncompressed one to clients that can. */
+  if (response->content_encoding != NULL
+      || (response->content_type != NULL && http_mime_type_compressible(response->content_type)))
+    http_builder_header(&builder, "Vary", "Accept-Encoding");
+
+  http_builder_header(&builder, "Connection", response->keep_alive ? "keep-alive" : "close");
+  return http_builder_end(&builder);
+}
+
+/* Whether the If-None-Match list VALUE holds ETAG or "*". Comparison is weak,
+ * as RFC 7232 asks for this header. */
+static int http_etag_list_matches(struct http_slice *value, char *etag, size_t etag_length) {
+  char *end = value->data + value->length;
+  char *item = value->data;
+  while (item < end) {
+    char *item_end = memchr(item, ',', end - item);
+    if (item_end == NULL) item_end = end;
+
+    while (item < item_end && (*item == ' ' || *item == '\t')) item++;
+    char *tag_end = item_end;
+    while (tag_end > item && (tag_end[-1] == ' ' || tag_end[-1] == '\t')) tag_end--;
+    if (tag_end - item == 1 && *item == '*') return 1;
+    if (tag_end - item >= 2 && strncmp(item, "W/", 2) == 0) item += 2;
+    if ((size_t) (tag_end - item) == etag_length && strncmp(item, etag, etag_length) == 0)
+      return 1;
+    item = item_end + 1;
+  }
+  return 0;
+}
+
+/* Whether the Range of a request with If-Range VALUE is still to be served:
+ * only if the client's partial copy is the current one. */
+static int http_if_range_matches(struct http_slice *value, char *etag, size_t etag_length,
+    struct http_response *response) {
+  if (value->length > 0 && (value->data[0] == '"' || value->data[0] == 'W'))
+    return value->length == etag_length && strncmp(value->data, etag, etag_length) == 0;
+  time_t date;
+  return http_parse_date(value, &date) && date == response->last_modified.tv_sec;
+}
+
+static char *http_parse_number(char *c, char *end, size_t *number) {
+  char *digits = c;
+  *number = 0;
+  for (; c < end && *c >= '0' && *c <= '9'; c++) {
+    if (*number > (SIZE_MAX - 9) / 10) return NULL;
+    *number = *number * 10 + (*c - '0');
+  }
+  return c == digits ? NULL : c;
+}
+
+/*
+ * Parses a Range VALUE of the form "bytes=first-last", "bytes=first-" or
+ * "bytes=-suffix" against a body of LENGTH bytes into [*START, *END). Returns
+ * 1 for a range that can be served, 0 for one that cannot (it lies past the
+ * end of the body) and -1 for a header that is to be ignored: malformed, in
+ * other units, or asking for several ranges.
+ */
+static int http_parse_range(struct http_slice *value, size_t length, size_t *start,
+    size_t *end) {
+  char *c = value->data;
+  char *value_end = value->data + value->length;
+  if (value->length < 6 || strncasecmp(c, "bytes=", 6) != 0) return -1;
+  c += 6;
+  if (memchr(c, ',', value_end - c) != NULL) return -1;
+
+  size_t first, last;
+  if (c < value_end && *c == '-') {
+    if (http_parse_number(c + 1, value_end, &last) != value_end) return -1;
+    if (last == 0 || length == 0) return 0;
+    *start = last < length ? length - last : 0;
+    *end = length;
+    return 1;
+  }
+
+  c = http_parse_number(c, value_end, &first);
+  if (c == NULL || c == value_end || *c != '-') return -1;
+  if (c + 1 == value_end) {
+    last = SIZE_MAX - 1;
+  } else if (http_parse_number(c + 1, value_end, &last) != value_end || last < first) {
+    return -1;
+  }
+  if (first >= length) return 0;
+  *start = first;
+  *end = last < length ? last + 1 : length;
+  return 1;
+}
+
+/* Leaves RESPONSE without a body, and without a pre-rendered header for one. */
+static void http_response_drop_body(struct http_response *response) {
+  if (response->release == NULL) free(response->body);
+  response->body = NULL;
+  if (response->body_fd != -1) close(response->body_fd);
+  response->body_fd = -1;
+  response->body_offset = 0;
+  response->body_length = 0;
+  response->header = NULL;
+}
+
+/*
+ * Turns a 200 RESPONSE with validators into what the conditional and Range
+ * headers of REQUEST ask for: 304 Not Modified when the client's copy is
+ * still current, 206 Partial Content for a single byte range, or 416 for a
+ * range past the end. A request for several ranges gets the whole body, as
+ * RFC 7233 allows. A partial body is a window into the same buffer or file,
+ * so it is not copied either.
+ */
+void http_response_apply_conditions(struct http_request *request,
+    struct http_response *response) {
+  if (response->status_code != 200 || response->produce != NULL) return;
+  char etag[96];
+  int etag_length = http_format_etag(response, etag, sizeof(etag));
+  if (etag_length < 0) return;
+
+  /* If-Modified-Since only counts when there is no If-None-Match. */
+  int not_modified;
+  time_t date;
+  struct http_slice *value = http_request_header(request, "If-None-Match");
+  if (value != NULL) {
+    not_modified = http_etag_list_matches(value, etag, etag_length);
+  } else {
+    value = http_request_header(request, "If-Modified-Since");
+    not_modified = value != NULL && http_parse_date(value, &date)
+        && response->last_modified.tv_sec <= date;
+  }
+  if (not_modified) {
+    http_response_drop_body(response);
+    response->status_code = 304;
+    return;
+  }
+
+  value = http_request_header(request, "Range");
+  if (value == NULL) return;
+  struct http_slice *if_range = http_request_header(request, "If-Range");
+  if (if_range != NULL && !http_if_range_matches(if_range, etag, etag_length, response))
+    return;
+
+  size_t start, end;
+  switch (http_parse_range(value, response->body_length, &start, &end)) {
+    case -1:
+      return;
+    case 0:
+      response->complete_length = response->body_length;
+      http_response_drop_body(response);
+      response->status_code = 416;
+      return;
+  }
+  response->complete_length = response->body_length;
+  response->status_code = 206;
+  response->body_offset += start;
+  response->body_length = end - start;
+  response->header = NULL;
+}
+
+/*
+ * Fills BUFFER (of SIZE bytes, room for the framing included) with the next
+ * piece of a produced body, framed as a chunk if the response is chunked,
+ * and with the last chunk once the body is complete. Returns 0 when there is
+ * nothing left to send.
+ */
+size_t http_response_next_chunk(struct http_response *response, char *buffer, size_t size) {
+  if (response->produced) return 0;
+
+  /* A fixed-width size line, so the data can be produced in place. */
+  size_t prefix = response->chunked ? 10 : 0;
+  size_t suffix = response->chunked ? 2 : 0;
+  size_t length = response->produce(response->release_data, buffer + prefix,
+      size - prefix - suffix);
+
+  if (length == 0) {
+    response->produced = 1;
+    if (!response->chunked) return 0;
+    memcpy(buffer, "0\r\n\r\n", 5);
+    return 5;
+  }
+  if (!response->chunked) return length;
+
+  char size_line[32];
+  snprintf(size_line, sizeof(size_line), "%08zx\r\n", length);
+  memcpy(buffer, size_line, prefix);
+  memcpy(buffer + prefix + length, "\r\n", suffix);
+  return prefix + length + suffix;
+}
+
+void http_response_free(struct http_response *response) {
+  if (response->release != NULL) {
+    response->release(response->release_data);
+  } else {
+    free(response->body);
+  }
+  if (response->body_fd != -1) close(response->body_fd);
+  http_response_init(response);
+}
+
+char *http_get_mime_type(char *file_name) {
+  char *file_extension = strrchr(file_name, '.');
+  char *type = file_extension != NULL ? mime_lookup(file_extension + 1) : NULL;
+  return type != NULL ? type : MIME_DEFAULT_TYPE;
+}
+
+int http_mime_type_compressible(char *content_type) {
+  return strcmp(content_type, "text/html") == 0
+      || strcmp(content_type, "text/css") == 0
+      || strcmp(content_type, "application/javascript") == 0
+      || strcmp(content_type, "text/javascript") == 0;
 }
 
 size_t get_content_length(char* file_name) {
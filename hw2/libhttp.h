@@ -3,16 +3,22 @@
  *
  * Usage example:
  *
- *     // Returns NULL if an error was encountered.
- *     struct http_request *request = http_request_parse(fd);
+ *     struct http_request_buffer buffer = { .length = 0 };
+ *     struct http_request request;
+ *     http_request_init(&request);
+ *     if (http_request_read(fd, &buffer, &request) != HTTP_PARSE_COMPLETE) ...
  *
  *     ...
  *
- *     http_start_response(fd, 200);
- *     http_send_header(fd, "Content-type", http_get_mime_type("index.html"));
- *     http_send_header(fd, "Server", "httpserver/1.0");
- *     http_end_headers(fd);
- *     http_send_string(fd, "<html><body><a href='/'>Home</a></body></html>");
+ *     char *body = "<html><body><a href='/'>Home</a></body></html>";
+ *     char head[LIBHTTP_HEADER_MAX_SIZE];
+ *     struct http_builder builder;
+ *     http_builder_init(&builder, head, sizeof(head));
+ *     http_builder_start(&builder, 200);
+ *     http_builder_header(&builder, "Content-Type", http_get_mime_type("index.html"));
+ *     http_builder_headerf(&builder, "Content-Length", "%zu", strlen(body));
+ *     http_builder_end(&builder);
+ *     http_builder_send(fd, &builder, body, strlen(body));
  *
  *     close(fd);
  */
@@ -20,33 +26,200 @@
 #ifndef LIBHTTP_H
 #define LIBHTTP_H
 
+#include <stddef.h>
+#include <sys/types.h>
+#include <time.h>
+
+#define LIBHTTP_REQUEST_MAX_SIZE 8192
+
+#define LIBHTTP_MAX_HEADERS 32
+
+#define LIBHTTP_CHUNK_SIZE 16384
+
+#define LIBHTTP_HEADER_MAX_SIZE 1024
+
 /*
  * Functions for parsing an HTTP request.
+ *
+ * The parser is incremental and allocation-free: it runs over a buffer owned
+ * by the caller, can be fed more bytes as they arrive, and exposes every
+ * part of the request as a slice of that buffer.
  */
+struct http_slice {
+  char *data;
+  size_t length;
+};
+
+struct http_header {
+  struct http_slice name;
+  struct http_slice value;
+};
+
 struct http_request {
-  char *method;
-  char *path;
+  struct http_slice method;     /* Also null-terminated in place. */
+  struct http_slice path;       /* Also null-terminated in place. */
+  struct http_slice version;    /* Empty for a bare "GET /path" line. */
+  struct http_header headers[LIBHTTP_MAX_HEADERS];
+  int num_headers;
+  int keep_alive;       /* HTTP/1.1 default, or an explicit Connection header. */
+  size_t head_length;   /* Bytes up to and including the empty line. */
+  size_t body_length;   /* Content-Length; 0 without one. */
+  int has_content_length;   /* To catch a second, different Content-Length. */
+
+  /* Parser state, see http_request_parse_more. */
+  int parse_state;
+  size_t parse_offset;
 };
 
-struct http_request *http_request_parse(int fd);
+enum http_parse_status {
+  HTTP_PARSE_NEED_MORE,
+  HTTP_PARSE_COMPLETE,
+  HTTP_PARSE_ERROR,
+};
+
+void http_request_init(struct http_request *request);
+enum http_parse_status http_request_parse_more(struct http_request *request, char *buffer,
+    size_t length);
+enum http_parse_status http_request_parse_finish(struct http_request *request, char *buffer,
+    size_t length);
+struct http_slice *http_request_header(struct http_request *request, char *name);
+int http_request_accepts_encoding(struct http_request *request, char *coding);
+int http_parse_date(struct http_slice *value, time_t *date);
+enum http_parse_status http_request_peek_path(char *buffer, size_t length,
+    struct http_slice *path);
+
+/*
+ * Per-connection read buffer. Bytes that arrive after the current request
+ * head (pipelined requests) stay in the buffer for the next request.
+ */
+struct http_request_buffer {
+  char data[LIBHTTP_REQUEST_MAX_SIZE + 1];
+  size_t length;
+};
+
+enum http_parse_status http_request_read(int fd, struct http_request_buffer *buffer,
+    struct http_request *request);
+void http_request_consume(struct http_request_buffer *buffer, struct http_request *request);
+
+/* How many bytes REQUEST takes up in the buffer it was parsed from: its
+ * head and, once that is complete, its Content-Length body. */
+size_t http_request_length(struct http_request *request);
+
+/*
+ * Persistent connection policy, shared by the threaded server and the
+ * reactor. Beside the keep-alive timeout, which bounds the wait for the next
+ * request, a request head has to arrive in full within the header timeout
+ * once it has started, and a response that the client stops taking is cut
+ * off after the body timeout without progress.
+ */
+extern int http_keep_alive_timeout_ms;
+extern int http_keep_alive_max_requests;
+extern int http_header_timeout_ms;
+extern int http_body_timeout_ms;
 
 /*
  * Functions for sending an HTTP response.
+ *
+ * A response head is best put together with an http_builder, which collects
+ * the status line and headers in a caller-owned buffer (one per connection,
+ * say) so that they leave with the body in a single writev instead of one
+ * write per line. A head that does not fit marks the builder as overflowed
+ * and http_builder_end then returns -1.
+ *
+ * http_start_response and friends write every line straight to FD.
  */
+struct http_builder {
+  char *buffer;
+  size_t size;
+  size_t length;
+  int overflow;
+};
+
+void http_builder_init(struct http_builder *builder, char *buffer, size_t size);
+void http_builder_start(struct http_builder *builder, int status_code);
+void http_builder_header(struct http_builder *builder, char *key, char *value);
+void http_builder_headerf(struct http_builder *builder, char *key, char *format, ...)
+    __attribute__((format(printf, 3, 4)));
+void http_builder_append(struct http_builder *builder, char *data, size_t length);
+int http_builder_end(struct http_builder *builder);
+size_t http_builder_send(int fd, struct http_builder *builder, char *body, size_t body_length);
+
 void http_start_response(int fd, int status_code);
 void http_send_header(int fd, char *key, char *value);
 void http_end_headers(int fd);
 void http_send_string(int fd, char *data);
-void http_send_data(int fd, char *data, size_t size);
+size_t http_send_data(int fd, char *data, size_t size);
+
+size_t http_send_file(int fd, int file_fd, off_t offset, size_t size);
+
+/*
+ * A fully prepared response. The threaded server writes it out with
+ * http_send_response, the epoll reactor formats the headers with
+ * http_format_headers and writes them and the body without blocking.
+ *
+ * The body is BODY_LENGTH bytes starting at BODY_OFFSET, either of the BODY
+ * buffer or, when BODY_FD is not -1, of that file, in which case they are
+ * sent with sendfile and never copied into user space.
+ *
+ * A body that comes from a file carries validators: the file's SIZE and
+ * LAST_MODIFIED time (tv_sec 0 if there are none), from which the ETag and
+ * Last-Modified headers are derived. A 206 response sends part of a body of
+ * COMPLETE_LENGTH bytes, the one starting at BODY_OFFSET.
+ *
+ * A body whose length is not known upfront is instead generated piece by
+ * piece: PRODUCE(RELEASE_DATA, buffer, size) fills BUFFER with up to SIZE
+ * more bytes and returns how many, and 0 only once the body is complete.
+ * It is sent with chunked transfer encoding if CHUNKED is set (HTTP/1.1
+ * clients) and otherwise delimited by closing the connection, so KEEP_ALIVE
+ * must then be 0.
+ *
+ * A response may carry a pre-rendered HEADER block, which is then sent as-is
+ * instead of being formatted from the fields above. When RELEASE is set, the
+ * header and body are borrowed and http_response_free calls
+ * RELEASE(RELEASE_DATA) instead of freeing the body.
+ */
+struct http_response {
+  int status_code;
+  int keep_alive;
+  char *content_type;
+  char *content_encoding;       /* E.g. "gzip", or NULL. */
+  char *body;           /* Owned by the response, see http_response_free. */
+  int body_fd;          /* Owned by the response, see http_response_free. */
+  off_t body_offset;
+  size_t body_length;
+  off_t size;
+  struct timespec last_modified;
+  size_t complete_length;
+  char *header;
+  size_t header_length;
+  size_t (*produce)(void *release_data, char *buffer, size_t size);
+  int chunked;
+  int produced;         /* The whole produced body has been handed out. */
+  void (*release)(void *release_data);
+  void *release_data;
+};
+
+void http_response_init(struct http_response *response);
+size_t http_send_response(int fd, struct http_response *response);
+int http_format_headers(struct http_response *response, char *buffer, size_t size);
+int http_format_etag(struct http_response *response, char *buffer, size_t size);
+void http_response_apply_conditions(struct http_request *request,
+    struct http_response *response);
+size_t http_response_next_chunk(struct http_response *response, char *buffer, size_t size);
+void http_response_free(struct http_response *response);
 
 /*
- * Helper function: gets the Content-Type based on a file name.
+ * Helper function: gets the Content-Type based on a file name, from the table
+ * built by mime_init (see mime.h).
  */
 char *http_get_mime_type(char *file_name);
 
-int contains_index_html(char* path);
+/*
+ * Whether responses of CONTENT_TYPE are worth compressing.
+ */
+int http_mime_type_compressible(char *content_type);
 
-char* generate_content_from_directory(char* directory_name);
+int contains_index_html(char* path);
 
 size_t get_content_length(char* file_name);
 
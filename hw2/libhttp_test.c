@@ -0,0 +1,119 @@
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "libhttp.h"
+
+/* Parses the first request in TEXT out of BUFFER, as a server does. */
+enum http_parse_status parse(struct http_request_buffer *buffer, struct http_request *request,
+    char *text) {
+  buffer->length = strlen(text);
+  memcpy(buffer->data, text, buffer->length);
+  http_request_init(request);
+  return http_request_parse_more(request, buffer->data, buffer->length);
+}
+
+/* A head that arrives a few bytes at a time, split inside the request line
+ * and inside a header, is parsed as it comes and complete only once the
+ * empty line is in. */
+void test_head_in_pieces() {
+  struct http_request_buffer buffer;
+  struct http_request request;
+  char *text = "GET /my_documents/ HTTP/1.1\r\nHost: example.com\r\nAccept: */*\r\n\r\n";
+  size_t splits[] = { 2, 9, 20, 31, 40, 55, 61, 62 };
+  size_t total = strlen(text);
+  size_t i;
+
+  http_request_init(&request);
+  buffer.length = 0;
+  for (i = 0; i < sizeof(splits) / sizeof(splits[0]); i++) {
+    memcpy(buffer.data + buffer.length, text + buffer.length, splits[i] - buffer.length);
+    buffer.length = splits[i];
+    assert(http_request_parse_more(&request, buffer.data, buffer.length) == HTTP_PARSE_NEED_MORE);
+  }
+  memcpy(buffer.data + buffer.length, text + buffer.length, total - buffer.length);
+  buffer.length = total;
+  assert(http_request_parse_more(&request, buffer.data, buffer.length) == HTTP_PARSE_COMPLETE);
+
+  assert(strcmp(request.method.data, "GET") == 0);
+  assert(strcmp(request.path.data, "/my_documents/") == 0);
+  assert(request.version.length == 8 && strncmp(request.version.data, "HTTP/1.1", 8) == 0);
+  assert(request.num_headers == 2);
+  struct http_slice *host = http_request_header(&request, "Host");
+  assert(host != NULL && host->length == 11 && strncmp(host->data, "example.com", 11) == 0);
+  struct http_slice *accept = http_request_header(&request, "accept");
+  assert(accept != NULL && accept->length == 3 && strncmp(accept->data, "*/*", 3) == 0);
+  assert(request.head_length == total);
+  assert(request.keep_alive);
+}
+
+/* A body is skipped, and what follows it is the next request. */
+void test_body_is_skipped() {
+  struct http_request_buffer buffer;
+  struct http_request request;
+  char *text =
+    "POST /index.html HTTP/1.1\r\nContent-Length: 40\r\n\r\n"
+    "GET /my_documents/ HTTP/1.1\r\nHost: x\r\n\r\n"
+    "GET /next HTTP/1.1\r\n\r\n";
+
+  assert(parse(&buffer, &request, text) == HTTP_PARSE_COMPLETE);
+  assert(request.body_length == 40);
+  assert(request.keep_alive);
+  http_request_consume(&buffer, &request);
+
+  assert(http_request_parse_more(&request, buffer.data, buffer.length) == HTTP_PARSE_COMPLETE);
+  assert(strcmp(request.path.data, "/next") == 0);
+  http_request_consume(&buffer, &request);
+  assert(buffer.length == 0);
+}
+
+/* A body that has not arrived yet cannot be skipped: the connection is not
+ * kept alive, so it is never read as a request either. */
+void test_partial_body_closes() {
+  struct http_request_buffer buffer;
+  struct http_request request;
+  assert(parse(&buffer, &request,
+        "POST / HTTP/1.1\r\nContent-Length: 40\r\n\r\nGET /my_documents/ HTTP/1.1\r\n")
+      == HTTP_PARSE_COMPLETE);
+  assert(!request.keep_alive);
+}
+
+/* Framing the parser cannot be sure of is refused. */
+void test_ambiguous_framing_is_refused() {
+  struct http_request_buffer buffer;
+  struct http_request request;
+  assert(parse(&buffer, &request,
+        "POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n0\r\n\r\n") == HTTP_PARSE_ERROR);
+  assert(parse(&buffer, &request,
+        "POST / HTTP/1.1\r\nContent-Length: 4\r\nContent-Length: 5\r\n\r\nbody!") == HTTP_PARSE_ERROR);
+  assert(parse(&buffer, &request,
+        "POST / HTTP/1.1\r\nContent-Length: -4\r\n\r\n") == HTTP_PARSE_ERROR);
+  assert(parse(&buffer, &request,
+        "POST / HTTP/1.1\r\nContent-Length: 4\r\nContent-Length: 4\r\n\r\nbody")
+      == HTTP_PARSE_COMPLETE);
+  assert(request.body_length == 4);
+}
+
+/* Pipelined requests without bodies are still taken one at a time. */
+void test_pipelined_requests() {
+  struct http_request_buffer buffer;
+  struct http_request request;
+  assert(parse(&buffer, &request, "GET /a HTTP/1.1\r\n\r\nGET /b HTTP/1.0\r\n\r\n")
+      == HTTP_PARSE_COMPLETE);
+  assert(strcmp(request.path.data, "/a") == 0);
+  assert(request.keep_alive);
+  http_request_consume(&buffer, &request);
+  assert(http_request_parse_more(&request, buffer.data, buffer.length) == HTTP_PARSE_COMPLETE);
+  assert(strcmp(request.path.data, "/b") == 0);
+  assert(!request.keep_alive);
+}
+
+int main() {
+  test_head_in_pieces();
+  test_body_is_skipped();
+  test_partial_body_closes();
+  test_ambiguous_framing_is_refused();
+  test_pipelined_requests();
+  printf("libhttp test successful!\n");
+  return 0;
+}
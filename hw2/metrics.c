@@ -0,0 +1,289 @@
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "metrics.h"
+
+#define METRICS_SUB_BUCKETS (1 << METRICS_HISTOGRAM_PRECISION)
+#define METRICS_HISTOGRAM_SIZE (64 * METRICS_SUB_BUCKETS)
+#define METRICS_REPORT_SIZE 4096
+
+struct metrics_histogram_data {
+  unsigned long counts[METRICS_HISTOGRAM_SIZE];
+  unsigned long total;
+  unsigned long sum;
+  unsigned long max;
+};
+
+struct metrics_shard {
+  unsigned long counters[METRICS_NUM_COUNTERS];
+  struct metrics_histogram_data histograms[METRICS_NUM_HISTOGRAMS];
+  struct metrics_shard *next;
+  struct metrics_shard *next_free;
+} __attribute__((aligned(64)));
+
+static char *counter_names[METRICS_NUM_COUNTERS] = {
+  "connections",
+  "requests_1xx",
+  "requests_2xx",
+  "requests_3xx",
+  "requests_4xx",
+  "requests_5xx",
+  "bytes_sent",
+  "cache_hits",
+  "cache_misses",
+  "tunnels_opened",
+  "tunnels_closed",
+  "access_log_dropped",
+  "timeouts",
+  "shed",
+  "rate_limited",
+};
+
+static char *histogram_names[METRICS_NUM_HISTOGRAMS] = {
+  "queue_wait_us",
+  "handler_us",
+};
+
+struct metrics_gauge {
+  char *name;
+  long (*read)(void *data);
+  void *data;
+};
+
+static struct metrics_shard *shards;
+static __thread struct metrics_shard *local_shard;
+static pthread_once_t shard_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t shard_key;
+static pthread_mutex_t free_shards_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct metrics_shard *free_shards;
+
+static pthread_mutex_t gauges_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct metrics_gauge gauges[METRICS_MAX_GAUGES];
+static int num_gauges;
+
+/* Runs as a thread exits (pool workers come and go): its shard, counts and
+ * all, is handed on to the next thread that starts, so the list readers walk
+ * is as long as the most threads ever alive at once. */
+static void metrics_shard_release(void *data) {
+  struct metrics_shard *shard = data;
+  local_shard = NULL;
+  pthread_mutex_lock(&free_shards_mutex);
+  shard->next_free = free_shards;
+  free_shards = shard;
+  pthread_mutex_unlock(&free_shards_mutex);
+}
+
+static void metrics_shard_key_create() {
+  pthread_key_create(&shard_key, metrics_shard_release);
+}
+
+/* The calling thread's shard, taken over from an exited thread or created
+ * and pushed onto the list on first use. Shards are never freed. */
+static struct metrics_shard *metrics_shard() {
+  if (local_shard != NULL) return local_shard;
+  pthread_once(&shard_key_once, metrics_shard_key_create);
+
+  pthread_mutex_lock(&free_shards_mutex);
+  struct metrics_shard *shard = free_shards;
+  if (shard != NULL) free_shards = shard->next_free;
+  pthread_mutex_unlock(&free_shards_mutex);
+
+  if (shard == NULL) {
+    if (posix_memalign((void **) &shard, 64, sizeof(struct metrics_shard)) != 0) return NULL;
+    memset(shard, 0, sizeof(struct metrics_shard));
+    shard->next = __atomic_load_n(&shards, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&shards, &shard->next, shard, 1, __ATOMIC_RELEASE,
+          __ATOMIC_RELAXED));
+  }
+  pthread_setspecific(shard_key, shard);
+  return local_shard = shard;
+}
+
+/* Only the owning thread writes to a shard, so no read-modify-write
+ * instruction is needed; the atomic store just keeps readers from tearing. */
+static void shard_add(unsigned long *value, unsigned long amount) {
+  __atomic_store_n(value, __atomic_load_n(value, __ATOMIC_RELAXED) + amount, __ATOMIC_RELAXED);
+}
+
+void metrics_count(enum metrics_counter counter, unsigned long amount) {
+  struct metrics_shard *shard = metrics_shard();
+  if (shard != NULL) shard_add(&shard->counters[counter], amount);
+}
+
+void metrics_count_status(int status_code) {
+  if (status_code >= 100 && status_code < 600)
+    metrics_count(METRICS_REQUESTS_1XX + status_code / 100 - 1, 1);
+}
+
+static int histogram_index(unsigned long value) {
+  if (value < METRICS_SUB_BUCKETS) return value;
+  int exponent = 63 - __builtin_clzl(value);
+  int sub_bucket = (value >> (exponent - METRICS_HISTOGRAM_PRECISION))
+      & (METRICS_SUB_BUCKETS - 1);
+  return (exponent - METRICS_HISTOGRAM_PRECISION + 1) * METRICS_SUB_BUCKETS + sub_bucket;
+}
+
+/* The largest value that falls in bucket INDEX. */
+static unsigned long histogram_bucket_value(int index) {
+  if (index < METRICS_SUB_BUCKETS) return index;
+  int exponent = index / METRICS_SUB_BUCKETS + METRICS_HISTOGRAM_PRECISION - 1;
+  unsigned long sub_bucket = index % METRICS_SUB_BUCKETS;
+  return ((METRICS_SUB_BUCKETS + sub_bucket + 1) << (exponent - METRICS_HISTOGRAM_PRECISION))
+      - 1;
+}
+
+void metrics_record(enum metrics_histogram histogram, long value) {
+  struct metrics_shard *shard = metrics_shard();
+  if (shard == NULL) return;
+  struct metrics_histogram_data *data = &shard->histograms[histogram];
+  unsigned long sample = value > 0 ? value : 0;
+  shard_add(&data->counts[histogram_index(sample)], 1);
+  shard_add(&data->total, 1);
+  shard_add(&data->sum, sample);
+  if (sample > data->max) __atomic_store_n(&data->max, sample, __ATOMIC_RELAXED);
+}
+
+void metrics_add_gauge(char *name, long (*read)(void *data), void *data) {
+  pthread_mutex_lock(&gauges_mutex);
+  if (num_gauges < METRICS_MAX_GAUGES) {
+    gauges[num_gauges].name = name;
+    gauges[num_gauges].read = read;
+    gauges[num_gauges].data = data;
+    num_gauges++;
+  } else {
+    fprintf(stderr, "Too many gauges, not reporting %s\n", name);
+  }
+  pthread_mutex_unlock(&gauges_mutex);
+}
+
+long metrics_now_us() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+enum metrics_format metrics_stats_format(char *path, size_t length) {
+  size_t prefix_length = strlen(METRICS_PATH);
+  if (length < prefix_length || strncmp(path, METRICS_PATH, prefix_length) != 0)
+    return METRICS_NOT_STATS;
+  if (length == prefix_length) return METRICS_TEXT;
+  if (path[prefix_length] != '?') return METRICS_NOT_STATS;
+  return memmem(path + prefix_length, length - prefix_length, "format=json", 11) != NULL
+      ? METRICS_JSON : METRICS_TEXT;
+}
+
+static unsigned long histogram_percentile(struct metrics_histogram_data *data,
+    double percentile) {
+  unsigned long rank = (unsigned long) (percentile / 100 * data->total + 0.5);
+  if (rank == 0) rank = 1;
+  unsigned long seen = 0;
+  int i;
+  for (i = 0; i < METRICS_HISTOGRAM_SIZE; i++) {
+    seen += data->counts[i];
+    if (seen >= rank) {
+      unsigned long value = histogram_bucket_value(i);
+      return value < data->max ? value : data->max;
+    }
+  }
+  return data->max;
+}
+
+static void report_append(char *buffer, size_t size, size_t *length, char *format, ...) {
+  if (*length >= size) return;
+  va_list arguments;
+  va_start(arguments, format);
+  int written = vsnprintf(buffer + *length, size - *length, format, arguments);
+  va_end(arguments);
+  if (written > 0) *length += written;
+}
+
+/* Sums all shards and renders the result. Returns its length (truncated to
+ * SIZE). */
+static size_t metrics_format_report(enum metrics_format format, char *buffer, size_t size) {
+  unsigned long counters[METRICS_NUM_COUNTERS] = { 0 };
+  static __thread struct metrics_histogram_data histograms[METRICS_NUM_HISTOGRAMS];
+  memset(histograms, 0, sizeof(histograms));
+
+  struct metrics_shard *shard;
+  for (shard = __atomic_load_n(&shards, __ATOMIC_ACQUIRE); shard != NULL; shard = shard->next) {
+    int i, j;
+    for (i = 0; i < METRICS_NUM_COUNTERS; i++)
+      counters[i] += __atomic_load_n(&shard->counters[i], __ATOMIC_RELAXED);
+    for (i = 0; i < METRICS_NUM_HISTOGRAMS; i++) {
+      struct metrics_histogram_data *from = &shard->histograms[i];
+      struct metrics_histogram_data *into = &histograms[i];
+      for (j = 0; j < METRICS_HISTOGRAM_SIZE; j++)
+        into->counts[j] += __atomic_load_n(&from->counts[j], __ATOMIC_RELAXED);
+      into->total += __atomic_load_n(&from->total, __ATOMIC_RELAXED);
+      into->sum += __atomic_load_n(&from->sum, __ATOMIC_RELAXED);
+      unsigned long max = __atomic_load_n(&from->max, __ATOMIC_RELAXED);
+      if (max > into->max) into->max = max;
+    }
+  }
+
+  int json = format == METRICS_JSON;
+  size_t length = 0;
+  report_append(buffer, size, &length, json ? "{" : "");
+  int i;
+  for (i = 0; i < METRICS_NUM_COUNTERS; i++)
+    report_append(buffer, size, &length, json ? "\"%s\": %lu, " : "%s %lu\n",
+        counter_names[i], counters[i]);
+  /* Tunnels are opened and closed on different threads; the gauge is the
+   * difference of the two counters. */
+  report_append(buffer, size, &length, json ? "\"tunnels_active\": %lu" : "tunnels_active %lu\n",
+      counters[METRICS_TUNNELS_OPENED] - counters[METRICS_TUNNELS_CLOSED]);
+
+  /* Each name once, where it was first registered. */
+  pthread_mutex_lock(&gauges_mutex);
+  for (i = 0; i < num_gauges; i++) {
+    int j;
+    for (j = 0; j < i && strcmp(gauges[j].name, gauges[i].name) != 0; j++);
+    if (j < i) continue;
+    long value = 0;
+    for (j = i; j < num_gauges; j++)
+      if (strcmp(gauges[j].name, gauges[i].name) == 0) value += gauges[j].read(gauges[j].data);
+    report_append(buffer, size, &length, json ? ", \"%s\": %ld" : "%s %ld\n",
+        gauges[i].name, value);
+  }
+  pthread_mutex_unlock(&gauges_mutex);
+
+  for (i = 0; i < METRICS_NUM_HISTOGRAMS; i++) {
+    struct metrics_histogram_data *data = &histograms[i];
+    report_append(buffer, size, &length,
+        json ? ", \"%s\": {\"count\": %lu, \"mean\": %.1f, \"p50\": %lu, \"p90\": %lu, "
+               "\"p99\": %lu, \"p999\": %lu, \"max\": %lu}"
+             : "%s count %lu mean %.1f p50 %lu p90 %lu p99 %lu p999 %lu max %lu\n",
+        histogram_names[i], data->total,
+        data->total > 0 ? (double) data->sum / data->total : 0.0,
+        histogram_percentile(data, 50), histogram_percentile(data, 90),
+        histogram_percentile(data, 99), histogram_percentile(data, 99.9), data->max);
+  }
+  report_append(buffer, size, &length, json ? "}\n" : "");
+  return length < size ? length : size;
+}
+
+void metrics_respond(enum metrics_format format, struct http_response *response) {
+  response->status_code = 200;
+  response->content_type = format == METRICS_JSON ? "application/json" : "text/plain";
+  response->body = malloc(METRICS_REPORT_SIZE);
+  if (response->body == NULL) {
+    response->status_code = 500;
+    return;
+  }
+  response->body_length = metrics_format_report(format, response->body, METRICS_REPORT_SIZE);
+}
+
+void metrics_send(int fd, enum metrics_format format) {
+  struct http_response response;
+  http_response_init(&response);
+  metrics_respond(format, &response);
+  metrics_count(METRICS_BYTES_SENT, http_send_response(fd, &response));
+  metrics_count_status(response.status_code);
+  http_response_free(&response);
+}
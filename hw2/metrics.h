@@ -0,0 +1,84 @@
+#ifndef __METRICS__
+#define __METRICS__
+
+#include <stddef.h>
+
+#include "libhttp.h"
+
+/* METRICS counts what the server does: connections, requests by status,
+ * bytes sent, cache hits, proxy tunnels, timeouts and connections turned
+ * away, plus latency histograms of the time connections wait in a work queue
+ * and of the time spent building each response. Modules that keep their own
+ * state, such as the worker pools' size and queue depth, register gauges,
+ * read whenever a report is rendered.
+ *
+ * Every thread updates its own shard, registered lock-free on first use and
+ * handed on, counts intact, to a later thread once it exits, so recording is
+ * a handful of plain stores on a cache line no other thread writes. Readers sum the shards with relaxed loads; a report is therefore a
+ * slightly blurred snapshot, never a torn counter.
+ *
+ * Reports are served at METRICS_PATH, as text or, with ?format=json, as
+ * JSON. */
+
+#define METRICS_PATH "/__stats"
+
+/* Histograms are exact below 2^METRICS_HISTOGRAM_PRECISION and within about
+ * 6% above. */
+#define METRICS_HISTOGRAM_PRECISION 4
+
+#define METRICS_MAX_GAUGES 64
+
+enum metrics_counter {
+  METRICS_CONNECTIONS,
+  METRICS_REQUESTS_1XX,
+  METRICS_REQUESTS_2XX,
+  METRICS_REQUESTS_3XX,
+  METRICS_REQUESTS_4XX,
+  METRICS_REQUESTS_5XX,
+  METRICS_BYTES_SENT,
+  METRICS_CACHE_HITS,
+  METRICS_CACHE_MISSES,
+  METRICS_TUNNELS_OPENED,
+  METRICS_TUNNELS_CLOSED,
+  METRICS_ACCESS_LOG_DROPPED,
+  METRICS_TIMEOUTS,         /* Connections cut off by a deadline. */
+  METRICS_SHED,             /* Connections turned away under overload. */
+  METRICS_RATE_LIMITED,     /* Requests over their client's rate limit. */
+  METRICS_NUM_COUNTERS,
+};
+
+enum metrics_histogram {
+  METRICS_QUEUE_WAIT_US,    /* From pool_submit until a worker picks it up. */
+  METRICS_HANDLER_US,       /* Building a response, file I/O included. */
+  METRICS_NUM_HISTOGRAMS,
+};
+
+enum metrics_format {
+  METRICS_NOT_STATS = -1,
+  METRICS_TEXT,
+  METRICS_JSON,
+};
+
+void metrics_count(enum metrics_counter counter, unsigned long amount);
+void metrics_count_status(int status_code);
+void metrics_record(enum metrics_histogram histogram, long value);
+
+/* Reports READ(DATA) as NAME. Gauges registered under the same name (one
+ * per pool, say) are reported as their sum. */
+void metrics_add_gauge(char *name, long (*read)(void *data), void *data);
+
+/* A monotonic clock in microseconds, cheap enough to call per request. */
+long metrics_now_us();
+
+/* Whether the request path PATH (LENGTH bytes) asks for a report, and in
+ * which format. */
+enum metrics_format metrics_stats_format(char *path, size_t length);
+
+/* Fills RESPONSE with a report in FORMAT. */
+void metrics_respond(enum metrics_format format, struct http_response *response);
+
+/* Sends a report in FORMAT on FD, as the last response of its connection.
+ * For the proxy, which otherwise never answers requests itself. */
+void metrics_send(int fd, enum metrics_format format);
+
+#endif
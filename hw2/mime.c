@@ -0,0 +1,197 @@
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "mime.h"
+
+/* Extensions per bucket on average, and how many tries a bucket gets to find
+ * a seed before the table is rebuilt with more slots. */
+#define MIME_BUCKET_SIZE 4
+#define MIME_MAX_SEED (1 << 16)
+
+struct mime_entry {
+  char *extension;          /* Lower case. */
+  char *type;
+  size_t bucket;
+};
+
+static char *builtin_types[][2] = {
+  { "html", "text/html" },
+  { "htm", "text/html" },
+  { "jpg", "image/jpeg" },
+  { "jpeg", "image/jpeg" },
+  { "png", "image/png" },
+  { "css", "text/css" },
+  { "js", "application/javascript" },
+  { "pdf", "application/pdf" },
+};
+
+static struct mime_entry *entries;
+static size_t num_entries;
+static size_t entries_capacity;
+
+/* The perfect hash: an extension's bucket picks the seed that finds its slot. */
+static unsigned int *seeds;
+static size_t num_buckets;
+static struct mime_entry **slots;
+static size_t num_slots;
+static size_t *bucket_sizes;
+
+static unsigned int mime_hash(char *extension, unsigned int seed) {
+  unsigned int hash = 2166136261u ^ (seed * 0x9e3779b9u);
+  while (*extension) {
+    hash ^= (unsigned char) *extension++;
+    hash *= 16777619u;
+  }
+  /* FNV alone spreads short keys poorly over the low bits. */
+  hash ^= hash >> 16;
+  hash *= 0x85ebca6bu;
+  hash ^= hash >> 13;
+  hash *= 0xc2b2ae35u;
+  hash ^= hash >> 16;
+  return hash;
+}
+
+/* Copies EXTENSION into BUFFER in lower case. Returns 0 if it is empty or
+ * longer than any extension in the table may be. */
+static int mime_normalize(char *extension, char *buffer) {
+  size_t i;
+  for (i = 0; extension[i] != '\0'; i++) {
+    if (i == MIME_MAX_EXTENSION_LENGTH) return 0;
+    buffer[i] = tolower((unsigned char) extension[i]);
+  }
+  buffer[i] = '\0';
+  return i > 0;
+}
+
+/* Maps EXTENSION to TYPE, replacing an earlier mapping. Returns -1 if out of
+ * memory. */
+static int mime_add(char *extension, char *type) {
+  char normalized[MIME_MAX_EXTENSION_LENGTH + 1];
+  if (!mime_normalize(extension, normalized)) return 0;
+
+  size_t i;
+  for (i = 0; i < num_entries; i++) {
+    if (strcmp(entries[i].extension, normalized) == 0) {
+      entries[i].type = type;
+      return 0;
+    }
+  }
+
+  if (num_entries == entries_capacity) {
+    size_t capacity = entries_capacity > 0 ? entries_capacity * 2 : 64;
+    struct mime_entry *grown = realloc(entries, capacity * sizeof(struct mime_entry));
+    if (grown == NULL) return -1;
+    entries = grown;
+    entries_capacity = capacity;
+  }
+  entries[num_entries].extension = strdup(normalized);
+  if (entries[num_entries].extension == NULL) return -1;
+  entries[num_entries].type = type;
+  num_entries++;
+  return 0;
+}
+
+static int mime_load(char *file_name) {
+  FILE *file = fopen(file_name, "r");
+  if (file == NULL) return -1;
+
+  char *line = NULL;
+  size_t line_capacity = 0;
+  int result = 0;
+  while (result == 0 && getline(&line, &line_capacity, file) != -1) {
+    char *comment = strchr(line, '#');
+    if (comment != NULL) *comment = '\0';
+
+    char *save_pointer;
+    char *type = strtok_r(line, " \t\r\n", &save_pointer);
+    char *extension = type != NULL ? strtok_r(NULL, " \t\r\n", &save_pointer) : NULL;
+    if (extension == NULL) continue;
+
+    /* Shared by all extensions on the line, and kept for good. */
+    if ((type = strdup(type)) == NULL) result = -1;
+    for (; result == 0 && extension != NULL;
+        extension = strtok_r(NULL, " \t\r\n", &save_pointer))
+      result = mime_add(extension, type);
+  }
+  if (ferror(file)) result = -1;
+  free(line);
+  fclose(file);
+  return result;
+}
+
+/* Largest buckets first, so they are placed while most slots are free. */
+static int mime_compare_entries(const void *a, const void *b) {
+  const struct mime_entry *entry_a = a, *entry_b = b;
+  if (bucket_sizes[entry_a->bucket] != bucket_sizes[entry_b->bucket])
+    return bucket_sizes[entry_a->bucket] > bucket_sizes[entry_b->bucket] ? -1 : 1;
+  return entry_a->bucket < entry_b->bucket ? -1 : entry_a->bucket > entry_b->bucket;
+}
+
+/* Finds every bucket a seed under which its extensions land in distinct,
+ * free slots among SLOT_COUNT. Returns 0 if some bucket has none, -1 if out
+ * of memory. */
+static int mime_build(size_t slot_count) {
+  free(slots);
+  num_slots = slot_count;
+  slots = calloc(num_slots, sizeof(struct mime_entry *));
+  if (slots == NULL) return -1;
+
+  size_t first;
+  size_t last;
+  for (first = 0; first < num_entries; first = last) {
+    size_t bucket = entries[first].bucket;
+    for (last = first; last < num_entries && entries[last].bucket == bucket; last++);
+
+    unsigned int seed;
+    for (seed = 1; seed < MIME_MAX_SEED; seed++) {
+      size_t i;
+      for (i = first; i < last; i++) {
+        size_t slot = mime_hash(entries[i].extension, seed) % num_slots;
+        if (slots[slot] != NULL) break;
+        slots[slot] = &entries[i];
+      }
+      if (i == last) break;
+      /* Take back what this seed placed. */
+      while (i-- > first) slots[mime_hash(entries[i].extension, seed) % num_slots] = NULL;
+    }
+    if (seed == MIME_MAX_SEED) return 0;
+    seeds[bucket] = seed;
+  }
+  return 1;
+}
+
+int mime_init(char *file_name) {
+  size_t i;
+  for (i = 0; i < sizeof(builtin_types) / sizeof(builtin_types[0]); i++)
+    if (mime_add(builtin_types[i][0], builtin_types[i][1]) == -1) return -1;
+  if (file_name != NULL && mime_load(file_name) == -1) return -1;
+
+  num_buckets = num_entries / MIME_BUCKET_SIZE + 1;
+  seeds = calloc(num_buckets, sizeof(unsigned int));
+  bucket_sizes = calloc(num_buckets, sizeof(size_t));
+  if (seeds == NULL || bucket_sizes == NULL) return -1;
+  for (i = 0; i < num_entries; i++) {
+    entries[i].bucket = mime_hash(entries[i].extension, 0) % num_buckets;
+    bucket_sizes[entries[i].bucket]++;
+  }
+  qsort(entries, num_entries, sizeof(struct mime_entry), mime_compare_entries);
+  free(bucket_sizes);
+  bucket_sizes = NULL;
+
+  /* About 80% full; a table that cannot be placed gets more room. */
+  size_t slot_count = num_entries + num_entries / 4 + 1;
+  int built;
+  while ((built = mime_build(slot_count)) == 0) slot_count *= 2;
+  return built == 1 ? 0 : -1;
+}
+
+char *mime_lookup(char *extension) {
+  char normalized[MIME_MAX_EXTENSION_LENGTH + 1];
+  if (num_slots == 0 || !mime_normalize(extension, normalized)) return NULL;
+
+  unsigned int seed = seeds[mime_hash(normalized, 0) % num_buckets];
+  struct mime_entry *entry = slots[mime_hash(normalized, seed) % num_slots];
+  return entry != NULL && strcmp(entry->extension, normalized) == 0 ? entry->type : NULL;
+}
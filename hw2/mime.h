@@ -0,0 +1,26 @@
+#ifndef __MIME__
+#define __MIME__
+
+/* MIME maps file extensions to Content-Types. The table starts out with the
+ * handful of types the server has always known and can be extended, or
+ * overridden, from a mime.types file ("type ext1 ext2 ...", one type per
+ * line, # starts a comment).
+ *
+ * Once loaded, the table is turned into a perfect hash: extensions are
+ * spread over small buckets, and every bucket gets a seed under which its
+ * extensions hash to distinct slots. A lookup is two hashes and one string
+ * compare however many types there are, and never takes a lock, since the
+ * table does not change after mime_init. Extensions match case-insensitively. */
+
+#define MIME_MAX_EXTENSION_LENGTH 32
+#define MIME_DEFAULT_TYPE "text/plain"
+
+/* Builds the table from the built-in types and, if FILE_NAME is not NULL,
+ * the mime.types file FILE_NAME. Must be called before the first lookup.
+ * Returns -1 (with errno set) if the file cannot be read. */
+int mime_init(char *file_name);
+
+/* Returns the type of EXTENSION (without the dot), or NULL if unknown. */
+char *mime_lookup(char *extension);
+
+#endif
@@ -0,0 +1,373 @@
+#define _GNU_SOURCE
+#include <limits.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include "admission.h"
+#include "metrics.h"
+#include "pool.h"
+
+/* Tries every other worker's queue once, starting after WORKER. */
+static int pool_steal(pool_worker_t *worker, int *client_socket_fd, long *push_time_us) {
+  pool_t *pool = worker->pool;
+  int num_workers = __atomic_load_n(&pool->num_workers, __ATOMIC_RELAXED);
+  int i;
+  for (i = 1; i < num_workers; i++) {
+    pool_worker_t *victim = &pool->workers[(worker->index + i) % num_workers];
+    if (victim != worker && wq_try_pop(&victim->queue, client_socket_fd, push_time_us)) {
+      __atomic_add_fetch(&worker->steals, 1, __ATOMIC_RELAXED);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static int pool_find_work(pool_worker_t *worker, int *client_socket_fd, long *push_time_us) {
+  if (!wq_try_pop(&worker->queue, client_socket_fd, push_time_us)
+      && !pool_steal(worker, client_socket_fd, push_time_us))
+    return 0;
+  __atomic_sub_fetch(&worker->pool->queued, 1, __ATOMIC_RELAXED);
+  return 1;
+}
+
+/* Whether a connection that waited DELAY_US (as of NOW_US) is to be shed.
+ * Workers call this concurrently: whichever sees the interval end first
+ * judges it, and the shortest delay is kept with compare-and-swap. */
+static int pool_should_shed(pool_t *pool, long delay_us, long now_us) {
+  if (pool->target_us <= 0) return 0;
+
+  long interval_end_us = __atomic_load_n(&pool->interval_end_us, __ATOMIC_RELAXED);
+  if (now_us >= interval_end_us && __atomic_compare_exchange_n(&pool->interval_end_us,
+        &interval_end_us, now_us + pool->interval_us, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    long min_delay_us = __atomic_exchange_n(&pool->min_delay_us, LONG_MAX, __ATOMIC_RELAXED);
+    __atomic_store_n(&pool->overloaded, min_delay_us > pool->target_us, __ATOMIC_RELAXED);
+  }
+
+  long min_delay_us = __atomic_load_n(&pool->min_delay_us, __ATOMIC_RELAXED);
+  while (delay_us < min_delay_us && !__atomic_compare_exchange_n(&pool->min_delay_us,
+        &min_delay_us, delay_us, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+  return __atomic_load_n(&pool->overloaded, __ATOMIC_RELAXED) && delay_us > pool->target_us;
+}
+
+/* Serves (or sheds) a connection WORKER has taken off a queue. */
+static void pool_worker_serve(pool_worker_t *worker, int client_socket_fd, long push_time_us) {
+  pool_t *pool = worker->pool;
+  long now_us = metrics_now_us();
+  metrics_record(METRICS_QUEUE_WAIT_US, now_us - push_time_us);
+  if (pool_should_shed(pool, now_us - push_time_us, now_us)) {
+    admission_reject(client_socket_fd, 503);
+    __atomic_add_fetch(&worker->shed, 1, __ATOMIC_RELAXED);
+    return;
+  }
+  __atomic_store_n(&worker->busy, 1, __ATOMIC_RELAXED);
+  pool->handler(client_socket_fd);
+  __atomic_store_n(&worker->busy, 0, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&worker->served, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Takes WORKER, which has been idle for the idle timeout, out of the pool if
+ * it is the last active worker and the pool is above its minimum. Returns 0
+ * if it is to stay.
+ *
+ * The acceptor picks a queue from the active workers without a lock, so it
+ * may still be pushing onto this worker's queue after it has been taken out.
+ * It marks every push with POOL->submitting: a worker that sees the flag
+ * clear after shrinking the pool knows that later pushes go elsewhere (they
+ * are ordered with its store to num_workers), and only has to serve what is
+ * on its own queue before it goes.
+ */
+static int pool_retire(pool_worker_t *worker) {
+  pool_t *pool = worker->pool;
+  pthread_mutex_lock(&pool->resize_mutex);
+  int num_workers = pool->num_workers;
+  if (worker->index != num_workers - 1 || num_workers <= pool->min_workers) {
+    pthread_mutex_unlock(&pool->resize_mutex);
+    return 0;
+  }
+  __atomic_store_n(&pool->num_workers, num_workers - 1, __ATOMIC_SEQ_CST);
+  pthread_mutex_unlock(&pool->resize_mutex);
+
+  while (__atomic_load_n(&pool->submitting, __ATOMIC_SEQ_CST))
+    sched_yield();
+  int client_socket_fd;
+  long push_time_us;
+  while (wq_try_pop(&worker->queue, &client_socket_fd, &push_time_us)) {
+    __atomic_sub_fetch(&pool->queued, 1, __ATOMIC_RELAXED);
+    pool_worker_serve(worker, client_socket_fd, push_time_us);
+  }
+
+  __atomic_add_fetch(&pool->retired, 1, __ATOMIC_RELAXED);
+  __atomic_store_n(&worker->running, 0, __ATOMIC_RELEASE);
+  return 1;
+}
+
+static void *pool_worker_job(void *args) {
+  pool_worker_t *worker = args;
+  pool_t *pool = worker->pool;
+  int client_socket_fd;
+  long push_time_us;
+
+  __atomic_sub_fetch(&pool->starting_workers, 1, __ATOMIC_SEQ_CST);
+  while (1) {
+    while (!pool_find_work(worker, &client_socket_fd, &push_time_us)) {
+      /* The queues ran dry, so there is no standing backlog. */
+      __atomic_store_n(&pool->min_delay_us, 0, __ATOMIC_RELAXED);
+      int sequence = wq_event_prepare(&pool->work_available);
+      if (pool_find_work(worker, &client_socket_fd, &push_time_us)) {
+        wq_event_cancel(&pool->work_available);
+        break;
+      }
+      __atomic_add_fetch(&pool->idle_workers, 1, __ATOMIC_SEQ_CST);
+      int woken = wq_event_wait_timeout(&pool->work_available, sequence, pool->idle_ms);
+      __atomic_sub_fetch(&pool->idle_workers, 1, __ATOMIC_SEQ_CST);
+      if (!woken && pool_retire(worker)) return NULL;
+    }
+
+    pool_worker_serve(worker, client_socket_fd, push_time_us);
+  }
+
+  return NULL;
+}
+
+/* Starts a thread for the worker in slot INDEX. Returns 0 if it failed. */
+static int pool_start_worker(pool_t *pool, int index) {
+  pool_worker_t *worker = &pool->workers[index];
+  if (worker->queue.cells == NULL) {
+    wq_init(&worker->queue);
+    worker->pool = pool;
+    worker->index = index;
+  }
+  wq_set_high_water(&worker->queue, pool->queue_limit);
+
+  pthread_attr_t attributes;
+  pthread_attr_init(&attributes);
+  pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+  /* Set before the thread runs, so that its stack is first touched there. */
+  if (pool->pinned) pthread_attr_setaffinity_np(&attributes, sizeof(pool->cpus), &pool->cpus);
+  pthread_t thread;
+  __atomic_store_n(&worker->running, 1, __ATOMIC_RELAXED);
+  if (pthread_create(&thread, &attributes, pool_worker_job, worker) != 0) {
+    __atomic_store_n(&worker->running, 0, __ATOMIC_RELAXED);
+    pthread_attr_destroy(&attributes);
+    return 0;
+  }
+  pthread_attr_destroy(&attributes);
+  return 1;
+}
+
+/* Adds a worker, unless the pool is at its maximum or the slot is still
+ * held by a retiring worker. Returns the new worker, or NULL. */
+static pool_worker_t *pool_grow(pool_t *pool) {
+  pool_worker_t *worker = NULL;
+  pthread_mutex_lock(&pool->resize_mutex);
+  int num_workers = pool->num_workers;
+  __atomic_add_fetch(&pool->starting_workers, 1, __ATOMIC_SEQ_CST);
+  if (num_workers < pool->max_workers
+      && !__atomic_load_n(&pool->workers[num_workers].running, __ATOMIC_ACQUIRE)
+      && pool_start_worker(pool, num_workers)) {
+    worker = &pool->workers[num_workers];
+    __atomic_store_n(&pool->num_workers, num_workers + 1, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&pool->grown, 1, __ATOMIC_RELAXED);
+  } else {
+    __atomic_sub_fetch(&pool->starting_workers, 1, __ATOMIC_SEQ_CST);
+  }
+  pthread_mutex_unlock(&pool->resize_mutex);
+  return worker;
+}
+
+static int pool_worker_load(pool_worker_t *worker) {
+  return wq_size(&worker->queue) + __atomic_load_n(&worker->busy, __ATOMIC_RELAXED);
+}
+
+/* Picks the worker a new connection is queued on, from the first
+ * NUM_WORKERS. */
+static pool_worker_t *pool_choose_worker(pool_t *pool, int num_workers) {
+  unsigned int start = pool->next_worker++ % num_workers;
+  pool_worker_t *chosen = &pool->workers[start];
+  if (pool->balance == POOL_BALANCE_ROUND_ROBIN) return chosen;
+
+  /* Least loaded, ties broken round-robin. */
+  int chosen_load = pool_worker_load(chosen);
+  int i;
+  for (i = 1; i < num_workers && chosen_load > 0; i++) {
+    pool_worker_t *worker = &pool->workers[(start + i) % num_workers];
+    int load = pool_worker_load(worker);
+    if (load < chosen_load) {
+      chosen = worker;
+      chosen_load = load;
+    }
+  }
+  return chosen;
+}
+
+static long pool_gauge_workers(void *data) {
+  return __atomic_load_n(&((pool_t *) data)->num_workers, __ATOMIC_RELAXED);
+}
+
+static long pool_gauge_grown(void *data) {
+  return __atomic_load_n(&((pool_t *) data)->grown, __ATOMIC_RELAXED);
+}
+
+static long pool_gauge_retired(void *data) {
+  return __atomic_load_n(&((pool_t *) data)->retired, __ATOMIC_RELAXED);
+}
+
+static long pool_gauge_queued(void *data) {
+  return __atomic_load_n(&((pool_t *) data)->queued, __ATOMIC_RELAXED);
+}
+
+/* Retired workers' slots keep their counts, so every slot is summed. */
+static long pool_gauge_steals(void *data) {
+  pool_t *pool = data;
+  long steals = 0;
+  int i;
+  for (i = 0; i < pool->max_workers; i++)
+    steals += __atomic_load_n(&pool->workers[i].steals, __ATOMIC_RELAXED);
+  return steals;
+}
+
+pool_t *pool_create(int min_workers, int max_workers, long idle_ms, int balance,
+    cpu_set_t *cpus, void (*handler)(int)) {
+  if (min_workers < 1) min_workers = 1;
+  if (max_workers < min_workers) max_workers = min_workers;
+  pool_t *pool = calloc(1, sizeof(pool_t));
+  if (pool == NULL || posix_memalign((void **) &pool->workers, WQ_CACHE_LINE,
+        sizeof(pool_worker_t) * max_workers) != 0) {
+    perror("Failed to allocate thread pool");
+    exit(EXIT_FAILURE);
+  }
+  memset(pool->workers, 0, sizeof(pool_worker_t) * max_workers);
+  pool->min_workers = min_workers;
+  pool->max_workers = max_workers;
+  pool->idle_ms = idle_ms;
+  pthread_mutex_init(&pool->resize_mutex, NULL);
+  pool->queue_limit = WQ_CAPACITY;
+  if (cpus != NULL) {
+    pool->cpus = *cpus;
+    pool->pinned = 1;
+  }
+  pool->balance = balance;
+  pool->handler = handler;
+  wq_event_init(&pool->work_available);
+  pool->min_delay_us = LONG_MAX;
+
+  /* Queues are set up before any worker can go looking for work on them. */
+  int i;
+  for (i = 0; i < min_workers; i++) {
+    pool_worker_t *worker = &pool->workers[i];
+    wq_init(&worker->queue);
+    worker->pool = pool;
+    worker->index = i;
+  }
+  pool->num_workers = min_workers;
+  pool->starting_workers = min_workers;
+  for (i = 0; i < min_workers; i++) {
+    if (!pool_start_worker(pool, i)) {
+      perror("Failed to start worker thread");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  metrics_add_gauge("pool_workers", pool_gauge_workers, pool);
+  metrics_add_gauge("pool_grown", pool_gauge_grown, pool);
+  metrics_add_gauge("pool_retired", pool_gauge_retired, pool);
+  metrics_add_gauge("pool_steals", pool_gauge_steals, pool);
+  metrics_add_gauge("pool_queued", pool_gauge_queued, pool);
+  return pool;
+}
+
+void pool_default_size(int *min_workers, int *max_workers) {
+  long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  if (num_cpus < 1) num_cpus = 1;
+  long max = num_cpus * POOL_WORKERS_PER_CPU;
+
+  struct rlimit limit;
+  if (getrlimit(RLIMIT_NPROC, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY
+      && (long) limit.rlim_cur / 2 < max)
+    max = limit.rlim_cur / 2;
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY
+      && (long) limit.rlim_cur / POOL_FDS_PER_WORKER < max)
+    max = limit.rlim_cur / POOL_FDS_PER_WORKER;
+
+  *min_workers = num_cpus;
+  *max_workers = max > num_cpus ? max : num_cpus;
+}
+
+void pool_set_admission(pool_t *pool, size_t queue_limit, long target_ms, long interval_ms) {
+  pthread_mutex_lock(&pool->resize_mutex);
+  pool->queue_limit = queue_limit;
+  int i;
+  for (i = 0; i < pool->num_workers; i++)
+    wq_set_high_water(&pool->workers[i].queue, queue_limit);
+  pthread_mutex_unlock(&pool->resize_mutex);
+  pool->target_us = target_ms * 1000;
+  pool->interval_us = interval_ms * 1000;
+  pool->interval_end_us = metrics_now_us() + pool->interval_us;
+}
+
+/* Queues CLIENT_SOCKET_FD on a worker and wakes an idle worker, if any.
+ * Adds a worker if there are more connections queued than workers to take
+ * them; it starts out by stealing. Sheds the connection if every queue is
+ * full. Must be called from a single thread (the acceptor feeding this
+ * pool). */
+void pool_submit(pool_t *pool, int client_socket_fd) {
+  __atomic_store_n(&pool->submitting, 1, __ATOMIC_SEQ_CST);
+  int num_workers = __atomic_load_n(&pool->num_workers, __ATOMIC_SEQ_CST);
+  pool_worker_t *worker = pool_choose_worker(pool, num_workers);
+  int i;
+  for (i = 0; !wq_try_push(&worker->queue, client_socket_fd); i++) {
+    if (i == num_workers - 1) {
+      __atomic_store_n(&pool->submitting, 0, __ATOMIC_SEQ_CST);
+      admission_reject(client_socket_fd, 503);
+      __atomic_add_fetch(&pool->shed, 1, __ATOMIC_RELAXED);
+      return;
+    }
+    worker = &pool->workers[(worker->index + 1) % num_workers];
+  }
+  __atomic_store_n(&pool->submitting, 0, __ATOMIC_SEQ_CST);
+
+  int queued = __atomic_add_fetch(&pool->queued, 1, __ATOMIC_SEQ_CST);
+  if (num_workers < pool->max_workers
+      && queued > __atomic_load_n(&pool->idle_workers, __ATOMIC_SEQ_CST)
+          + __atomic_load_n(&pool->starting_workers, __ATOMIC_SEQ_CST))
+    pool_grow(pool);
+  wq_event_signal(&pool->work_available);
+}
+
+/* Renders per-worker queue depth, served, steal and shed counters, one
+ * worker per line, and what was shed because the queues were full. Returns
+ * the number of bytes written (truncated to SIZE). */
+int pool_format_stats(pool_t *pool, char *buffer, size_t size) {
+  size_t length = 0;
+  int num_workers = __atomic_load_n(&pool->num_workers, __ATOMIC_RELAXED);
+  int i;
+  int written = snprintf(buffer, size, "workers %d (%d to %d): grown %ld retired %ld\n",
+      num_workers, pool->min_workers, pool->max_workers,
+      __atomic_load_n(&pool->grown, __ATOMIC_RELAXED),
+      __atomic_load_n(&pool->retired, __ATOMIC_RELAXED));
+  if (written > 0) length += written;
+  for (i = 0; i < num_workers && length < size; i++) {
+    pool_worker_t *worker = &pool->workers[i];
+    written = snprintf(buffer + length, size - length,
+        "worker %d: depth %zu served %ld steals %ld shed %ld%s\n", i,
+        wq_size(&worker->queue),
+        __atomic_load_n(&worker->served, __ATOMIC_RELAXED),
+        __atomic_load_n(&worker->steals, __ATOMIC_RELAXED),
+        __atomic_load_n(&worker->shed, __ATOMIC_RELAXED),
+        __atomic_load_n(&worker->busy, __ATOMIC_RELAXED) ? " (busy)" : "");
+    if (written < 0) break;
+    length += written;
+  }
+  if (length < size) {
+    written = snprintf(buffer + length, size - length, "queues full: shed %ld\n",
+        __atomic_load_n(&pool->shed, __ATOMIC_RELAXED));
+    if (written > 0) length += written;
+  }
+  return length < size ? length : size;
+}
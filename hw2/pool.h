@@ -0,0 +1,101 @@
+#ifndef __POOL__
+#define __POOL__
+
+#include <pthread.h>
+#include <sched.h>
+#include <stddef.h>
+
+#include "wq.h"
+
+/* POOL is the thread pool behind --mode threads. Every worker owns a work
+ * queue; the acceptor hands each connection to one worker (round-robin or
+ * the least loaded one), and workers that run out of work steal from the
+ * others before going to sleep.
+ *
+ * A pool sizes itself between a minimum and a maximum number of workers.
+ * A worker holds a connection for as long as it stays alive, blocked in
+ * reads and writes most of the time, so CPUs say little about how many are
+ * needed: the acceptor adds a worker whenever more connections are queued
+ * than there are workers free to take them, and a worker that has found
+ * nothing to do for the idle timeout goes away again, the most recently
+ * added first.
+ *
+ * A pool sheds load rather than letting its queues grow: a connection that
+ * finds every queue at its high-water mark is answered with a 503 straight
+ * away (see admission.h). With a target delay, queues are also watched the
+ * way CoDel watches a router's: a queue that kept connections waiting
+ * longer than the target for a whole interval has a standing backlog, and
+ * until an interval goes by in which one got through faster, connections
+ * that waited longer than the target are shed as they come out. That drains
+ * the backlog, so the connections that are served keep a short wait.
+ *
+ * The number of workers, how many were added and retired, the steals and
+ * the connections queued are reported at METRICS_PATH, summed over pools;
+ * pool_format_stats breaks them down by worker. */
+
+#define POOL_BALANCE_ROUND_ROBIN 0
+#define POOL_BALANCE_LEAST_LOADED 1
+#define POOL_DEFAULT_INTERVAL_MS 100
+#define POOL_DEFAULT_IDLE_MS 10000
+#define POOL_WORKERS_PER_CPU 64       /* Default maximum, see pool_default_size. */
+#define POOL_FDS_PER_WORKER 4         /* Client, file or backend, and some spare. */
+
+typedef struct pool_worker {
+  wq_t queue;
+  struct pool *pool;
+  int index;
+  int running;          // Its thread is alive (if retiring, still draining).
+  int busy;             // Currently running the request handler.
+  long served;          // Connections handled, own or stolen.
+  long steals;          // Connections taken from other workers' queues.
+  long shed;            // Connections turned away by this worker.
+} __attribute__((aligned(WQ_CACHE_LINE))) pool_worker_t;
+
+typedef struct pool {
+  pool_worker_t *workers;     // max_workers slots, the first num_workers active.
+  int num_workers;
+  int min_workers;
+  int max_workers;
+  long idle_ms;               // How long a worker waits for work before retiring.
+  int idle_workers;           // Workers asleep waiting for work.
+  int starting_workers;       // Workers added that have not looked for work yet.
+  int queued;                 // Connections on the queues.
+  int submitting;             // Set while the acceptor pushes, see pool_retire.
+  pthread_mutex_t resize_mutex;
+  cpu_set_t cpus;             // Where workers run, if pinned.
+  int pinned;
+  long grown;
+  long retired;
+  size_t queue_limit;
+  int balance;
+  unsigned int next_worker;
+  wq_event_t work_available;  // Signalled on every submit, for idle workers.
+  void (*handler)(int);
+  long target_us;             // Queue delay to shed above; 0 never sheds.
+  long interval_us;
+  long interval_end_us;
+  long min_delay_us;          // Shortest queue delay in the current interval.
+  int overloaded;             // No delay in the last interval met the target.
+  long shed;                  // Connections turned away when submitted.
+} pool_t;
+
+/* Starts a pool of MIN_WORKERS workers, which grows up to MAX_WORKERS and
+ * shrinks back once workers have been idle for IDLE_MS. Workers are created
+ * on CPUS unless it is NULL. */
+pool_t *pool_create(int min_workers, int max_workers, long idle_ms, int balance,
+    cpu_set_t *cpus, void (*handler)(int));
+
+/* Bounds for a pool when none are given: a worker per CPU to begin with and,
+ * at most, POOL_WORKERS_PER_CPU per CPU, as far as RLIMIT_NPROC (shared with
+ * the rest of the process) and RLIMIT_NOFILE (POOL_FDS_PER_WORKER each)
+ * allow. */
+void pool_default_size(int *min_workers, int *max_workers);
+
+/* Caps every worker's queue at QUEUE_LIMIT connections and, unless TARGET_MS
+ * is 0, sheds connections that waited longer than TARGET_MS while the queues
+ * have not met that target for INTERVAL_MS. */
+void pool_set_admission(pool_t *pool, size_t queue_limit, long target_ms, long interval_ms);
+void pool_submit(pool_t *pool, int client_socket_fd);
+int pool_format_stats(pool_t *pool, char *buffer, size_t size);
+
+#endif
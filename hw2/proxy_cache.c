@@ -0,0 +1,736 @@
+#define _GNU_SOURCE
+
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "metrics.h"
+#include "proxy_cache.h"
+#include "upstream.h"
+#include "utlist.h"
+
+#define PROXY_CACHE_NUM_BUCKETS 256
+#define PROXY_CACHE_HEAD_SIZE 8192      /* Largest backend response head we parse. */
+#define PROXY_CACHE_HEADERS_SIZE 2048   /* Largest header block we keep. */
+#define PROXY_CACHE_FILE_PREFIX "proxy-cache-"
+
+struct proxy_cache_entry {
+  char *key;
+  unsigned int hash;
+
+  int status_code;
+  char *headers;            /* Backend header lines passed on as-is. */
+  size_t headers_length;
+  char *body;               /* NULL in a stub, whose body is only on disk. */
+  size_t body_length;
+  char *disk_file;          /* NULL unless the body has been written to disk. */
+
+  long stored_ms;
+  long age;                 /* Seconds the response was old when stored. */
+  long expires_ms;
+  int fetching;             /* A placeholder for a fetch in flight. */
+  int pass;                 /* A marker for a key that is not cacheable. */
+
+  int refcount;             /* One for the shard, one per response using it. */
+  int cached;               /* Still reachable from its shard. */
+  int in_memory;            /* On the memory LRU (not a stub or placeholder). */
+  struct proxy_cache_entry *bucket_next;
+  struct proxy_cache_entry *prev, *next;            /* Memory LRU, newest last. */
+  struct proxy_cache_entry *disk_prev, *disk_next;  /* Disk LRU, newest last. */
+};
+
+struct proxy_cache_shard {
+  pthread_mutex_t mutex;
+  pthread_cond_t fetched;   /* Signalled whenever a fetch settles. */
+  struct proxy_cache_entry *buckets[PROXY_CACHE_NUM_BUCKETS];
+  struct proxy_cache_entry *lru;
+  struct proxy_cache_entry *disk_lru;
+  size_t size;
+  size_t disk_size;
+};
+
+/* A parsed backend response head. */
+struct proxy_cache_response {
+  int status_code;
+  struct http_header headers[LIBHTTP_MAX_HEADERS];
+  int num_headers;
+  size_t head_length;
+};
+
+static struct proxy_cache_shard shards[PROXY_CACHE_NUM_SHARDS];
+static size_t shard_capacity;
+static char *disk_directory;
+static size_t disk_shard_capacity;
+static unsigned long disk_file_counter;
+
+/* Request headers that are not passed on when fetching: hop-by-hop ones, and
+ * those that would get back a response only this client can use. */
+static char *FETCH_SKIPPED_HEADERS[] = {
+  "Connection", "Keep-Alive", "Proxy-Connection", "Proxy-Authorization", "TE", "Upgrade",
+  "Accept-Encoding", "If-Modified-Since", "If-None-Match", "If-Match", "If-Unmodified-Since",
+  "If-Range", NULL
+};
+
+/* Response headers that are not stored: hop-by-hop ones, and those that are
+ * rendered again for every response served from the cache. */
+static char *STORE_SKIPPED_HEADERS[] = {
+  "Connection", "Keep-Alive", "Proxy-Connection", "TE", "Trailer", "Transfer-Encoding",
+  "Upgrade", "Content-Length", "Age", NULL
+};
+
+/* CLOCK_MONOTONIC_COARSE is served from the vDSO, so this is not a syscall. */
+static long now_ms() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+  return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static unsigned int hash_string(char *string) {
+  unsigned int hash = 2166136261u;
+  while (*string) {
+    hash ^= (unsigned char) *string++;
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static int slice_equals(struct http_slice *slice, char *string) {
+  size_t length = strlen(string);
+  return slice->length == length && strncasecmp(slice->data, string, length) == 0;
+}
+
+static int header_name_in(struct http_slice *name, char **names) {
+  for (; *names != NULL; names++)
+    if (slice_equals(name, *names)) return 1;
+  return 0;
+}
+
+static struct http_slice *response_header(struct proxy_cache_response *response, char *name) {
+  int i;
+  for (i = 0; i < response->num_headers; i++)
+    if (slice_equals(&response->headers[i].name, name)) return &response->headers[i].value;
+  return NULL;
+}
+
+/* Parses the non-negative number of seconds at DATA, as in max-age=N or
+ * Age: N. Returns -1 if there is none before END. */
+static long parse_seconds(char *data, char *end) {
+  long seconds = -1;
+  if (data < end && *data == '"') data++;
+  for (; data < end && isdigit((unsigned char) *data); data++) {
+    seconds = (seconds < 0 ? 0 : seconds) * 10 + (*data - '0');
+    if (seconds > INT_MAX) return INT_MAX;
+  }
+  return seconds;
+}
+
+/* Looks for DIRECTIVE in the Cache-Control header VALUE. Returns 0 if it is
+ * absent; otherwise 1, with *ARGUMENT (if not NULL) set to its number of
+ * seconds, or -1 if it has none. */
+static int cache_control_has(struct http_slice *value, char *directive, long *argument) {
+  size_t directive_length = strlen(directive);
+  char *c = value->data;
+  char *end = value->data + value->length;
+  while (c < end) {
+    while (c < end && (*c == ' ' || *c == '\t' || *c == ',')) c++;
+    char *item = c;
+    while (c < end && *c != ',') c++;
+    size_t item_length = c - item;
+    while (item_length > 0 && (item[item_length - 1] == ' ' || item[item_length - 1] == '\t'))
+      item_length--;
+
+    if (item_length < directive_length || strncasecmp(item, directive, directive_length) != 0
+        || (item_length > directive_length && item[directive_length] != '='))
+      continue;
+    if (argument != NULL)
+      *argument = item_length > directive_length
+          ? parse_seconds(item + directive_length + 1, item + item_length) : -1;
+    return 1;
+  }
+  return 0;
+}
+
+/* Parses the status line and headers of a backend response, whose complete
+ * head is the first HEAD_LENGTH bytes of DATA. Returns 0 if it is malformed
+ * or has too many headers. */
+static int response_parse(char *data, size_t head_length,
+    struct proxy_cache_response *response) {
+  char *end = data + head_length;
+  if (head_length < 12 || strncmp(data, "HTTP/1.", 7) != 0 || data[8] != ' '
+      || !isdigit((unsigned char) data[9]) || !isdigit((unsigned char) data[10])
+      || !isdigit((unsigned char) data[11]))
+    return 0;
+  response->status_code = (data[9] - '0') * 100 + (data[10] - '0') * 10 + (data[11] - '0');
+  response->num_headers = 0;
+  response->head_length = head_length;
+
+  char *line = memchr(data, '\n', head_length) + 1;
+  while (line < end) {
+    char *line_end = memchr(line, '\n', end - line);
+    char *value_end = line_end > line && line_end[-1] == '\r' ? line_end - 1 : line_end;
+    if (value_end == line) break;
+
+    char *colon = memchr(line, ':', value_end - line);
+    if (colon == NULL || response->num_headers == LIBHTTP_MAX_HEADERS) return 0;
+    char *value = colon + 1;
+    while (value < value_end && (*value == ' ' || *value == '\t')) value++;
+    while (value_end > value && (value_end[-1] == ' ' || value_end[-1] == '\t')) value_end--;
+
+    struct http_header *header = &response->headers[response->num_headers++];
+    header->name.data = line;
+    header->name.length = colon - line;
+    header->value.data = value;
+    header->value.length = value_end - value;
+    line = line_end + 1;
+  }
+  return 1;
+}
+
+/* How many seconds RESPONSE may be served from the cache, or 0 if it may not
+ * be cached at all. Sets *AGE to how old the backend says it already is. */
+static long response_freshness(struct proxy_cache_response *response, long *age) {
+  if (response->status_code != 200 && response->status_code != 301
+      && response->status_code != 404)
+    return 0;
+  if (response_header(response, "Set-Cookie") != NULL) return 0;
+  /* Fetches never ask for compression, so a response that varies only on
+   * Accept-Encoding suits every client. */
+  struct http_slice *vary = response_header(response, "Vary");
+  if (vary != NULL && !slice_equals(vary, "Accept-Encoding")) return 0;
+
+  long lifetime = -1;
+  struct http_slice *cache_control = response_header(response, "Cache-Control");
+  if (cache_control != NULL) {
+    if (cache_control_has(cache_control, "no-store", NULL)
+        || cache_control_has(cache_control, "no-cache", NULL)
+        || cache_control_has(cache_control, "private", NULL))
+      return 0;
+    if (!cache_control_has(cache_control, "s-maxage", &lifetime))
+      cache_control_has(cache_control, "max-age", &lifetime);
+  }
+  if (lifetime < 0) {
+    struct http_slice *expires = response_header(response, "Expires");
+    struct http_slice *date = response_header(response, "Date");
+    time_t expires_time, date_time;
+    if (expires == NULL || !http_parse_date(expires, &expires_time)) return 0;
+    if (date == NULL || !http_parse_date(date, &date_time)) date_time = time(NULL);
+    lifetime = expires_time - date_time;
+  }
+
+  struct http_slice *age_header = response_header(response, "Age");
+  *age = age_header != NULL ? parse_seconds(age_header->data,
+      age_header->data + age_header->length) : 0;
+  if (*age < 0) *age = 0;
+  return lifetime > *age ? lifetime - *age : 0;
+}
+
+/* Copies the headers of RESPONSE worth keeping into BUFFER. Returns their
+ * length, or -1 if they do not fit. */
+static int response_format_headers(struct proxy_cache_response *response, char *buffer,
+    size_t size) {
+  size_t length = 0;
+  int i;
+  for (i = 0; i < response->num_headers; i++) {
+    struct http_header *header = &response->headers[i];
+    if (header_name_in(&header->name, STORE_SKIPPED_HEADERS)) continue;
+    int line_length = snprintf(buffer + length, size - length, "%.*s: %.*s\r\n",
+        (int) header->name.length, header->name.data,
+        (int) header->value.length, header->value.data);
+    if (line_length < 0 || (size_t) line_length >= size - length) return -1;
+    length += line_length;
+  }
+  return length;
+}
+
+/* Formats the request sent to a backend on a miss for REQUEST: the same GET
+ * as HTTP/1.0 with Connection: close, so the response ends where the
+ * connection does. Returns its length, or -1 if it does not fit in SIZE. */
+static int fetch_format_request(struct http_request *request, char *buffer, size_t size) {
+  int length = snprintf(buffer, size, "GET %s HTTP/1.0\r\n", request->path.data);
+  int i;
+  for (i = 0; i < request->num_headers && length >= 0 && (size_t) length < size; i++) {
+    struct http_header *header = &request->headers[i];
+    if (header_name_in(&header->name, FETCH_SKIPPED_HEADERS)) continue;
+    int line_length = snprintf(buffer + length, size - length, "%.*s: %.*s\r\n",
+        (int) header->name.length, header->name.data,
+        (int) header->value.length, header->value.data);
+    length = line_length < 0 ? -1 : length + line_length;
+  }
+  if (length >= 0 && (size_t) length < size) {
+    int line_length = snprintf(buffer + length, size - length, "Connection: close\r\n\r\n");
+    length = line_length < 0 ? -1 : length + line_length;
+  }
+  return length >= 0 && (size_t) length < size ? length : -1;
+}
+
+static size_t entry_cost(struct proxy_cache_entry *entry) {
+  return strlen(entry->key) + entry->headers_length + (entry->body ? entry->body_length : 0);
+}
+
+static void entry_release(struct proxy_cache_entry *entry) {
+  if (__atomic_sub_fetch(&entry->refcount, 1, __ATOMIC_ACQ_REL) > 0) return;
+  free(entry->key);
+  free(entry->headers);
+  free(entry->body);
+  free(entry->disk_file);
+  free(entry);
+}
+
+/* Sends ENTRY to FD as a response, its body from BODY_FD (an open copy of its
+ * disk file) if that is not -1. Returns whether the connection can stay
+ * open. */
+static int entry_send(int fd, struct proxy_cache_entry *entry, int body_fd, int keep_alive,
+    char *x_cache, int *status_code, size_t *bytes_sent) {
+  char head[LIBHTTP_HEADER_MAX_SIZE + PROXY_CACHE_HEADERS_SIZE];
+  struct http_builder builder;
+  http_builder_init(&builder, head, sizeof(head));
+  http_builder_start(&builder, entry->status_code);
+  http_builder_append(&builder, entry->headers, entry->headers_length);
+  http_builder_headerf(&builder, "Content-Length", "%zu", entry->body_length);
+  http_builder_headerf(&builder, "Age", "%ld", entry->age + (now_ms() - entry->stored_ms) / 1000);
+  http_builder_header(&builder, "X-Cache", x_cache);
+  http_builder_header(&builder, "Connection", keep_alive ? "keep-alive" : "close");
+  int head_length = http_builder_end(&builder);
+
+  *status_code = entry->status_code;
+  *bytes_sent = 0;
+  if (head_length < 0) return 0;
+  if (body_fd == -1) {
+    *bytes_sent = http_builder_send(fd, &builder, entry->body, entry->body_length);
+  } else {
+    *bytes_sent = http_send_data(fd, head, head_length);
+    if (*bytes_sent == (size_t) head_length)
+      *bytes_sent += http_send_file(fd, body_fd, 0, entry->body_length);
+  }
+  return keep_alive && *bytes_sent == head_length + entry->body_length;
+}
+
+/* Drops ENTRY from SHARD, and its disk file with it, and releases the
+ * shard's reference. Must be called with the shard locked. */
+static void shard_remove(struct proxy_cache_shard *shard, struct proxy_cache_entry *entry) {
+  struct proxy_cache_entry **bucket = &shard->buckets[entry->hash % PROXY_CACHE_NUM_BUCKETS];
+  LL_DELETE2(*bucket, entry, bucket_next);
+  if (entry->in_memory) {
+    DL_DELETE(shard->lru, entry);
+    shard->size -= entry_cost(entry);
+    entry->in_memory = 0;
+  }
+  if (entry->disk_file != NULL) {
+    DL_DELETE2(shard->disk_lru, entry, disk_prev, disk_next);
+    shard->disk_size -= entry->body_length;
+    unlink(entry->disk_file);
+  }
+  entry->cached = 0;
+  entry_release(entry);
+}
+
+static struct proxy_cache_entry *shard_find(struct proxy_cache_shard *shard, char *key,
+    unsigned int hash) {
+  struct proxy_cache_entry *entry = shard->buckets[hash % PROXY_CACHE_NUM_BUCKETS];
+  while (entry != NULL && (entry->hash != hash || strcmp(entry->key, key) != 0))
+    entry = entry->bucket_next;
+  return entry;
+}
+
+/* Frees the memory of the least recently used entry of SHARD. An entry with a
+ * copy on disk is replaced by a stub that serves it from there. Must be
+ * called with the shard locked. */
+static void shard_evict(struct proxy_cache_shard *shard) {
+  struct proxy_cache_entry *entry = shard->lru;
+  struct proxy_cache_entry *stub = NULL;
+  if (entry->disk_file != NULL && (stub = calloc(1, sizeof(*stub))) != NULL) {
+    stub->key = strdup(entry->key);
+    stub->headers = malloc(entry->headers_length + 1);
+    if (stub->key == NULL || stub->headers == NULL) {
+      free(stub->key);
+      free(stub->headers);
+      free(stub);
+      stub = NULL;
+    }
+  }
+
+  if (stub != NULL) {
+    memcpy(stub->headers, entry->headers, entry->headers_length);
+    stub->headers_length = entry->headers_length;
+    stub->hash = entry->hash;
+    stub->status_code = entry->status_code;
+    stub->body_length = entry->body_length;
+    stub->stored_ms = entry->stored_ms;
+    stub->age = entry->age;
+    stub->expires_ms = entry->expires_ms;
+    stub->refcount = 1;
+    stub->cached = 1;
+
+    /* The stub takes over the disk file. It was the least recently used entry
+     * in memory, so it goes first in line on disk too. */
+    stub->disk_file = entry->disk_file;
+    DL_DELETE2(shard->disk_lru, entry, disk_prev, disk_next);
+    DL_PREPEND2(shard->disk_lru, stub, disk_prev, disk_next);
+    entry->disk_file = NULL;
+    LL_PREPEND2(shard->buckets[stub->hash % PROXY_CACHE_NUM_BUCKETS], stub, bucket_next);
+  }
+  shard_remove(shard, entry);
+}
+
+/* Evicts least recently used disk files until SHARD's fit. Must be called
+ * with the shard locked. */
+static void shard_trim_disk(struct proxy_cache_shard *shard) {
+  while (shard->disk_lru != NULL && shard->disk_size > disk_shard_capacity) {
+    struct proxy_cache_entry *entry = shard->disk_lru;
+    if (!entry->in_memory) {
+      shard_remove(shard, entry);
+      continue;
+    }
+    DL_DELETE2(shard->disk_lru, entry, disk_prev, disk_next);
+    shard->disk_size -= entry->body_length;
+    unlink(entry->disk_file);
+    free(entry->disk_file);
+    entry->disk_file = NULL;
+  }
+}
+
+/* Adds ENTRY to the memory LRU of SHARD, evicting as needed. Must be called
+ * with the shard locked. */
+static void shard_insert(struct proxy_cache_shard *shard, struct proxy_cache_entry *entry) {
+  struct proxy_cache_entry *existing = shard_find(shard, entry->key, entry->hash);
+  if (existing != NULL) shard_remove(shard, existing);
+  while (shard->lru != NULL && shard->size + entry_cost(entry) > shard_capacity)
+    shard_evict(shard);
+  LL_PREPEND2(shard->buckets[entry->hash % PROXY_CACHE_NUM_BUCKETS], entry, bucket_next);
+  DL_APPEND(shard->lru, entry);
+  shard->size += entry_cost(entry);
+  entry->in_memory = 1;
+  entry->cached = 1;
+}
+
+/* Ends the fetch for PLACEHOLDER: replaces it with ENTRY, or with a pass
+ * marker if PASS is set, or with nothing, and wakes up whoever waits for
+ * it. */
+static void shard_settle(struct proxy_cache_shard *shard, struct proxy_cache_entry *placeholder,
+    struct proxy_cache_entry *entry, int pass) {
+  struct proxy_cache_entry *marker = NULL;
+  if (entry == NULL && pass && (marker = calloc(1, sizeof(*marker))) != NULL) {
+    marker->key = strdup(placeholder->key);
+    marker->hash = placeholder->hash;
+    marker->pass = 1;
+    marker->expires_ms = now_ms() + PROXY_CACHE_PASS_MS;
+    marker->refcount = 1;
+    if (marker->key == NULL) {
+      free(marker);
+      marker = NULL;
+    }
+  }
+
+  pthread_mutex_lock(&shard->mutex);
+  shard_remove(shard, placeholder);
+  if (entry != NULL) shard_insert(shard, entry);
+  if (marker != NULL) shard_insert(shard, marker);
+  pthread_cond_broadcast(&shard->fetched);
+  pthread_mutex_unlock(&shard->mutex);
+}
+
+/* Writes the body of ENTRY to the disk tier, outside the lock, once it has
+ * been sent. */
+static void entry_write_to_disk(struct proxy_cache_shard *shard, struct proxy_cache_entry *entry) {
+  if (disk_directory == NULL || entry->body_length > disk_shard_capacity) return;
+
+  char file_name[PATH_MAX];
+  snprintf(file_name, sizeof(file_name), "%s/" PROXY_CACHE_FILE_PREFIX "%08x-%lx",
+      disk_directory, entry->hash, __atomic_add_fetch(&disk_file_counter, 1, __ATOMIC_RELAXED));
+  int file_fd = open(file_name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (file_fd == -1) return;
+  size_t written = http_send_data(file_fd, entry->body, entry->body_length);
+  close(file_fd);
+
+  char *disk_file = strdup(file_name);
+  pthread_mutex_lock(&shard->mutex);
+  int keep = written == entry->body_length && disk_file != NULL && entry->cached
+      && entry->disk_file == NULL;
+  if (keep) {
+    entry->disk_file = disk_file;
+    DL_APPEND2(shard->disk_lru, entry, disk_prev, disk_next);
+    shard->disk_size += entry->body_length;
+    shard_trim_disk(shard);
+  }
+  pthread_mutex_unlock(&shard->mutex);
+  if (!keep) {
+    unlink(file_name);
+    free(disk_file);
+  }
+}
+
+/* Finds the end of a response head in the LENGTH bytes of DATA. Returns its
+ * length, or 0 if it is not complete. */
+static size_t find_head_end(char *data, size_t length) {
+  char *end = memmem(data, length, "\r\n\r\n", 4);
+  return end != NULL ? (size_t) (end - data) + 4 : 0;
+}
+
+/* Fetches REQUEST from a backend for PLACEHOLDER, the entry that other
+ * requests for KEY now wait on, settles it and answers the client on FD. */
+static int proxy_cache_fetch(int fd, struct http_request *request,
+    struct proxy_cache_shard *shard, struct proxy_cache_entry *placeholder,
+    int *status_code, size_t *bytes_sent) {
+  int upstream_fd;
+  upstream_t *upstream = upstream_connect(request->path.data, request->path.length,
+      &upstream_fd);
+  if (upstream == NULL) {
+    shard_settle(shard, placeholder, NULL, 0);
+    return -1;
+  }
+
+  /* Backend connections are non-blocking; this one is used by this thread only. */
+  fcntl(upstream_fd, F_SETFL, fcntl(upstream_fd, F_GETFL) & ~O_NONBLOCK);
+  struct timeval timeout;
+  timeout.tv_sec = PROXY_CACHE_FETCH_TIMEOUT_MS / 1000;
+  timeout.tv_usec = (PROXY_CACHE_FETCH_TIMEOUT_MS % 1000) * 1000;
+  setsockopt(upstream_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  setsockopt(upstream_fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+  size_t buffer_size = PROXY_CACHE_HEAD_SIZE + PROXY_CACHE_MAX_ENTRY_SIZE;
+  char *data = malloc(buffer_size);
+  int request_length = data != NULL
+      ? fetch_format_request(request, data, LIBHTTP_REQUEST_MAX_SIZE) : -1;
+  if (request_length < 0
+      || http_send_data(upstream_fd, data, request_length) != (size_t) request_length) {
+    shard_settle(shard, placeholder, NULL, data != NULL && request_length < 0);
+    free(data);
+    upstream_release(upstream);
+    close(upstream_fd);
+    return -1;
+  }
+
+  /* Reads until the end of the response, or until it is clear that it will
+   * not fit in an entry. */
+  struct proxy_cache_response response;
+  response.status_code = 0;
+  response.head_length = 0;
+  long start_ms = now_ms();
+  size_t length = 0;
+  size_t content_length = 0;
+  int has_content_length = 0;
+  int parsed = 0;
+  int complete = 0;
+  while (length < buffer_size) {
+    ssize_t bytes_read = read(upstream_fd, data + length, buffer_size - length);
+    if (bytes_read < 0 && errno == EINTR) continue;
+    if (bytes_read <= 0) {
+      complete = bytes_read == 0;
+      break;
+    }
+    if (length == 0) upstream_report_latency(upstream, now_ms() - start_ms);
+    length += bytes_read;
+
+    if (!parsed) {
+      size_t head_length = find_head_end(data, length < PROXY_CACHE_HEAD_SIZE
+          ? length : PROXY_CACHE_HEAD_SIZE);
+      if (head_length == 0 && length < PROXY_CACHE_HEAD_SIZE) continue;
+      if (head_length == 0 || !response_parse(data, head_length, &response)) break;
+      parsed = 1;
+      struct http_slice *value = response_header(&response, "Content-Length");
+      if (value != NULL) {
+        has_content_length = 1;
+        content_length = strtoul(value->data, NULL, 10);
+      }
+    }
+    if (has_content_length && length - response.head_length >= content_length) {
+      complete = 1;
+      break;
+    }
+  }
+  if (length == 0) {
+    /* An idle pooled connection the backend had already closed, say. */
+    shard_settle(shard, placeholder, NULL, 0);
+    free(data);
+    upstream_release(upstream);
+    close(upstream_fd);
+    return -1;
+  }
+
+  struct proxy_cache_entry *entry = NULL;
+  char headers[PROXY_CACHE_HEADERS_SIZE];
+  int headers_length = 0;
+  long age = 0;
+  long freshness = parsed && complete ? response_freshness(&response, &age) : 0;
+  size_t body_length = has_content_length ? content_length : length - response.head_length;
+  if (freshness > 0 && response_header(&response, "Transfer-Encoding") == NULL
+      && length - response.head_length >= body_length
+      && body_length <= PROXY_CACHE_MAX_ENTRY_SIZE
+      && (headers_length = response_format_headers(&response, headers, sizeof(headers))) >= 0
+      && strlen(placeholder->key) + headers_length + body_length <= shard_capacity
+      && (entry = calloc(1, sizeof(*entry))) != NULL) {
+    entry->key = strdup(placeholder->key);
+    entry->headers = malloc(headers_length + 1);
+    entry->body = malloc(body_length + 1);
+    if (entry->key == NULL || entry->headers == NULL || entry->body == NULL) {
+      entry_release(entry);
+      entry = NULL;
+    }
+  }
+
+  if (entry != NULL) {
+    entry->hash = placeholder->hash;
+    entry->status_code = response.status_code;
+    memcpy(entry->headers, headers, headers_length);
+    entry->headers_length = headers_length;
+    memcpy(entry->body, data + response.head_length, body_length);
+    entry->body_length = body_length;
+    entry->stored_ms = now_ms();
+    entry->age = age;
+    entry->expires_ms = entry->stored_ms + freshness * 1000;
+    entry->refcount = 2;
+    free(data);
+    upstream_release(upstream);
+    close(upstream_fd);
+    shard_settle(shard, placeholder, entry, 0);
+
+    int keep_alive = entry_send(fd, entry, -1, request->keep_alive, "MISS", status_code,
+        bytes_sent);
+    entry_write_to_disk(shard, entry);
+    entry_release(entry);
+    return keep_alive;
+  }
+
+  /* Not cacheable: the waiting requests go to the backends themselves, and
+   * this one gets the response as it came, then the rest of it. The backend
+   * closes the connection at its end, and so do we. */
+  shard_settle(shard, placeholder, NULL, 1);
+  *status_code = parsed ? response.status_code : 0;
+  *bytes_sent = http_send_data(fd, data, length);
+  while (!complete && *bytes_sent > 0) {
+    ssize_t bytes_read = read(upstream_fd, data, buffer_size);
+    if (bytes_read < 0 && errno == EINTR) continue;
+    if (bytes_read <= 0) break;
+    size_t sent = http_send_data(fd, data, bytes_read);
+    *bytes_sent += sent;
+    if (sent < (size_t) bytes_read) break;
+  }
+  free(data);
+  upstream_release(upstream);
+  close(upstream_fd);
+  return 0;
+}
+
+int proxy_cache_init(size_t capacity, char *directory, size_t disk_capacity) {
+  shard_capacity = capacity / PROXY_CACHE_NUM_SHARDS;
+
+  int i;
+  for (i = 0; i < PROXY_CACHE_NUM_SHARDS; i++) {
+    memset(&shards[i], 0, sizeof(shards[i]));
+    pthread_mutex_init(&shards[i].mutex, NULL);
+    pthread_cond_init(&shards[i].fetched, NULL);
+  }
+  if (shard_capacity == 0 || directory == NULL) return 0;
+
+  if (mkdir(directory, 0700) == -1 && errno != EEXIST) return -1;
+  DIR *dir = opendir(directory);
+  if (dir == NULL) return -1;
+  struct dirent *dirent;
+  while ((dirent = readdir(dir)) != NULL)
+    if (strncmp(dirent->d_name, PROXY_CACHE_FILE_PREFIX, strlen(PROXY_CACHE_FILE_PREFIX)) == 0)
+      unlinkat(dirfd(dir), dirent->d_name, 0);
+  closedir(dir);
+
+  disk_directory = directory;
+  disk_shard_capacity = disk_capacity / PROXY_CACHE_NUM_SHARDS;
+  return 0;
+}
+
+int proxy_cache_enabled() {
+  return shard_capacity > 0;
+}
+
+int proxy_cache_eligible(struct http_request *request) {
+  if (!proxy_cache_enabled() || !slice_equals(&request->method, "GET")
+      || request->version.length == 0
+      || http_request_header(request, "Authorization") != NULL
+      || http_request_header(request, "Range") != NULL
+      || http_request_header(request, "Content-Length") != NULL
+      || http_request_header(request, "Transfer-Encoding") != NULL)
+    return 0;
+
+  struct http_slice *cache_control = http_request_header(request, "Cache-Control");
+  struct http_slice *pragma = http_request_header(request, "Pragma");
+  return (cache_control == NULL || (!cache_control_has(cache_control, "no-cache", NULL)
+        && !cache_control_has(cache_control, "no-store", NULL)))
+      && (pragma == NULL || !cache_control_has(pragma, "no-cache", NULL));
+}
+
+int proxy_cache_respond(int fd, struct http_request *request, int *status_code,
+    size_t *bytes_sent) {
+  /* Both come from the same request head, so the key fits. */
+  char key[LIBHTTP_REQUEST_MAX_SIZE + 1];
+  struct http_slice *host = http_request_header(request, "Host");
+  snprintf(key, sizeof(key), "%.*s%s", host ? (int) host->length : 0, host ? host->data : "",
+      request->path.data);
+  unsigned int hash = hash_string(key);
+  struct proxy_cache_shard *shard = &shards[hash % PROXY_CACHE_NUM_SHARDS];
+
+  pthread_mutex_lock(&shard->mutex);
+  struct proxy_cache_entry *entry;
+  while ((entry = shard_find(shard, key, hash)) != NULL && entry->fetching)
+    pthread_cond_wait(&shard->fetched, &shard->mutex);
+  if (entry != NULL && now_ms() >= entry->expires_ms) {
+    shard_remove(shard, entry);
+    entry = NULL;
+  }
+  if (entry != NULL && entry->pass) {
+    pthread_mutex_unlock(&shard->mutex);
+    return -1;
+  }
+
+  int body_fd = -1;
+  if (entry != NULL && entry->body == NULL
+      && (body_fd = open(entry->disk_file, O_RDONLY | O_CLOEXEC)) == -1) {
+    shard_remove(shard, entry);
+    entry = NULL;
+  }
+  if (entry != NULL) {
+    if (entry->in_memory) {
+      DL_DELETE(shard->lru, entry);
+      DL_APPEND(shard->lru, entry);
+    }
+    if (entry->disk_file != NULL) {
+      DL_DELETE2(shard->disk_lru, entry, disk_prev, disk_next);
+      DL_APPEND2(shard->disk_lru, entry, disk_prev, disk_next);
+    }
+    __atomic_add_fetch(&entry->refcount, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&shard->mutex);
+
+    metrics_count(METRICS_CACHE_HITS, 1);
+    int keep_alive = entry_send(fd, entry, body_fd, request->keep_alive, "HIT", status_code,
+        bytes_sent);
+    if (body_fd != -1) close(body_fd);
+    entry_release(entry);
+    return keep_alive;
+  }
+
+  /* A miss: this request fetches KEY, and later ones wait for it. */
+  struct proxy_cache_entry *placeholder = calloc(1, sizeof(*placeholder));
+  if (placeholder == NULL || (placeholder->key = strdup(key)) == NULL) {
+    pthread_mutex_unlock(&shard->mutex);
+    free(placeholder);
+    return -1;
+  }
+  placeholder->hash = hash;
+  placeholder->fetching = 1;
+  placeholder->refcount = 1;
+  placeholder->cached = 1;
+  LL_PREPEND2(shard->buckets[hash % PROXY_CACHE_NUM_BUCKETS], placeholder, bucket_next);
+  pthread_mutex_unlock(&shard->mutex);
+
+  metrics_count(METRICS_CACHE_MISSES, 1);
+  return proxy_cache_fetch(fd, request, shard, placeholder, status_code, bytes_sent);
+}
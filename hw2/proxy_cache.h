@@ -0,0 +1,53 @@
+#ifndef __PROXY_CACHE__
+#define __PROXY_CACHE__
+
+#include <stddef.h>
+
+#include "libhttp.h"
+
+/* PROXY_CACHE answers repeated GET requests in proxy mode without asking a
+ * backend again. On a miss the request is fetched from a backend as a fresh
+ * HTTP/1.0 exchange, so the response can be parsed and framed, and kept if
+ * the backend marked it as fresh for a while (s-maxage, max-age or Expires)
+ * and nothing forbids sharing it (no-store, no-cache, private, Set-Cookie,
+ * Vary). Entries are keyed by Host and path and live in independently locked
+ * shards, in an LRU bounded in bytes.
+ *
+ * Concurrent misses for the same key are coalesced: the first one fetches,
+ * the others wait on the shard and are then served from the new entry. A
+ * response that turns out not to be cacheable leaves a short-lived marker so
+ * that later requests for it are relayed straight away instead of queueing
+ * behind each other.
+ *
+ * With a cache directory, bodies are also written there after they have been
+ * sent. An entry evicted from memory then stays reachable on disk, and is
+ * served from there with sendfile until the disk tier, an LRU of its own,
+ * evicts it too. */
+
+#define PROXY_CACHE_NUM_SHARDS 16
+#define PROXY_CACHE_MAX_ENTRY_SIZE (1024 * 1024)
+#define PROXY_CACHE_DEFAULT_DISK_SIZE (256 * 1024 * 1024)
+#define PROXY_CACHE_FETCH_TIMEOUT_MS 10000
+#define PROXY_CACHE_PASS_MS 1000    /* How long uncacheable keys bypass the cache. */
+
+/* Sizes the memory tier to CAPACITY bytes (0 disables the cache) and, if
+ * DIRECTORY is not NULL, adds a disk tier of DISK_CAPACITY bytes in it, which
+ * is created if needed and cleared of files left by an earlier run. Returns
+ * -1 (with errno set) if DIRECTORY cannot be used. */
+int proxy_cache_init(size_t capacity, char *directory, size_t disk_capacity);
+
+int proxy_cache_enabled();
+
+/* Whether REQUEST may be answered from the cache: a GET without a body,
+ * credentials or a Range, from a client that does not ask to bypass caches. */
+int proxy_cache_eligible(struct http_request *request);
+
+/* Answers REQUEST on FD from the cache, fetching it from a backend on a
+ * miss. Returns -1 if nothing was sent and the request is to be relayed
+ * instead (the key is not cacheable, or no backend answered). Otherwise
+ * returns whether the connection can stay open, and sets *STATUS_CODE and
+ * *BYTES_SENT to what was sent. */
+int proxy_cache_respond(int fd, struct http_request *request, int *status_code,
+    size_t *bytes_sent);
+
+#endif
@@ -0,0 +1,458 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "access_log.h"
+#include "admission.h"
+#include "affinity.h"
+#include "metrics.h"
+#include "reactor.h"
+#include "timer_wheel.h"
+
+#define REACTOR_MAX_EVENTS 256
+
+enum connection_state {
+  CONNECTION_READING,
+  CONNECTION_WRITING,
+};
+
+struct reactor;
+
+struct connection {
+  struct reactor *reactor;
+  int fd;
+  enum connection_state state;
+  int want_write;           /* Registered for EPOLLOUT instead of EPOLLIN. */
+  int peer_closed;          /* The client shut down its sending side. */
+  int requests_served;
+  int idle;                 /* Waiting for the next request to start. */
+  struct timer timer;       /* The deadline of whatever it waits for. */
+
+  struct http_request_buffer request_buffer;
+  struct http_request request;    /* Parsed incrementally as bytes arrive. */
+
+  char header_buffer[LIBHTTP_HEADER_MAX_SIZE];
+  char *header;             /* Either header_buffer or a pre-rendered header. */
+  size_t header_length;
+  size_t header_sent;
+
+  struct http_response response;
+  size_t body_sent;
+  char *chunk;              /* Produced bodies, LIBHTTP_CHUNK_SIZE at a time. */
+  size_t chunk_length;
+  size_t chunk_sent;
+  size_t bytes_sent;        /* Of the current response, headers included. */
+
+  struct sockaddr_in peer;
+  int logging;              /* LOG_ENTRY is to be completed with the response. */
+  struct access_log_entry log_entry;
+};
+
+struct reactor {
+  int epoll_fd;
+  int server_socket;
+  reactor_handler_t handler;
+  struct timer_wheel wheel;
+};
+
+static void reactor_fatal_error(char *message) {
+  perror(message);
+  exit(errno);
+}
+
+static long now_ms() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+  return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static void connection_close(struct reactor *reactor, struct connection *connection) {
+  epoll_ctl(reactor->epoll_fd, EPOLL_CTL_DEL, connection->fd, NULL);
+  close(connection->fd);
+  http_response_free(&connection->response);
+  timer_cancel(&connection->timer);
+  free(connection->chunk);
+  free(connection);
+}
+
+static void connection_expire(void *data) {
+  struct connection *connection = data;
+  metrics_count(METRICS_TIMEOUTS, 1);
+  connection_close(connection->reactor, connection);
+}
+
+/* Gives CONNECTION TIMEOUT_MS from now for what it waits for next. */
+static void connection_deadline(struct reactor *reactor, struct connection *connection,
+    long timeout_ms) {
+  timer_arm(&reactor->wheel, &connection->timer, now_ms() + timeout_ms);
+}
+
+/* Switches the epoll interest of CONNECTION between reading and writing.
+ * Returns -1 (after closing the connection) on failure. */
+static int connection_want_write(struct reactor *reactor, struct connection *connection,
+    int want_write) {
+  if (connection->want_write == want_write) return 0;
+
+  struct epoll_event event;
+  event.events = want_write ? EPOLLOUT : EPOLLIN | EPOLLRDHUP;
+  event.data.ptr = connection;
+  if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_MOD, connection->fd, &event) == -1) {
+    connection_close(reactor, connection);
+    return -1;
+  }
+  connection->want_write = want_write;
+  return 0;
+}
+
+/* Writes as much of the pending response as the socket takes. Returns 1 when
+ * the response is fully sent, 0 when the socket is full and -1 on error. */
+static int connection_flush(struct connection *connection) {
+  struct http_response *response = &connection->response;
+  ssize_t bytes_sent;
+
+  /* An in-memory body leaves in the same sendmsg as the header. Any other
+   * header is sent with MSG_MORE, so it still shares a segment with the first
+   * body bytes instead of going out on its own. */
+  while (connection->header_sent < connection->header_length) {
+    size_t header_left = connection->header_length - connection->header_sent;
+    if (response->body_fd == -1 && response->produce == NULL) {
+      struct iovec iov[2] = {
+        { connection->header + connection->header_sent, header_left },
+        { response->body + response->body_offset, response->body_length },
+      };
+      struct msghdr message = { .msg_iov = iov, .msg_iovlen = 2 };
+      bytes_sent = sendmsg(connection->fd, &message, MSG_NOSIGNAL);
+    } else {
+      int more = response->body_length > 0 || response->produce != NULL ? MSG_MORE : 0;
+      bytes_sent = send(connection->fd, connection->header + connection->header_sent,
+          header_left, MSG_NOSIGNAL | more);
+    }
+    if (bytes_sent < 0) return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+    metrics_count(METRICS_BYTES_SENT, bytes_sent);
+    connection->bytes_sent += bytes_sent;
+    if ((size_t) bytes_sent > header_left) {
+      connection->body_sent += bytes_sent - header_left;
+      bytes_sent = header_left;
+    }
+    connection->header_sent += bytes_sent;
+  }
+
+  while (connection->body_sent < response->body_length) {
+    if (response->body_fd != -1) {
+      off_t offset = response->body_offset + connection->body_sent;
+      bytes_sent = sendfile(connection->fd, response->body_fd, &offset,
+          response->body_length - connection->body_sent);
+      if (bytes_sent == 0) return -1; /* The file shrank under us. */
+    } else {
+      bytes_sent = send(connection->fd,
+          response->body + response->body_offset + connection->body_sent,
+          response->body_length - connection->body_sent, MSG_NOSIGNAL);
+    }
+    if (bytes_sent < 0) return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+    metrics_count(METRICS_BYTES_SENT, bytes_sent);
+    connection->bytes_sent += bytes_sent;
+    connection->body_sent += bytes_sent;
+  }
+
+  while (response->produce != NULL) {
+    if (connection->chunk_sent == connection->chunk_length) {
+      /* The buffer is allocated on first use and kept for later responses. */
+      if (connection->chunk == NULL
+          && (connection->chunk = malloc(LIBHTTP_CHUNK_SIZE)) == NULL) return -1;
+      connection->chunk_length = http_response_next_chunk(response, connection->chunk,
+          LIBHTTP_CHUNK_SIZE);
+      connection->chunk_sent = 0;
+      if (connection->chunk_length == 0) break;
+    }
+    bytes_sent = send(connection->fd, connection->chunk + connection->chunk_sent,
+        connection->chunk_length - connection->chunk_sent, MSG_NOSIGNAL);
+    if (bytes_sent < 0) return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+    metrics_count(METRICS_BYTES_SENT, bytes_sent);
+    connection->bytes_sent += bytes_sent;
+    connection->chunk_sent += bytes_sent;
+  }
+
+  return 1;
+}
+
+/* Called once a response is fully sent. Returns 1 if the connection stays
+ * open for the next request. */
+static int connection_finish_response(struct reactor *reactor, struct connection *connection) {
+  if (connection->logging)
+    access_log_finish(&connection->log_entry, connection->response.status_code,
+        connection->bytes_sent);
+  if (!connection->response.keep_alive) {
+    connection_close(reactor, connection);
+    return 0;
+  }
+
+  http_response_free(&connection->response);
+  connection->header_sent = connection->header_length = 0;
+  connection->body_sent = connection->bytes_sent = 0;
+  connection->chunk_length = connection->chunk_sent = 0;
+  connection->state = CONNECTION_READING;
+  /* Pipelined bytes are the start of the next request head. */
+  connection->idle = connection->request_buffer.length == 0;
+  connection_deadline(reactor, connection, connection->idle
+      ? http_keep_alive_timeout_ms : http_header_timeout_ms);
+  return connection_want_write(reactor, connection, 0) == 0;
+}
+
+/* Builds the response for the parsed request (STATUS is HTTP_PARSE_COMPLETE
+ * or HTTP_PARSE_ERROR) and starts sending it. Returns 1 if the response went
+ * out in full and the connection is ready for the next request. */
+static int connection_respond(struct reactor *reactor, struct connection *connection,
+    enum http_parse_status status) {
+  struct http_request *request = &connection->request;
+  if (status == HTTP_PARSE_COMPLETE
+      && ++connection->requests_served >= http_keep_alive_max_requests)
+    request->keep_alive = 0;
+  int parsed = status == HTTP_PARSE_COMPLETE;
+  connection->logging = access_log_start(&connection->log_entry, &connection->peer,
+      parsed ? &request->method : NULL, parsed ? &request->path : NULL);
+  /* The first request was paid for when the connection was admitted. */
+  if (!parsed || connection->requests_served == 1
+      || admission_allow_request(&connection->peer, &connection->response))
+    reactor->handler(parsed ? request : NULL, &connection->response);
+  http_request_consume(&connection->request_buffer, request);
+
+  if (connection->response.header != NULL) {
+    connection->header = connection->response.header;
+    connection->header_length = connection->response.header_length;
+  } else {
+    int header_length = http_format_headers(&connection->response,
+        connection->header_buffer, sizeof(connection->header_buffer));
+    if (header_length < 0) {
+      connection_close(reactor, connection);
+      return 0;
+    }
+    connection->header = connection->header_buffer;
+    connection->header_length = header_length;
+  }
+  connection->state = CONNECTION_WRITING;
+
+  int flushed = connection_flush(connection);
+  if (flushed < 0) {
+    connection_close(reactor, connection);
+    return 0;
+  }
+  if (flushed == 0) {
+    connection_deadline(reactor, connection, http_body_timeout_ms);
+    connection_want_write(reactor, connection, 1);
+    return 0;
+  }
+  return connection_finish_response(reactor, connection);
+}
+
+/* Answers every complete request in the buffer, one at a time, until the
+ * buffer runs dry or a response has to wait for the socket. */
+static void connection_process(struct reactor *reactor, struct connection *connection) {
+  struct http_request_buffer *buffer = &connection->request_buffer;
+
+  while (connection->state == CONNECTION_READING) {
+    enum http_parse_status status = http_request_parse_more(&connection->request,
+        buffer->data, buffer->length);
+    if (status == HTTP_PARSE_NEED_MORE) {
+      if (buffer->length == LIBHTTP_REQUEST_MAX_SIZE) {
+        status = HTTP_PARSE_ERROR;
+      } else if (connection->peer_closed && buffer->length > 0) {
+        /* Answer whatever the client sent before hanging up. */
+        status = http_request_parse_finish(&connection->request, buffer->data, buffer->length);
+      } else {
+        if (connection->peer_closed) connection_close(reactor, connection);
+        return;
+      }
+    }
+    if (!connection_respond(reactor, connection, status)) return;
+  }
+}
+
+static void connection_read(struct reactor *reactor, struct connection *connection) {
+  struct http_request_buffer *buffer = &connection->request_buffer;
+  ssize_t bytes_read;
+
+  while (buffer->length < LIBHTTP_REQUEST_MAX_SIZE) {
+    bytes_read = read(connection->fd, buffer->data + buffer->length,
+        LIBHTTP_REQUEST_MAX_SIZE - buffer->length);
+    if (bytes_read < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+      connection_close(reactor, connection);
+      return;
+    }
+    if (bytes_read == 0) {
+      connection->peer_closed = 1;
+      break;
+    }
+    buffer->length += bytes_read;
+    if (connection->idle) {
+      connection->idle = 0;
+      connection_deadline(reactor, connection, http_header_timeout_ms);
+    }
+  }
+
+  connection_process(reactor, connection);
+}
+
+static void connection_handle(struct reactor *reactor, struct connection *connection,
+    uint32_t events) {
+  if (events & (EPOLLERR | EPOLLHUP) && connection->state == CONNECTION_WRITING) {
+    connection_close(reactor, connection);
+    return;
+  }
+
+  if (connection->state == CONNECTION_READING) {
+    connection_read(reactor, connection);
+    return;
+  }
+
+  int status = connection_flush(connection);
+  if (status < 0) {
+    connection_close(reactor, connection);
+  } else if (status == 0) {
+    /* It took something, or epoll would not have said it could. */
+    connection_deadline(reactor, connection, http_body_timeout_ms);
+  } else if (status > 0 && connection_finish_response(reactor, connection)) {
+    connection_process(reactor, connection);
+  }
+}
+
+static void reactor_accept(struct reactor *reactor) {
+  while (1) {
+    struct sockaddr_in peer;
+    socklen_t peer_length = sizeof(peer);
+    int client_socket_number = accept4(reactor->server_socket, (struct sockaddr *) &peer,
+        &peer_length, SOCK_NONBLOCK);
+    if (client_socket_number < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        perror("Error accepting socket");
+      return;
+    }
+    metrics_count(METRICS_CONNECTIONS, 1);
+    if (!admission_allow(&peer)) {
+      admission_reject(client_socket_number, 429);
+      continue;
+    }
+
+    struct connection *connection = calloc(1, sizeof(struct connection));
+    if (connection == NULL) {
+      close(client_socket_number);
+      continue;
+    }
+    connection->reactor = reactor;
+    connection->fd = client_socket_number;
+    connection->peer = peer;
+    connection->state = CONNECTION_READING;
+    http_request_init(&connection->request);
+    http_response_init(&connection->response);
+
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLRDHUP;
+    event.data.ptr = connection;
+    if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, client_socket_number, &event) == -1) {
+      close(client_socket_number);
+      free(connection);
+      continue;
+    }
+    /* A new client gets as long for its first request as for any head. */
+    timer_init(&connection->timer, connection_expire, connection);
+    connection_deadline(reactor, connection, http_header_timeout_ms);
+  }
+}
+
+static void *reactor_loop(void *args) {
+  struct reactor *reactor = args;
+  struct epoll_event events[REACTOR_MAX_EVENTS];
+
+  while (1) {
+    int num_events = epoll_wait(reactor->epoll_fd, events, REACTOR_MAX_EVENTS,
+        timer_wheel_timeout(&reactor->wheel, now_ms()));
+    if (num_events < 0) {
+      if (errno == EINTR) continue;
+      reactor_fatal_error("Failed to wait for events");
+    }
+
+    int i;
+    for (i = 0; i < num_events; i++) {
+      /* The listening socket is registered with a NULL data pointer. */
+      if (events[i].data.ptr == NULL) {
+        reactor_accept(reactor);
+      } else {
+        connection_handle(reactor, events[i].data.ptr, events[i].events);
+      }
+    }
+
+    timer_wheel_advance(&reactor->wheel, now_ms());
+  }
+
+  return NULL;
+}
+
+static struct reactor *reactor_create(int server_socket, reactor_handler_t handler) {
+  struct reactor *reactor = malloc(sizeof(struct reactor));
+  if (reactor == NULL) reactor_fatal_error("Failed to allocate reactor");
+
+  reactor->server_socket = server_socket;
+  reactor->handler = handler;
+  timer_wheel_init(&reactor->wheel, now_ms());
+  reactor->epoll_fd = epoll_create1(0);
+  if (reactor->epoll_fd == -1) reactor_fatal_error("Failed to create epoll instance");
+
+  /* EPOLLEXCLUSIVE wakes a single reactor per incoming connection instead of
+   * all of them. */
+  struct epoll_event event;
+  event.events = EPOLLIN | EPOLLEXCLUSIVE;
+  event.data.ptr = NULL;
+  if (epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, server_socket, &event) == -1)
+    reactor_fatal_error("Failed to watch server socket");
+
+  return reactor;
+}
+
+/* What a reactor thread is started with: it sets itself up only once it is
+ * on its own CPUs, so that its memory is allocated there. */
+struct reactor_start {
+  int server_socket;
+  int index;
+  int count;
+  reactor_handler_t handler;
+};
+
+static void *reactor_start(void *args) {
+  struct reactor_start *start = args;
+  affinity_pin(start->index, start->count);
+  return reactor_loop(reactor_create(start->server_socket, start->handler));
+}
+
+void reactor_serve_forever(int *server_sockets, int num_reactors, reactor_handler_t handler) {
+  if (num_reactors < 1) num_reactors = 1;
+  struct reactor_start *starts = malloc(sizeof(struct reactor_start) * num_reactors);
+  if (starts == NULL) reactor_fatal_error("Failed to allocate reactors");
+
+  int i;
+  for (i = 0; i < num_reactors; i++) {
+    int flags = fcntl(server_sockets[i], F_GETFL, 0);
+    if (flags == -1 || fcntl(server_sockets[i], F_SETFL, flags | O_NONBLOCK) == -1)
+      reactor_fatal_error("Failed to make server socket non-blocking");
+    starts[i].server_socket = server_sockets[i];
+    starts[i].index = i;
+    starts[i].count = num_reactors;
+    starts[i].handler = handler;
+  }
+
+  for (i = 1; i < num_reactors; i++) {
+    pthread_t thread;
+    pthread_create(&thread, NULL, reactor_start, &starts[i]);
+  }
+  reactor_start(&starts[0]);
+}
@@ -0,0 +1,23 @@
+#ifndef __REACTOR__
+#define __REACTOR__
+
+#include "libhttp.h"
+
+/* REACTOR serves HTTP connections from a small, fixed set of event loop
+ * threads. Every reactor thread owns an epoll instance together with the
+ * non-blocking client sockets it accepted, and drives each of them through
+ * a read-request / write-response state machine, so slow or idle clients
+ * only cost a connection struct instead of a whole worker thread. */
+
+/* Builds the response for a parsed request (which is NULL when the request
+ * could not be parsed). Must not block on the client socket. */
+typedef void (*reactor_handler_t)(struct http_request *request,
+    struct http_response *response);
+
+/* Runs NUM_REACTORS event loops, loop I accepting on SERVER_SOCKETS[I] (the
+ * sockets may all be the same) and pinned to share I of the CPUs (see
+ * affinity.h), the first one on the calling thread. Never returns. */
+void reactor_serve_forever(int *server_sockets, int num_reactors,
+    reactor_handler_t handler);
+
+#endif
@@ -0,0 +1,563 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "access_log.h"
+#include "admission.h"
+#include "affinity.h"
+#include "libhttp.h"
+#include "metrics.h"
+#include "relay.h"
+#include "timer_wheel.h"
+#include "utlist.h"
+
+#define RELAY_MAX_EVENTS 256
+
+#define BAD_GATEWAY_RESPONSE \
+    "HTTP/1.0 502 Bad Gateway\r\n" \
+    "Content-Type: text/html\r\n" \
+    "\r\n" \
+    "<center><h1>502 Bad Gateway</h1><hr></center>"
+
+/* One direction of a tunnel: bytes are spliced FROM -> pipe -> TO. */
+struct relay_direction {
+  int from;
+  int to;
+  int pipe[2];
+  size_t buffered;      /* Bytes sitting in the pipe. */
+  size_t moved;         /* Bytes passed on to TO so far. */
+  int eof;              /* FROM has been read to the end. */
+  int done;             /* ... and everything was passed on to TO. */
+};
+
+struct relay;
+
+struct tunnel {
+  struct relay *relay;
+  int client_fd;
+  int upstream_fd;      /* -1 until a backend has been chosen. */
+  upstream_t *upstream;
+  int connecting;       /* Waiting for a non-blocking connect to finish. */
+  int attempts;         /* Backends tried so far. */
+  struct sockaddr_in upstream_address;
+  long request_sent_ms; /* When the first request bytes went upstream. */
+  int latency_reported;
+  int closed;           /* Freed once the current batch of events is done. */
+  long last_active_ms;  /* When bytes last moved, either way. */
+  struct timer timer;   /* Armed by the relay thread on the first event. */
+  struct relay_direction directions[2];   /* Client -> upstream, and back. */
+  struct sockaddr_in peer;
+  int logging;          /* LOG_ENTRY is to be completed when the tunnel closes. */
+  struct access_log_entry log_entry;
+  struct tunnel *next;
+};
+
+struct relay {
+  int epoll_fd;
+  int server_socket;                /* -1 if the relay does not accept. */
+  int index, count;                 /* Its share of the CPUs. */
+  struct tunnel *graveyard;
+  int handoff_fd;                   /* An eventfd, signalled by relay_attach. */
+  pthread_mutex_t handoff_mutex;
+  struct tunnel *handoff;           /* Attached, not yet registered. */
+  struct timer_wheel wheel;
+};
+
+static struct relay **relays;
+static int num_relays;
+static unsigned int next_relay;
+
+long relay_idle_timeout_ms = RELAY_DEFAULT_IDLE_TIMEOUT_MS;
+
+static void relay_fatal_error(char *message) {
+  perror(message);
+  exit(errno);
+}
+
+static long now_ms() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+  return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static int set_non_blocking(int fd) {
+  int flags = fcntl(fd, F_GETFL, 0);
+  return flags == -1 ? -1 : fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+static void tunnel_close(struct relay *relay, struct tunnel *tunnel) {
+  if (tunnel->closed) return;
+  tunnel->closed = 1;
+  timer_cancel(&tunnel->timer);
+  metrics_count(METRICS_BYTES_SENT, tunnel->directions[1].moved);
+  metrics_count(METRICS_TUNNELS_CLOSED, 1);
+  if (tunnel->logging) access_log_finish(&tunnel->log_entry, 0, tunnel->directions[1].moved);
+
+  /* Closing the sockets also removes them from the epoll set. */
+  close(tunnel->client_fd);
+  if (tunnel->upstream_fd != -1) close(tunnel->upstream_fd);
+  if (tunnel->upstream != NULL) upstream_release(tunnel->upstream);
+  int i;
+  for (i = 0; i < 2; i++) {
+    if (tunnel->directions[i].pipe[0] != -1) close(tunnel->directions[i].pipe[0]);
+    if (tunnel->directions[i].pipe[1] != -1) close(tunnel->directions[i].pipe[1]);
+  }
+
+  /* Events for the other socket may still be pending in this batch. */
+  LL_PREPEND(relay->graveyard, tunnel);
+}
+
+/* A client that never completes its request line is cut off after the header
+ * timeout; after that, a tunnel lives for as long as bytes keep moving. The
+ * deadline is only pushed back when it comes due, not on every byte. */
+static void tunnel_expire(void *data) {
+  struct tunnel *tunnel = data;
+  long now = now_ms();
+  if (tunnel->upstream_fd != -1 && now - tunnel->last_active_ms < relay_idle_timeout_ms) {
+    timer_arm(&tunnel->relay->wheel, &tunnel->timer,
+        tunnel->last_active_ms + relay_idle_timeout_ms);
+    return;
+  }
+  metrics_count(METRICS_TIMEOUTS, 1);
+  tunnel_close(tunnel->relay, tunnel);
+}
+
+/* Moves as many bytes as possible in DIRECTION. Returns -1 on error. */
+static int direction_pump(struct relay_direction *direction) {
+  ssize_t bytes;
+
+  while (1) {
+    if (direction->buffered > 0) {
+      bytes = splice(direction->pipe[0], NULL, direction->to, NULL, direction->buffered,
+          SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+      if (bytes < 0) return errno == EAGAIN ? 0 : -1;
+      direction->buffered -= bytes;
+      direction->moved += bytes;
+      continue;
+    }
+
+    if (direction->eof) {
+      if (!direction->done) {
+        shutdown(direction->to, SHUT_WR);
+        direction->done = 1;
+      }
+      return 0;
+    }
+
+    bytes = splice(direction->from, NULL, direction->pipe[1], NULL, RELAY_PIPE_SIZE,
+        SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (bytes < 0) return errno == EAGAIN ? 0 : -1;
+    if (bytes == 0) direction->eof = 1;
+    direction->buffered += bytes;
+  }
+}
+
+static void tunnel_bad_gateway(struct tunnel *tunnel) {
+  /* Dummy request read, just to be compliant, then a best-effort 502. */
+  char buffer[4096];
+  while (read(tunnel->client_fd, buffer, sizeof(buffer)) > 0);
+  send(tunnel->client_fd, BAD_GATEWAY_RESPONSE, strlen(BAD_GATEWAY_RESPONSE), MSG_NOSIGNAL);
+}
+
+static void tunnel_set_upstream(struct tunnel *tunnel, upstream_t *upstream, int upstream_fd) {
+  tunnel->upstream = upstream;
+  tunnel->upstream_fd = upstream_fd;
+  tunnel->directions[0].from = tunnel->directions[1].to = tunnel->client_fd;
+  tunnel->directions[0].to = tunnel->directions[1].from = upstream_fd;
+}
+
+/* Pairs TUNNEL with a backend chosen for PATH: a pooled connection, or a
+ * non-blocking connect. Backends that refuse straight away are skipped.
+ * Returns -1 if there is none left to try. */
+static int tunnel_connect(struct relay *relay, struct tunnel *tunnel, struct http_slice *path) {
+  while (tunnel->attempts++ < upstream_count()) {
+    upstream_t *upstream = upstream_choose(path ? path->data : NULL, path ? path->length : 0);
+    upstream_address(upstream, &tunnel->upstream_address);
+
+    int connecting = 0;
+    int upstream_fd = upstream_take(upstream);
+    if (upstream_fd == -1) {
+      upstream_fd = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+      if (upstream_fd == -1) {
+        upstream_release(upstream);
+        return -1;
+      }
+      if (connect(upstream_fd, (struct sockaddr *) &tunnel->upstream_address,
+            sizeof(tunnel->upstream_address)) == -1) {
+        if (errno != EINPROGRESS) {
+          close(upstream_fd);
+          upstream_report_failure(upstream);
+          upstream_release(upstream);
+          continue;
+        }
+        connecting = 1;
+      }
+    }
+
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    event.data.ptr = tunnel;
+    if (epoll_ctl(relay->epoll_fd, EPOLL_CTL_ADD, upstream_fd, &event) == -1) {
+      close(upstream_fd);
+      upstream_release(upstream);
+      return -1;
+    }
+    tunnel_set_upstream(tunnel, upstream, upstream_fd);
+    tunnel->connecting = connecting;
+    return 0;
+  }
+  return -1;
+}
+
+/* Starts the access log entry of TUNNEL for the request line at the start
+ * of BUFFER, whose path is PATH. Only the first request of a tunnel is
+ * logged: the relay does not look at any later ones. */
+static void tunnel_start_log(struct tunnel *tunnel, char *buffer, struct http_slice *path) {
+  struct http_slice method = { buffer, path->data - 1 - buffer };
+  tunnel->logging = access_log_start(&tunnel->log_entry, &tunnel->peer, &method, path);
+}
+
+/* Picks the backend once the request line is in, which hash balancing needs
+ * and which tells METRICS_PATH requests apart. Returns 1 once the tunnel has
+ * an upstream socket, 0 to wait for more bytes, -1 on failure and -2 if the
+ * request was answered here. */
+static int tunnel_choose(struct relay *relay, struct tunnel *tunnel) {
+  /* Peek, so the request line stays in the socket to be relayed as-is. */
+  char buffer[LIBHTTP_REQUEST_MAX_SIZE];
+  ssize_t length = recv(tunnel->client_fd, buffer, sizeof(buffer), MSG_PEEK);
+  if (length < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+  if (length <= 0) return -1;
+
+  struct http_slice path;
+  enum http_parse_status status = http_request_peek_path(buffer, length, &path);
+  if (status == HTTP_PARSE_NEED_MORE) return 0;
+
+  enum metrics_format stats_format = status == HTTP_PARSE_COMPLETE
+      ? metrics_stats_format(path.data, path.length) : METRICS_NOT_STATS;
+  if (stats_format != METRICS_NOT_STATS) {
+    /* Consume what was peeked, so that closing does not reset the report. */
+    if (recv(tunnel->client_fd, buffer, length, 0) > 0)
+      metrics_send(tunnel->client_fd, stats_format);
+    return -2;
+  }
+  if (status == HTTP_PARSE_COMPLETE) tunnel_start_log(tunnel, buffer, &path);
+  return tunnel_connect(relay, tunnel, status == HTTP_PARSE_COMPLETE ? &path : NULL) == 0
+      ? 1 : -1;
+}
+
+static void tunnel_handle(struct relay *relay, struct tunnel *tunnel) {
+  if (tunnel->closed) return;
+  if (!timer_armed(&tunnel->timer)) {
+    tunnel->last_active_ms = now_ms();
+    timer_arm(&relay->wheel, &tunnel->timer, tunnel->last_active_ms
+        + (tunnel->upstream_fd == -1 ? http_header_timeout_ms : relay_idle_timeout_ms));
+  }
+
+  while (tunnel->upstream_fd == -1 || tunnel->connecting) {
+    if (tunnel->upstream_fd == -1) {
+      int chosen = tunnel_choose(relay, tunnel);
+      if (chosen == 0) return;
+      if (chosen < 0) {
+        if (chosen == -1) tunnel_bad_gateway(tunnel);
+        tunnel_close(relay, tunnel);
+        return;
+      }
+      continue;
+    }
+
+    /* Events on the client socket can arrive first; asking connect again
+     * tells whether the upstream connection is actually established. */
+    if (connect(tunnel->upstream_fd, (struct sockaddr *) &tunnel->upstream_address,
+          sizeof(tunnel->upstream_address)) == 0 || errno == EISCONN) {
+      tunnel->connecting = 0;
+    } else if (errno == EALREADY || errno == EINPROGRESS) {
+      return;
+    } else {
+      /* Nothing has been read from the client yet: try the next backend. */
+      upstream_report_failure(tunnel->upstream);
+      upstream_release(tunnel->upstream);
+      close(tunnel->upstream_fd);
+      tunnel_set_upstream(tunnel, NULL, -1);
+      tunnel->connecting = 0;
+    }
+  }
+
+  size_t moved = tunnel->directions[0].moved + tunnel->directions[1].moved;
+  if (direction_pump(&tunnel->directions[0]) < 0
+      || direction_pump(&tunnel->directions[1]) < 0
+      || (tunnel->directions[0].done && tunnel->directions[1].done)) {
+    tunnel_close(relay, tunnel);
+    return;
+  }
+  if (tunnel->directions[0].moved + tunnel->directions[1].moved != moved)
+    tunnel->last_active_ms = now_ms();
+
+  /* Time to first byte of the (first) response, for ejecting slow backends. */
+  if (!tunnel->latency_reported) {
+    long now = now_ms();
+    if (tunnel->request_sent_ms == 0 && tunnel->directions[0].moved > 0)
+      tunnel->request_sent_ms = now;
+    if (tunnel->request_sent_ms != 0 && tunnel->directions[1].moved > 0) {
+      upstream_report_latency(tunnel->upstream, now - tunnel->request_sent_ms);
+      tunnel->latency_reported = 1;
+    }
+  }
+}
+
+/* Creates a tunnel for CLIENT_FD, with the first HEAD_LENGTH bytes of its
+ * request (already read by the caller) queued in the client -> upstream pipe. */
+static struct tunnel *tunnel_create(int client_fd, char *head, size_t head_length) {
+  struct tunnel *tunnel = calloc(1, sizeof(struct tunnel));
+  if (tunnel == NULL) return NULL;
+  tunnel->client_fd = client_fd;
+  tunnel_set_upstream(tunnel, NULL, -1);
+  timer_init(&tunnel->timer, tunnel_expire, tunnel);
+
+  int i;
+  for (i = 0; i < 2; i++) {
+    struct relay_direction *direction = &tunnel->directions[i];
+    direction->pipe[0] = direction->pipe[1] = -1;
+    if (pipe2(direction->pipe, O_NONBLOCK | O_CLOEXEC) == -1) {
+      if (i == 1) {
+        close(tunnel->directions[0].pipe[0]);
+        close(tunnel->directions[0].pipe[1]);
+      }
+      free(tunnel);
+      return NULL;
+    }
+  }
+
+  /* The head is at most LIBHTTP_REQUEST_MAX_SIZE, well under a pipe's
+   * capacity, so this never blocks. */
+  if (head_length > 0) {
+    if (write(tunnel->directions[0].pipe[1], head, head_length) != (ssize_t) head_length) {
+      for (i = 0; i < 2; i++) {
+        close(tunnel->directions[i].pipe[0]);
+        close(tunnel->directions[i].pipe[1]);
+      }
+      free(tunnel);
+      return NULL;
+    }
+    tunnel->directions[0].buffered = head_length;
+  }
+  return tunnel;
+}
+
+/* Registers the client socket of TUNNEL with RELAY (edge-triggered: every
+ * event pumps both directions until they would block). On failure the
+ * tunnel is torn down right away, as nothing can be pending for it yet. */
+static int relay_add_tunnel(struct relay *relay, struct tunnel *tunnel) {
+  tunnel->relay = relay;
+  struct epoll_event event;
+  event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+  event.data.ptr = tunnel;
+  if (epoll_ctl(relay->epoll_fd, EPOLL_CTL_ADD, tunnel->client_fd, &event) == -1) {
+    close(tunnel->client_fd);
+    if (tunnel->upstream_fd != -1) close(tunnel->upstream_fd);
+    if (tunnel->upstream != NULL) upstream_release(tunnel->upstream);
+    int i;
+    for (i = 0; i < 2; i++) {
+      close(tunnel->directions[i].pipe[0]);
+      close(tunnel->directions[i].pipe[1]);
+    }
+    free(tunnel);
+    return -1;
+  }
+  metrics_count(METRICS_TUNNELS_OPENED, 1);
+  return 0;
+}
+
+static void relay_accept(struct relay *relay) {
+  while (1) {
+    struct sockaddr_in peer;
+    socklen_t peer_length = sizeof(peer);
+    int client_fd = accept4(relay->server_socket, (struct sockaddr *) &peer, &peer_length,
+        SOCK_NONBLOCK);
+    if (client_fd < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        perror("Error accepting socket");
+      return;
+    }
+    metrics_count(METRICS_CONNECTIONS, 1);
+    if (!admission_allow(&peer)) {
+      admission_reject(client_fd, 429);
+      continue;
+    }
+
+    /* The backend is chosen once the client's first event brings the
+     * request line. */
+    struct tunnel *tunnel = tunnel_create(client_fd, NULL, 0);
+    if (tunnel == NULL) {
+      close(client_fd);
+      continue;
+    }
+    tunnel->peer = peer;
+    relay_add_tunnel(relay, tunnel);
+  }
+}
+
+/* Registers the tunnels that other threads attached since the last look.
+ * Only the relay thread touches a tunnel once it has been handed over, so
+ * no other thread can find it pumped, closed or freed under its feet. */
+static void relay_take_handoff(struct relay *relay) {
+  uint64_t count;
+  if (read(relay->handoff_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+    relay_fatal_error("Failed to read the relay's eventfd");
+
+  pthread_mutex_lock(&relay->handoff_mutex);
+  struct tunnel *tunnels = relay->handoff;
+  relay->handoff = NULL;
+  pthread_mutex_unlock(&relay->handoff_mutex);
+
+  struct tunnel *tunnel, *tmp;
+  LL_FOREACH_SAFE(tunnels, tunnel, tmp) {
+    tunnel->next = NULL;
+    if (relay_add_tunnel(relay, tunnel) == -1) continue;
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    event.data.ptr = tunnel;
+    if (epoll_ctl(relay->epoll_fd, EPOLL_CTL_ADD, tunnel->upstream_fd, &event) == -1)
+      tunnel_close(relay, tunnel);
+  }
+}
+
+static void *relay_loop(void *args) {
+  struct relay *relay = args;
+  struct epoll_event events[RELAY_MAX_EVENTS];
+
+  /* Relays are created up front, so that tunnels can be attached to them
+   * straight away; what they allocate later, per tunnel, is local. */
+  affinity_pin(relay->index, relay->count);
+  while (1) {
+    int num_events = epoll_wait(relay->epoll_fd, events, RELAY_MAX_EVENTS,
+        timer_wheel_timeout(&relay->wheel, now_ms()));
+    if (num_events < 0) {
+      if (errno == EINTR) continue;
+      relay_fatal_error("Failed to wait for events");
+    }
+
+    int i;
+    for (i = 0; i < num_events; i++) {
+      /* The listening socket is registered with a NULL data pointer, the
+       * handoff eventfd with the relay's. */
+      if (events[i].data.ptr == NULL) {
+        relay_accept(relay);
+      } else if (events[i].data.ptr == relay) {
+        relay_take_handoff(relay);
+      } else {
+        tunnel_handle(relay, events[i].data.ptr);
+      }
+    }
+    timer_wheel_advance(&relay->wheel, now_ms());
+
+    struct tunnel *tunnel, *tmp;
+    LL_FOREACH_SAFE(relay->graveyard, tunnel, tmp) {
+      free(tunnel);
+    }
+    relay->graveyard = NULL;
+  }
+
+  return NULL;
+}
+
+static struct relay *relay_create(int server_socket, int index, int count) {
+  struct relay *relay = calloc(1, sizeof(struct relay));
+  if (relay == NULL) relay_fatal_error("Failed to allocate relay");
+
+  relay->server_socket = server_socket;
+  relay->index = index;
+  relay->count = count;
+  timer_wheel_init(&relay->wheel, now_ms());
+  relay->epoll_fd = epoll_create1(0);
+  if (relay->epoll_fd == -1) relay_fatal_error("Failed to create epoll instance");
+
+  pthread_mutex_init(&relay->handoff_mutex, NULL);
+  relay->handoff_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  struct epoll_event handoff_event;
+  handoff_event.events = EPOLLIN;
+  handoff_event.data.ptr = relay;
+  if (relay->handoff_fd == -1
+      || epoll_ctl(relay->epoll_fd, EPOLL_CTL_ADD, relay->handoff_fd, &handoff_event) == -1)
+    relay_fatal_error("Failed to set up the relay's eventfd");
+
+  if (server_socket != -1) {
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLEXCLUSIVE;
+    event.data.ptr = NULL;
+    if (epoll_ctl(relay->epoll_fd, EPOLL_CTL_ADD, server_socket, &event) == -1)
+      relay_fatal_error("Failed to watch server socket");
+  }
+  return relay;
+}
+
+void relay_init(int count) {
+  num_relays = count > 0 ? count : 1;
+  relays = malloc(sizeof(struct relay *) * num_relays);
+  if (relays == NULL) relay_fatal_error("Failed to allocate relays");
+
+  int i;
+  for (i = 0; i < num_relays; i++) {
+    relays[i] = relay_create(-1, i, num_relays);
+    pthread_t thread;
+    pthread_create(&thread, NULL, relay_loop, relays[i]);
+  }
+}
+
+/* Safe to call from any thread: the tunnel is built here and handed to the
+ * relay thread, which registers its sockets. */
+void relay_attach(int client_fd, int upstream_fd, upstream_t *upstream,
+    char *head, size_t head_length) {
+  struct relay *relay = relays[__atomic_fetch_add(&next_relay, 1, __ATOMIC_RELAXED)
+      % num_relays];
+
+  struct tunnel *tunnel = NULL;
+  if (set_non_blocking(client_fd) == 0 && set_non_blocking(upstream_fd) == 0)
+    tunnel = tunnel_create(client_fd, head, head_length);
+  if (tunnel == NULL) {
+    close(client_fd);
+    close(upstream_fd);
+    upstream_release(upstream);
+    return;
+  }
+  tunnel_set_upstream(tunnel, upstream, upstream_fd);
+
+  struct http_slice path;
+  socklen_t peer_length = sizeof(tunnel->peer);
+  if (access_log_enabled()
+      && http_request_peek_path(head, head_length, &path) == HTTP_PARSE_COMPLETE
+      && getpeername(client_fd, (struct sockaddr *) &tunnel->peer, &peer_length) == 0)
+    tunnel_start_log(tunnel, head, &path);
+
+  pthread_mutex_lock(&relay->handoff_mutex);
+  LL_APPEND(relay->handoff, tunnel);
+  pthread_mutex_unlock(&relay->handoff_mutex);
+  uint64_t one = 1;
+  if (write(relay->handoff_fd, &one, sizeof(one)) < 0)
+    relay_fatal_error("Failed to signal the relay's eventfd");
+}
+
+void relay_serve_forever(int *server_sockets, int count) {
+  if (count < 1) count = 1;
+
+  int i;
+  for (i = 0; i < count; i++)
+    if (set_non_blocking(server_sockets[i]) == -1)
+      relay_fatal_error("Failed to make server socket non-blocking");
+
+  for (i = 1; i < count; i++) {
+    pthread_t thread;
+    pthread_create(&thread, NULL, relay_loop, relay_create(server_sockets[i], i, count));
+  }
+  relay_loop(relay_create(server_sockets[0], 0, count));
+}
@@ -0,0 +1,36 @@
+#ifndef __RELAY__
+#define __RELAY__
+
+#include "upstream.h"
+
+/* RELAY shuttles bytes between proxied clients and their backends from a
+ * small, fixed set of event loop threads. Each tunnel moves data in both
+ * directions with splice through a pair of pipes, so relaying costs neither
+ * a thread nor a user-space buffer per connection. Every relay thread keeps
+ * the deadlines of its tunnels on a timer wheel (see timer_wheel.h). */
+
+#define RELAY_PIPE_SIZE 65536
+#define RELAY_DEFAULT_IDLE_TIMEOUT_MS 60000
+
+/* Tunnels in which no byte has moved either way for this long are closed. */
+extern long relay_idle_timeout_ms;
+
+/* Starts NUM_RELAYS relay threads that tunnels can be attached to, relay I
+ * pinned to share I of the CPUs (see affinity.h). */
+void relay_init(int num_relays);
+
+/* Hands a client socket and a connected socket to its chosen UPSTREAM over
+ * to a relay thread, which owns (and eventually closes and releases) them
+ * from now on. The HEAD_LENGTH bytes at HEAD, which the caller has already
+ * read from the client, are sent upstream first. */
+void relay_attach(int client_fd, int upstream_fd, upstream_t *upstream,
+    char *head, size_t head_length);
+
+/* Runs NUM_RELAYS relay loops, the first one on the calling thread, which
+ * also accept clients, loop I on SERVER_SOCKETS[I] (as for
+ * reactor_serve_forever), and pair them with a backend: a pooled
+ * connection, or a non-blocking connect (see upstream.h, which must be
+ * initialized first). Never returns. */
+void relay_serve_forever(int *server_sockets, int num_relays);
+
+#endif
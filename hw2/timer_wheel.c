@@ -0,0 +1,226 @@
+#include <limits.h>
+#include <linux/tcp.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <sys/socket.h>
+#include <time.h>
+
+#include "metrics.h"
+#include "timer_wheel.h"
+#include "utlist.h"
+
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SLOTS - 1)
+#define TIMER_WHEEL_MAX_TICKS ((1L << (TIMER_WHEEL_SLOT_BITS * TIMER_WHEEL_LEVELS)) - 1)
+
+struct timer_deadline_shard {
+  pthread_mutex_t mutex;
+  struct timer_wheel wheel;
+} __attribute__((aligned(64)));
+
+static pthread_once_t deadline_once = PTHREAD_ONCE_INIT;
+static struct timer_deadline_shard deadline_shards[TIMER_DEADLINE_SHARDS];
+
+static long now_ms() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+  return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+void timer_wheel_init(struct timer_wheel *wheel, long now_ms) {
+  int level, index;
+  wheel->now = now_ms / TIMER_WHEEL_TICK_MS;
+  wheel->count = 0;
+  for (level = 0; level < TIMER_WHEEL_LEVELS; level++)
+    for (index = 0; index < TIMER_WHEEL_SLOTS; index++)
+      wheel->slots[level][index] = NULL;
+}
+
+void timer_init(struct timer *timer, void (*expire)(void *data), void *data) {
+  timer->expire = expire;
+  timer->data = data;
+  timer->wheel = NULL;
+  timer->slot = NULL;
+  timer->prev = timer->next = NULL;
+}
+
+/* Drops TIMER into the slot of the finest ring whose span still reaches its
+ * expiry. Expiries in the past are due on the next tick, and those beyond
+ * the last ring are pulled in to its end. */
+static void timer_wheel_place(struct timer_wheel *wheel, struct timer *timer) {
+  long delta = timer->expires - wheel->now;
+  if (delta < 0) {
+    timer->expires = wheel->now;
+    delta = 0;
+  } else if (delta > TIMER_WHEEL_MAX_TICKS) {
+    timer->expires = wheel->now + TIMER_WHEEL_MAX_TICKS;
+    delta = TIMER_WHEEL_MAX_TICKS;
+  }
+
+  int level = 0;
+  while (level < TIMER_WHEEL_LEVELS - 1
+      && delta >= 1L << (TIMER_WHEEL_SLOT_BITS * (level + 1)))
+    level++;
+  int index = (timer->expires >> (TIMER_WHEEL_SLOT_BITS * level)) & TIMER_WHEEL_MASK;
+  timer->slot = &wheel->slots[level][index];
+  DL_APPEND(*timer->slot, timer);
+}
+
+void timer_arm(struct timer_wheel *wheel, struct timer *timer, long expires_ms) {
+  timer_cancel(timer);
+  /* Rounded up, so that a timer never expires early. */
+  timer->expires = (expires_ms + TIMER_WHEEL_TICK_MS - 1) / TIMER_WHEEL_TICK_MS;
+  timer->wheel = wheel;
+  timer_wheel_place(wheel, timer);
+  wheel->count++;
+}
+
+void timer_cancel(struct timer *timer) {
+  if (timer->wheel == NULL) return;
+  DL_DELETE(*timer->slot, timer);
+  timer->wheel->count--;
+  timer->wheel = NULL;
+  timer->slot = NULL;
+}
+
+int timer_armed(struct timer *timer) {
+  return timer->wheel != NULL;
+}
+
+/* At TICK, a multiple of the first ring's span, moves the timers of the
+ * coarser slots that now come due down the wheel. */
+static void timer_wheel_cascade(struct timer_wheel *wheel, long tick) {
+  int level;
+  for (level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+    int index = (tick >> (TIMER_WHEEL_SLOT_BITS * level)) & TIMER_WHEEL_MASK;
+    struct timer *timers = wheel->slots[level][index];
+    wheel->slots[level][index] = NULL;
+
+    struct timer *timer, *tmp;
+    DL_FOREACH_SAFE(timers, timer, tmp) {
+      timer_wheel_place(wheel, timer);
+    }
+    if (index != 0) break;
+  }
+}
+
+void timer_wheel_advance(struct timer_wheel *wheel, long now_ms) {
+  long target = now_ms / TIMER_WHEEL_TICK_MS;
+  while (wheel->now <= target) {
+    if (wheel->count == 0) {
+      wheel->now = target + 1;
+      break;
+    }
+
+    long tick = wheel->now;
+    if ((tick & TIMER_WHEEL_MASK) == 0) timer_wheel_cascade(wheel, tick);
+    wheel->now = tick + 1;
+
+    /* Timers armed by the callbacks can land in this very slot, a whole
+     * rotation later; they are behind the ones due now. */
+    struct timer **slot = &wheel->slots[0][tick & TIMER_WHEEL_MASK];
+    while (*slot != NULL && (*slot)->expires <= tick) {
+      struct timer *timer = *slot;
+      timer_cancel(timer);
+      timer->expire(timer->data);
+    }
+  }
+}
+
+int timer_wheel_timeout(struct timer_wheel *wheel, long now_ms) {
+  if (wheel->count == 0) return -1;
+
+  /* The first busy slot of the first ring, or the next cascade, whichever
+   * comes first. */
+  long tick = wheel->now;
+  int i;
+  for (i = 0; i < TIMER_WHEEL_SLOTS; i++, tick++) {
+    if (wheel->slots[0][tick & TIMER_WHEEL_MASK] != NULL) break;
+    if (i > 0 && (tick & TIMER_WHEEL_MASK) == 0) break;
+  }
+  long timeout = tick * TIMER_WHEEL_TICK_MS - now_ms;
+  return timeout < 0 ? 0 : timeout > INT_MAX ? INT_MAX : (int) timeout;
+}
+
+static void *timer_deadline_loop(void *args) {
+  struct timer_deadline_shard *shard = args;
+  struct timespec interval = { 0, TIMER_DEADLINE_INTERVAL_MS * 1000000L };
+  while (1) {
+    nanosleep(&interval, NULL);
+    pthread_mutex_lock(&shard->mutex);
+    timer_wheel_advance(&shard->wheel, now_ms());
+    pthread_mutex_unlock(&shard->mutex);
+  }
+  return NULL;
+}
+
+static void timer_deadline_start() {
+  int i;
+  for (i = 0; i < TIMER_DEADLINE_SHARDS; i++) {
+    struct timer_deadline_shard *shard = &deadline_shards[i];
+    pthread_mutex_init(&shard->mutex, NULL);
+    timer_wheel_init(&shard->wheel, now_ms());
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, timer_deadline_loop, shard) != 0)
+      perror("Failed to start a deadline thread (no deadlines for some workers)");
+  }
+}
+
+/* How much of what was sent on FD the peer has acknowledged. */
+static unsigned long long timer_deadline_bytes_acked(int fd) {
+  struct tcp_info info;
+  socklen_t length = sizeof(info);
+  if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &length) < 0) return 0;
+  return info.tcpi_bytes_acked;
+}
+
+/* Runs with the shard's mutex held, so the worker cannot have closed FD
+ * (and the number cannot have been reused) before it has cancelled. */
+static void timer_deadline_expire(void *data) {
+  struct timer_deadline *deadline = data;
+  if (deadline->timeout_ms > 0) {
+    unsigned long long bytes_acked = timer_deadline_bytes_acked(deadline->fd);
+    if (!deadline->acked_known || bytes_acked != deadline->bytes_acked) {
+      deadline->acked_known = 1;
+      deadline->bytes_acked = bytes_acked;
+      timer_arm(&deadline_shards[deadline->shard].wheel, &deadline->timer,
+          now_ms() + deadline->timeout_ms);
+      return;
+    }
+  }
+  metrics_count(METRICS_TIMEOUTS, 1);
+  shutdown(deadline->fd, SHUT_RDWR);
+}
+
+static void timer_deadline_schedule(struct timer_deadline *deadline, int fd,
+    long timeout_ms) {
+  pthread_once(&deadline_once, timer_deadline_start);
+  timer_init(&deadline->timer, timer_deadline_expire, deadline);
+  deadline->fd = fd;
+  deadline->shard = fd % TIMER_DEADLINE_SHARDS;
+
+  struct timer_deadline_shard *shard = &deadline_shards[deadline->shard];
+  pthread_mutex_lock(&shard->mutex);
+  timer_arm(&shard->wheel, &deadline->timer, now_ms() + timeout_ms);
+  pthread_mutex_unlock(&shard->mutex);
+}
+
+void timer_deadline_arm(struct timer_deadline *deadline, int fd, long timeout_ms) {
+  deadline->timeout_ms = 0;
+  timer_deadline_schedule(deadline, fd, timeout_ms);
+}
+
+void timer_deadline_arm_send(struct timer_deadline *deadline, int fd, long timeout_ms) {
+  deadline->timeout_ms = timeout_ms;
+  deadline->acked_known = 0;
+  timer_deadline_schedule(deadline, fd, timeout_ms / 4);
+}
+
+int timer_deadline_cancel(struct timer_deadline *deadline) {
+  struct timer_deadline_shard *shard = &deadline_shards[deadline->shard];
+  pthread_mutex_lock(&shard->mutex);
+  int expired = !timer_armed(&deadline->timer);
+  timer_cancel(&deadline->timer);
+  pthread_mutex_unlock(&shard->mutex);
+  return expired;
+}
@@ -0,0 +1,95 @@
+#ifndef __TIMER_WHEEL__
+#define __TIMER_WHEEL__
+
+/* TIMER_WHEEL keeps the deadlines of connections: the time a client has to
+ * send a request head, to start the next request on a kept-alive
+ * connection, to take the next piece of a response, or to move any byte at
+ * all through a proxy tunnel.
+ *
+ * A wheel is hierarchical: TIMER_WHEEL_LEVELS rings of TIMER_WHEEL_SLOTS
+ * slots, a slot of the first ring spanning one tick and every further ring
+ * being TIMER_WHEEL_SLOTS times coarser. A timer is an intrusive list node
+ * dropped into the slot its expiry falls into, so arming and cancelling are
+ * O(1) whatever the number of connections; the timers of a coarse slot are
+ * redistributed to finer rings as its time comes.
+ *
+ * A wheel belongs to one event loop thread and is not locked. Blocking
+ * workers, which cannot wait on a wheel while they sit in read or write,
+ * use timer_deadline_arm instead: shared wheels, each driven by a thread of
+ * its own, shut the socket down once the deadline passes, so that whatever
+ * the worker is blocked in returns. Deadlines are spread over the wheels by
+ * fd, each with its own lock, so workers arming and cancelling them every
+ * request seldom meet. */
+
+#define TIMER_WHEEL_TICK_MS 10
+#define TIMER_WHEEL_LEVELS 4
+#define TIMER_WHEEL_SLOT_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_SLOT_BITS)
+#define TIMER_DEADLINE_INTERVAL_MS 100    /* How often the deadline threads look. */
+#define TIMER_DEADLINE_SHARDS 8
+
+struct timer_wheel;
+
+struct timer {
+  long expires;             /* In ticks. */
+  void (*expire)(void *data);
+  void *data;
+  struct timer_wheel *wheel;    /* NULL unless armed. */
+  struct timer **slot;
+  struct timer *prev, *next;
+};
+
+struct timer_wheel {
+  long now;                 /* The next tick to expire. */
+  int count;                /* Armed timers. */
+  struct timer *slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+};
+
+/* A deadline of a blocking worker, see timer_deadline_arm. */
+struct timer_deadline {
+  struct timer timer;
+  int fd;
+  int shard;
+  long timeout_ms;          /* Set for a send deadline, 0 otherwise. */
+  int acked_known;          /* BYTES_ACKED has been read since arming. */
+  unsigned long long bytes_acked;
+};
+
+void timer_wheel_init(struct timer_wheel *wheel, long now_ms);
+
+/* Sets TIMER up to call EXPIRE(DATA) when it runs out. */
+void timer_init(struct timer *timer, void (*expire)(void *data), void *data);
+
+/* (Re)arms TIMER on WHEEL to expire at EXPIRES_MS, on the same clock as the
+ * NOW_MS passed to the wheel. */
+void timer_arm(struct timer_wheel *wheel, struct timer *timer, long expires_ms);
+
+void timer_cancel(struct timer *timer);
+
+int timer_armed(struct timer *timer);
+
+/* Expires every timer on WHEEL that is due at NOW_MS. Callbacks may arm and
+ * cancel timers, their own included. */
+void timer_wheel_advance(struct timer_wheel *wheel, long now_ms);
+
+/* How many milliseconds from NOW_MS the next timer on WHEEL may be due, as
+ * an epoll_wait timeout: -1 if there is none. */
+int timer_wheel_timeout(struct timer_wheel *wheel, long now_ms);
+
+/* Shuts FD down unless DEADLINE is cancelled within TIMEOUT_MS. DEADLINE
+ * must not be armed already. */
+void timer_deadline_arm(struct timer_deadline *deadline, int fd, long timeout_ms);
+
+/* Like timer_deadline_arm, but the deadline moves TIMEOUT_MS further out
+ * every time the peer is found to have acknowledged more of the data sent to
+ * it: it only trips once FD has been stalled for TIMEOUT_MS (and at most a
+ * quarter of that more). What the peer has acknowledged is first looked at a
+ * quarter of TIMEOUT_MS in, so a send that finishes sooner costs nothing
+ * beyond arming and cancelling. */
+void timer_deadline_arm_send(struct timer_deadline *deadline, int fd, long timeout_ms);
+
+/* Once this returns, DEADLINE will not touch its fd any more. Returns 1 if
+ * it had already shut the fd down. */
+int timer_deadline_cancel(struct timer_deadline *deadline);
+
+#endif
@@ -0,0 +1,455 @@
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "upstream.h"
+
+#define UPSTREAM_REFILL_INTERVAL_MS 250
+#define UPSTREAM_SHRINK_MS 1000         /* Without takers, the pool shrinks after. */
+#define UPSTREAM_RING_POINTS 128    /* Points per backend on the hash ring. */
+
+struct upstream_idle {
+  int fd;
+  long opened_ms;
+};
+
+struct upstream {
+  char *hostname;
+  int port;
+
+  /* Guarded by the mutex. */
+  struct sockaddr_in address;
+  long resolved_ms;
+  struct upstream_idle *idle;     /* Oldest first; taken from the end. */
+  int num_idle;
+  int refill;                     /* Connections taken since the last top-up. */
+  long taken_ms;                  /* When the pool was last drawn from. */
+
+  /* Updated atomically. */
+  int active;                     /* Client connections currently using it. */
+  long latency_ms;                /* Moving average of the time to first byte. */
+  long ejected_until_ms;
+
+  upstream_t *next;
+};
+
+struct upstream_ring_point {
+  unsigned int hash;
+  upstream_t *upstream;
+};
+
+static upstream_t *upstreams;
+static upstream_t **upstream_list;
+static int num_upstreams;
+static unsigned int next_upstream;
+static struct upstream_ring_point *ring;
+static int num_ring_points;
+
+static int upstream_balance;
+static long upstream_dns_ttl_ms;
+static int upstream_pool_size;
+static long upstream_max_latency_ms;
+static long upstream_eject_ms;
+
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t taken;        /* Signalled when a pool is drawn from. */
+
+static long now_ms() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static unsigned int hash_bytes(char *data, size_t length) {
+  unsigned int hash = 2166136261u;
+  while (length-- > 0) {
+    hash ^= (unsigned char) *data++;
+    hash *= 16777619u;
+  }
+  /* FNV alone spreads similar keys poorly over the ring; finish with a mix. */
+  hash ^= hash >> 16;
+  hash *= 0x85ebca6bu;
+  hash ^= hash >> 13;
+  return hash;
+}
+
+static int upstream_resolve(upstream_t *upstream, struct in_addr *address) {
+  struct addrinfo hints, *result;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(upstream->hostname, NULL, &hints, &result) != 0) return -1;
+  *address = ((struct sockaddr_in *) result->ai_addr)->sin_addr;
+  freeaddrinfo(result);
+  return 0;
+}
+
+/* Opens a non-blocking connection to ADDRESS, waiting at most
+ * UPSTREAM_CONNECT_TIMEOUT_MS for it: a backend that drops SYNs would
+ * otherwise hold the caller for the minutes the kernel keeps retrying. */
+static int upstream_open(struct sockaddr_in *address) {
+  int fd = socket(PF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  if (fd == -1) return -1;
+  if (connect(fd, (struct sockaddr *) address, sizeof(*address)) == -1) {
+    struct pollfd pollfd = { .fd = fd, .events = POLLOUT };
+    int error;
+    socklen_t length = sizeof(error);
+    if (errno != EINPROGRESS || poll(&pollfd, 1, UPSTREAM_CONNECT_TIMEOUT_MS) != 1
+        || getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length) == -1 || error != 0) {
+      close(fd);
+      return -1;
+    }
+  }
+  return fd;
+}
+
+static int upstream_healthy(upstream_t *upstream, long now) {
+  return now >= __atomic_load_n(&upstream->ejected_until_ms, __ATOMIC_RELAXED);
+}
+
+static void upstream_eject(upstream_t *upstream, char *reason) {
+  long now = now_ms();
+  if (!upstream_healthy(upstream, now)) return;
+  __atomic_store_n(&upstream->ejected_until_ms, now + upstream_eject_ms, __ATOMIC_RELAXED);
+  __atomic_store_n(&upstream->latency_ms, 0, __ATOMIC_RELAXED);
+  fprintf(stderr, "Ejecting upstream %s:%d for %ld ms (%s)\n", upstream->hostname,
+      upstream->port, upstream_eject_ms, reason);
+}
+
+/* Whether the pooled connection IDLE can still be handed out at NOW. A live,
+ * idle connection has nothing to read yet; anything else means the backend
+ * closed it (or sent something nobody asked for). */
+static int upstream_idle_usable(struct upstream_idle *idle, long now) {
+  char byte;
+  return now - idle->opened_ms < UPSTREAM_MAX_IDLE_MS
+      && recv(idle->fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT) == -1
+      && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+/* Closes the pooled connections of UPSTREAM that can no longer be handed
+ * out, or all of them if EVERYTHING is set. Must be called with the mutex
+ * held. */
+static void upstream_expire(upstream_t *upstream, long now, int everything) {
+  int kept = 0;
+  int i;
+  for (i = 0; i < upstream->num_idle; i++) {
+    if (!everything && upstream_idle_usable(&upstream->idle[i], now)) {
+      upstream->idle[kept++] = upstream->idle[i];
+    } else {
+      close(upstream->idle[i].fd);
+    }
+  }
+  upstream->num_idle = kept;
+}
+
+/* Re-resolves UPSTREAM if its TTL ran out and tops up its pool. Must be
+ * called with the mutex held, which is dropped around DNS and connects. */
+static void upstream_refresh(upstream_t *upstream, long now) {
+  if (now - upstream->resolved_ms >= upstream_dns_ttl_ms) {
+    struct in_addr address;
+    pthread_mutex_unlock(&mutex);
+    int resolved = upstream_resolve(upstream, &address) == 0;
+    pthread_mutex_lock(&mutex);
+
+    if (!resolved) {
+      fprintf(stderr, "Cannot refresh host: %s (keeping the cached address)\n",
+          upstream->hostname);
+    } else if (address.s_addr != upstream->address.sin_addr.s_addr) {
+      upstream->address.sin_addr = address;
+      upstream_expire(upstream, now, 1);
+    }
+    upstream->resolved_ms = now;
+  }
+
+  upstream_expire(upstream, now, 0);
+  if (!upstream_healthy(upstream, now)) return;
+
+  /* Once a burst is over, the connections opened for it are closed rather
+   * than left holding whatever the backend dedicates to an open connection
+   * (a worker thread, for a server like this one). */
+  int floor = UPSTREAM_POOL_FLOOR < upstream_pool_size ? UPSTREAM_POOL_FLOOR : upstream_pool_size;
+  if (now - upstream->taken_ms >= UPSTREAM_SHRINK_MS && upstream->num_idle > floor) {
+    int excess = upstream->num_idle - floor;
+    int i;
+    for (i = 0; i < excess; i++) close(upstream->idle[i].fd);
+    memmove(upstream->idle, upstream->idle + excess, sizeof(struct upstream_idle) * floor);
+    upstream->num_idle = floor;
+  }
+  while (upstream->num_idle < upstream_pool_size
+      && (upstream->refill > 0 || upstream->num_idle < floor)) {
+    if (upstream->refill > 0) upstream->refill--;
+    struct sockaddr_in address = upstream->address;
+    pthread_mutex_unlock(&mutex);
+    int fd = upstream_open(&address);
+    pthread_mutex_lock(&mutex);
+
+    if (fd == -1) {
+      upstream_eject(upstream, "connect failed");
+      return;
+    }
+    if (address.sin_addr.s_addr != upstream->address.sin_addr.s_addr
+        || upstream->num_idle == upstream_pool_size) {
+      close(fd);
+      continue;
+    }
+    upstream->idle[upstream->num_idle].fd = fd;
+    upstream->idle[upstream->num_idle].opened_ms = now_ms();
+    upstream->num_idle++;
+  }
+  /* Demand the pool was already full for is not carried over, or connections
+   * the backend closes for being idle would be replaced all the same. */
+  upstream->refill = 0;
+}
+
+static void *upstream_refresh_loop(void *args) {
+  pthread_mutex_lock(&mutex);
+  while (1) {
+    long wait_ms = UPSTREAM_REFILL_INTERVAL_MS;
+    upstream_t *upstream;
+    for (upstream = upstreams; upstream != NULL; upstream = upstream->next) {
+      upstream_refresh(upstream, now_ms());
+      long until_ttl = upstream->resolved_ms + upstream_dns_ttl_ms - now_ms();
+      if (until_ttl < wait_ms) wait_ms = until_ttl;
+    }
+    if (wait_ms < 1) wait_ms = 1;
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += wait_ms / 1000;
+    deadline.tv_nsec += (wait_ms % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000;
+    }
+    pthread_cond_timedwait(&taken, &mutex, &deadline);
+  }
+
+  return NULL;
+}
+
+static int ring_point_compare(const void *a, const void *b) {
+  unsigned int first = ((struct upstream_ring_point *) a)->hash;
+  unsigned int second = ((struct upstream_ring_point *) b)->hash;
+  return first < second ? -1 : first > second;
+}
+
+static void upstream_build_ring() {
+  num_ring_points = num_upstreams * UPSTREAM_RING_POINTS;
+  ring = malloc(sizeof(struct upstream_ring_point) * num_ring_points);
+  if (ring == NULL) {
+    perror("Failed to allocate upstream hash ring");
+    exit(errno);
+  }
+
+  int i, point = 0;
+  for (i = 0; i < num_upstreams; i++) {
+    int j;
+    for (j = 0; j < UPSTREAM_RING_POINTS; j++) {
+      char name[300];
+      int length = snprintf(name, sizeof(name), "%s:%d#%d", upstream_list[i]->hostname,
+          upstream_list[i]->port, j);
+      if (length >= (int) sizeof(name)) length = sizeof(name) - 1;
+      ring[point].hash = hash_bytes(name, length);
+      ring[point].upstream = upstream_list[i];
+      point++;
+    }
+  }
+  qsort(ring, num_ring_points, sizeof(struct upstream_ring_point), ring_point_compare);
+}
+
+void upstream_add(char *hostname, int port) {
+  upstream_t *upstream = calloc(1, sizeof(upstream_t));
+  if (upstream == NULL) {
+    perror("Failed to allocate upstream");
+    exit(errno);
+  }
+  upstream->hostname = hostname;
+  upstream->port = port;
+
+  /* Keep the order of the command line. */
+  upstream_t **last = &upstreams;
+  while (*last != NULL) last = &(*last)->next;
+  *last = upstream;
+  num_upstreams++;
+}
+
+void upstream_init(int balance, long dns_ttl_ms, int pool_size, long max_latency_ms,
+    long eject_ms) {
+  upstream_balance = balance;
+  upstream_dns_ttl_ms = dns_ttl_ms;
+  upstream_pool_size = pool_size;
+  upstream_max_latency_ms = max_latency_ms;
+  upstream_eject_ms = eject_ms;
+
+  upstream_list = malloc(sizeof(upstream_t *) * num_upstreams);
+  if (upstream_list == NULL) {
+    perror("Failed to allocate upstreams");
+    exit(errno);
+  }
+
+  int i = 0;
+  upstream_t *upstream;
+  for (upstream = upstreams; upstream != NULL; upstream = upstream->next) {
+    upstream->address.sin_family = AF_INET;
+    upstream->address.sin_port = htons(upstream->port);
+    if (upstream_resolve(upstream, &upstream->address.sin_addr) == -1) {
+      fprintf(stderr, "Cannot find host: %s\n", upstream->hostname);
+      exit(ENXIO);
+    }
+    upstream->resolved_ms = now_ms();
+
+    upstream->idle = malloc(sizeof(struct upstream_idle) * (pool_size > 0 ? pool_size : 1));
+    upstream->refill = pool_size;
+    if (upstream->idle == NULL) {
+      perror("Failed to allocate upstream pool");
+      exit(errno);
+    }
+    upstream_list[i++] = upstream;
+  }
+  if (balance == UPSTREAM_BALANCE_HASH) upstream_build_ring();
+
+  pthread_condattr_t attributes;
+  pthread_condattr_init(&attributes);
+  pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC);
+  pthread_cond_init(&taken, &attributes);
+  pthread_condattr_destroy(&attributes);
+
+  pthread_t thread;
+  pthread_create(&thread, NULL, upstream_refresh_loop, NULL);
+}
+
+int upstream_count() {
+  return num_upstreams;
+}
+
+/* The first healthy backend on the ring at or after the hash of PATH. */
+static upstream_t *upstream_choose_hash(char *path, size_t path_length, long now) {
+  unsigned int hash = path != NULL ? hash_bytes(path, path_length) : 0;
+  int low = 0, high = num_ring_points;
+  while (low < high) {
+    int middle = low + (high - low) / 2;
+    if (ring[middle].hash < hash) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+
+  int i;
+  for (i = 0; i < num_ring_points; i++) {
+    upstream_t *upstream = ring[(low + i) % num_ring_points].upstream;
+    if (upstream_healthy(upstream, now)) return upstream;
+  }
+  return ring[low % num_ring_points].upstream;
+}
+
+upstream_t *upstream_choose(char *path, size_t path_length) {
+  long now = now_ms();
+  upstream_t *chosen = NULL;
+
+  if (upstream_balance == UPSTREAM_BALANCE_HASH) {
+    chosen = upstream_choose_hash(path, path_length, now);
+  } else if (upstream_balance == UPSTREAM_BALANCE_ROUND_ROBIN) {
+    /* Ejected backends use up their turn, so that the next healthy one does
+     * not get theirs on top of its own. */
+    int i;
+    for (i = 0; i < num_upstreams && chosen == NULL; i++) {
+      upstream_t *upstream = upstream_list[__atomic_fetch_add(&next_upstream, 1,
+          __ATOMIC_RELAXED) % num_upstreams];
+      if (upstream_healthy(upstream, now)) chosen = upstream;
+    }
+  } else {
+    /* Least connections, ties broken round-robin. */
+    unsigned int start = __atomic_fetch_add(&next_upstream, 1, __ATOMIC_RELAXED);
+    int chosen_active = 0;
+    int i;
+    for (i = 0; i < num_upstreams; i++) {
+      upstream_t *upstream = upstream_list[(start + i) % num_upstreams];
+      if (!upstream_healthy(upstream, now)) continue;
+      int active = __atomic_load_n(&upstream->active, __ATOMIC_RELAXED);
+      if (chosen == NULL || active < chosen_active) {
+        chosen = upstream;
+        chosen_active = active;
+      }
+    }
+  }
+  /* With every backend ejected, keep trying them rather than fail outright. */
+  if (chosen == NULL)
+    chosen = upstream_list[__atomic_fetch_add(&next_upstream, 1, __ATOMIC_RELAXED)
+        % num_upstreams];
+
+  __atomic_add_fetch(&chosen->active, 1, __ATOMIC_RELAXED);
+  return chosen;
+}
+
+void upstream_release(upstream_t *upstream) {
+  __atomic_sub_fetch(&upstream->active, 1, __ATOMIC_RELAXED);
+}
+
+void upstream_address(upstream_t *upstream, struct sockaddr_in *address) {
+  pthread_mutex_lock(&mutex);
+  *address = upstream->address;
+  pthread_mutex_unlock(&mutex);
+}
+
+int upstream_take(upstream_t *upstream) {
+  int fd = -1;
+  long now = now_ms();
+
+  pthread_mutex_lock(&mutex);
+  while (fd == -1 && upstream->num_idle > 0) {
+    struct upstream_idle *candidate = &upstream->idle[--upstream->num_idle];
+    if (upstream_idle_usable(candidate, now)) {
+      fd = candidate->fd;
+    } else {
+      close(candidate->fd);
+    }
+  }
+  /* Demand, met or not, is what the pool is topped up to. */
+  if (upstream->refill < upstream_pool_size) upstream->refill++;
+  upstream->taken_ms = now;
+  pthread_cond_signal(&taken);
+  pthread_mutex_unlock(&mutex);
+
+  return fd;
+}
+
+upstream_t *upstream_connect(char *path, size_t path_length, int *fd) {
+  int attempts;
+  for (attempts = 0; attempts < num_upstreams; attempts++) {
+    upstream_t *upstream = upstream_choose(path, path_length);
+    *fd = upstream_take(upstream);
+    if (*fd != -1) return upstream;
+
+    struct sockaddr_in address;
+    upstream_address(upstream, &address);
+    *fd = upstream_open(&address);
+    if (*fd != -1) return upstream;
+
+    upstream_report_failure(upstream);
+    upstream_release(upstream);
+  }
+  return NULL;
+}
+
+void upstream_report_failure(upstream_t *upstream) {
+  upstream_eject(upstream, "connect failed");
+}
+
+void upstream_report_latency(upstream_t *upstream, long latency_ms) {
+  /* An exponentially weighted moving average with weight 1/8, as in TCP's
+   * SRTT. It starts from 0 after every (re)admission, so a single outlier
+   * ejects a backend only if it is far over the threshold. Concurrent
+   * reports may lose an update, which the average shrugs off. */
+  long average = __atomic_load_n(&upstream->latency_ms, __ATOMIC_RELAXED);
+  average += (latency_ms - average) / 8;
+  __atomic_store_n(&upstream->latency_ms, average, __ATOMIC_RELAXED);
+  if (average > upstream_max_latency_ms) upstream_eject(upstream, "too slow");
+}
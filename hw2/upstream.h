@@ -0,0 +1,80 @@
+#ifndef __UPSTREAM__
+#define __UPSTREAM__
+
+#include <netinet/in.h>
+
+/* UPSTREAM knows the proxy's backends, picks one per proxied connection and
+ * keeps connections to them ready.
+ *
+ * Backends are resolved with getaddrinfo (gethostbyname2 is not thread-safe)
+ * and their addresses are cached; a background thread re-resolves them
+ * whenever the TTL runs out, so no request waits on DNS, and a failed
+ * refresh keeps the last good address. The same thread keeps a pool of
+ * established, idle connections to every backend, so a proxied request
+ * starts without a handshake. The pool follows demand: every connection
+ * taken from it (or asked for when it was empty) is replaced, up to the pool
+ * size, and a second without takers shrinks it to UPSTREAM_POOL_FLOOR. Idle
+ * connections are kept until the backend closes them or
+ * UPSTREAM_MAX_IDLE_MS passes, rather than recycled on a timer, so an idle
+ * proxy does not churn through connections to its backends.
+ *
+ * A backend that refuses a connection, or whose smoothed time to first
+ * response byte exceeds the latency threshold, is ejected: it is not chosen
+ * again until the ejection period is over, unless every backend is ejected.
+ *
+ * Pooled connections are handed out once and never returned: the relays
+ * tunnel raw bytes without tracking where a response ends, so a connection
+ * that has served one client cannot safely be given to the next. For the
+ * same reason the backend is chosen once per client connection, not once per
+ * request on it. */
+
+#define UPSTREAM_DEFAULT_DNS_TTL_MS 30000
+#define UPSTREAM_DEFAULT_POOL_SIZE 8
+#define UPSTREAM_MAX_IDLE_MS 60000
+#define UPSTREAM_POOL_FLOOR 1
+#define UPSTREAM_DEFAULT_MAX_LATENCY_MS 1000
+#define UPSTREAM_DEFAULT_EJECT_MS 10000
+#define UPSTREAM_CONNECT_TIMEOUT_MS 3000
+
+#define UPSTREAM_BALANCE_ROUND_ROBIN 0
+#define UPSTREAM_BALANCE_LEAST_CONNECTIONS 1
+#define UPSTREAM_BALANCE_HASH 2   /* Consistent hashing on the request path. */
+
+typedef struct upstream upstream_t;
+
+/* Adds the backend HOSTNAME:PORT. Must be called before upstream_init. */
+void upstream_add(char *hostname, int port);
+
+/* Resolves every backend (exiting if one cannot be found) and starts the
+ * thread that refreshes addresses and keeps POOL_SIZE connections open to
+ * each backend. */
+void upstream_init(int balance, long dns_ttl_ms, int pool_size, long max_latency_ms,
+    long eject_ms);
+
+int upstream_count();
+
+/* Picks a backend for a new client connection that asked for PATH (NULL if
+ * unknown) and counts it as active until upstream_release. */
+upstream_t *upstream_choose(char *path, size_t path_length);
+void upstream_release(upstream_t *upstream);
+
+/* Copies the cached address of UPSTREAM into ADDRESS. */
+void upstream_address(upstream_t *upstream, struct sockaddr_in *address);
+
+/* Returns a connected, non-blocking socket to UPSTREAM from the pool, or -1
+ * if the pool has none left. */
+int upstream_take(upstream_t *upstream);
+
+/* Chooses a backend for PATH and returns a connected, non-blocking socket to
+ * it in *FD, from the pool if possible and otherwise with a connect that
+ * gives up after UPSTREAM_CONNECT_TIMEOUT_MS. Backends that refuse or time
+ * out are ejected and the next one is tried. Returns NULL if none could be
+ * reached. */
+upstream_t *upstream_connect(char *path, size_t path_length, int *fd);
+
+/* Outcome reports from the relays: UPSTREAM refused a connection, or took
+ * LATENCY_MS to start answering a request. */
+void upstream_report_failure(upstream_t *upstream);
+void upstream_report_latency(upstream_t *upstream, long latency_ms);
+
+#endif
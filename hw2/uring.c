@@ -0,0 +1,668 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "access_log.h"
+#include "admission.h"
+#include "affinity.h"
+#include "metrics.h"
+#include "timer_wheel.h"
+#include "uring.h"
+
+/* What a completion is for, kept in the low bits of its user_data next to
+ * the connection it belongs to (NULL for the accept and the tick timer). */
+enum uring_op {
+  URING_OP_ACCEPT,
+  URING_OP_TICK,            /* Time to advance the timer wheel. */
+  URING_OP_READ,
+  URING_OP_SEND,
+  URING_OP_SPLICE_IN,       /* File -> pipe. */
+  URING_OP_SPLICE_OUT,      /* Pipe -> socket. */
+};
+#define URING_OP_MASK 7
+
+/* A connection has exactly one operation in flight at any time, so it is
+ * only ever closed from the completion of that operation. */
+struct uring_connection {
+  int fd;
+  int writing;              /* Sending a response, as opposed to reading. */
+  int peer_closed;          /* The client shut down its sending side. */
+  int expired;              /* Past its deadline and shut down already. */
+  int requests_served;
+  int idle;                 /* Waiting for the next request to start. */
+  struct timer timer;
+
+  struct http_request_buffer *request_buffer;   /* In the registered arena. */
+  struct http_request request;
+
+  char header_buffer[LIBHTTP_HEADER_MAX_SIZE];
+  char *header;             /* Either header_buffer or a pre-rendered header. */
+  size_t header_length;
+  size_t header_sent;
+
+  struct http_response response;
+  size_t body_sent;
+  char *chunk;              /* Produced bodies, LIBHTTP_CHUNK_SIZE at a time. */
+  size_t chunk_length;
+  size_t chunk_sent;
+  size_t bytes_sent;        /* Of the current response, headers included. */
+  int pipe[2];              /* For file bodies; opened on first use. */
+  size_t pipe_size;
+  size_t piped;             /* Bytes waiting in the pipe. */
+
+  /* Read by the kernel until a SENDMSG completes. */
+  struct iovec iov[2];
+  struct msghdr message;
+
+  struct sockaddr_in peer;
+  int logging;              /* LOG_ENTRY is to be completed with the response. */
+  struct access_log_entry log_entry;
+
+  struct uring_connection *next_free;
+};
+
+struct uring {
+  int fd;
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  unsigned sq_entries;
+  unsigned sq_queued;       /* Prepared, not yet submitted. */
+  struct io_uring_sqe *sqes;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_cqe *cqes;
+
+  int server_socket;
+  int multishot;            /* Multishot accept works (Linux 5.19). */
+  int fixed_buffers;        /* The request buffers could be registered. */
+  reactor_handler_t handler;
+  struct http_request_buffer *buffers;
+  struct uring_connection *connections;
+  struct uring_connection *free_connections;
+  struct __kernel_timespec tick_interval;
+  struct timer_wheel wheel;
+};
+
+static void uring_fatal_error(char *message) {
+  perror(message);
+  exit(errno);
+}
+
+static long now_ms() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+  return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static int io_uring_setup(unsigned entries, struct io_uring_params *params) {
+  return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+  return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int io_uring_register(int fd, unsigned opcode, void *args, unsigned num_args) {
+  return syscall(__NR_io_uring_register, fd, opcode, args, num_args);
+}
+
+/* Creates a ring of ENTRIES submission and CQ_ENTRIES completion entries
+ * and maps its queues. Returns -1 (with errno set) on failure. */
+static int uring_setup(struct uring *ring, unsigned entries, unsigned cq_entries) {
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  params.flags = IORING_SETUP_CQSIZE;
+  params.cq_entries = cq_entries;
+  ring->fd = io_uring_setup(entries, &params);
+  if (ring->fd == -1) return -1;
+
+  size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  int single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+  if (single_mmap && cq_size > sq_size) sq_size = cq_size;
+
+  char *sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+      ring->fd, IORING_OFF_SQ_RING);
+  char *cq = single_mmap ? sq : mmap(NULL, cq_size, PROT_READ | PROT_WRITE,
+      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+  ring->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe),
+      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (sq == MAP_FAILED || cq == MAP_FAILED || ring->sqes == MAP_FAILED) {
+    close(ring->fd);
+    return -1;
+  }
+
+  ring->sq_head = (unsigned *) (sq + params.sq_off.head);
+  ring->sq_tail = (unsigned *) (sq + params.sq_off.tail);
+  ring->sq_mask = (unsigned *) (sq + params.sq_off.ring_mask);
+  ring->sq_array = (unsigned *) (sq + params.sq_off.array);
+  ring->sq_entries = params.sq_entries;
+  ring->sq_queued = 0;
+  ring->cq_head = (unsigned *) (cq + params.cq_off.head);
+  ring->cq_tail = (unsigned *) (cq + params.cq_off.tail);
+  ring->cq_mask = (unsigned *) (cq + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+  return 0;
+}
+
+/* Submits what has been prepared and waits for at least MIN_COMPLETE
+ * completions. */
+static void uring_submit(struct uring *ring, unsigned min_complete) {
+  while (1) {
+    int submitted = io_uring_enter(ring->fd, ring->sq_queued, min_complete,
+        min_complete > 0 ? IORING_ENTER_GETEVENTS : 0);
+    if (submitted >= 0) {
+      ring->sq_queued -= submitted;
+      return;
+    }
+    if (errno != EINTR) uring_fatal_error("Failed to submit to io_uring");
+  }
+}
+
+/* A cleared submission entry, queued for the next uring_submit. */
+static struct io_uring_sqe *uring_get_sqe(struct uring *ring) {
+  unsigned tail = *ring->sq_tail;
+  if (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) == ring->sq_entries)
+    uring_submit(ring, 0);
+
+  unsigned index = tail & *ring->sq_mask;
+  struct io_uring_sqe *sqe = &ring->sqes[index];
+  memset(sqe, 0, sizeof(struct io_uring_sqe));
+  ring->sq_array[index] = index;
+  __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  ring->sq_queued++;
+  return sqe;
+}
+
+static struct io_uring_sqe *uring_prepare(struct uring *ring, int opcode, int fd,
+    struct uring_connection *connection, enum uring_op op) {
+  struct io_uring_sqe *sqe = uring_get_sqe(ring);
+  sqe->opcode = opcode;
+  sqe->fd = fd;
+  sqe->user_data = (uintptr_t) connection | op;
+  return sqe;
+}
+
+static void uring_post_accept(struct uring *ring) {
+  struct io_uring_sqe *sqe = uring_prepare(ring, IORING_OP_ACCEPT, ring->server_socket,
+      NULL, URING_OP_ACCEPT);
+  sqe->accept_flags = SOCK_CLOEXEC;
+  if (ring->multishot) sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+}
+
+static void uring_post_tick(struct uring *ring) {
+  struct io_uring_sqe *sqe = uring_prepare(ring, IORING_OP_TIMEOUT, -1, NULL, URING_OP_TICK);
+  sqe->addr = (uintptr_t) &ring->tick_interval;
+  sqe->len = 1;
+}
+
+static void connection_post_read(struct uring *ring, struct uring_connection *connection) {
+  struct http_request_buffer *buffer = connection->request_buffer;
+  struct io_uring_sqe *sqe = uring_prepare(ring,
+      ring->fixed_buffers ? IORING_OP_READ_FIXED : IORING_OP_READ, connection->fd,
+      connection, URING_OP_READ);
+  sqe->addr = (uintptr_t) (buffer->data + buffer->length);
+  sqe->len = LIBHTTP_REQUEST_MAX_SIZE - buffer->length;
+  sqe->buf_index = 0;
+}
+
+static void connection_post_send(struct uring *ring, struct uring_connection *connection,
+    char *data, size_t length, int flags) {
+  struct io_uring_sqe *sqe = uring_prepare(ring, IORING_OP_SEND, connection->fd, connection,
+      URING_OP_SEND);
+  sqe->addr = (uintptr_t) data;
+  sqe->len = length;
+  sqe->msg_flags = MSG_NOSIGNAL | flags;
+}
+
+static void connection_post_splice(struct uring *ring, struct uring_connection *connection,
+    int from, off_t from_offset, int to, size_t length, enum uring_op op) {
+  struct io_uring_sqe *sqe = uring_prepare(ring, IORING_OP_SPLICE, to, connection, op);
+  sqe->splice_fd_in = from;
+  sqe->splice_off_in = from_offset;
+  sqe->off = -1;
+  sqe->len = length;
+  sqe->splice_flags = SPLICE_F_MOVE;
+}
+
+static void connection_close(struct uring *ring, struct uring_connection *connection) {
+  close(connection->fd);
+  if (connection->pipe[0] != -1) {
+    close(connection->pipe[0]);
+    close(connection->pipe[1]);
+  }
+  http_response_free(&connection->response);
+  free(connection->chunk);
+  timer_cancel(&connection->timer);
+  connection->fd = -1;
+  connection->next_free = ring->free_connections;
+  ring->free_connections = connection;
+}
+
+/* Connections are only closed from a completion: shutting the socket down
+ * ends the operation in flight, which then closes it. */
+static void connection_expire(void *data) {
+  struct uring_connection *connection = data;
+  metrics_count(METRICS_TIMEOUTS, 1);
+  shutdown(connection->fd, SHUT_RDWR);
+  connection->expired = 1;
+}
+
+/* Gives CONNECTION TIMEOUT_MS from now for what it waits for next. */
+static void connection_deadline(struct uring *ring, struct uring_connection *connection,
+    long timeout_ms) {
+  if (!connection->expired) timer_arm(&ring->wheel, &connection->timer, now_ms() + timeout_ms);
+}
+
+/* Queues the next operation for the pending response. Returns 1 when the
+ * response is fully sent, 0 when an operation was queued and -1 on error. */
+static int connection_flush(struct uring *ring, struct uring_connection *connection) {
+  struct http_response *response = &connection->response;
+
+  /* As in the reactor, an in-memory body leaves with the header, and any
+   * other header is sent with MSG_MORE. */
+  if (connection->header_sent < connection->header_length) {
+    char *header = connection->header + connection->header_sent;
+    size_t header_left = connection->header_length - connection->header_sent;
+    if (response->body_fd == -1 && response->produce == NULL) {
+      connection->iov[0].iov_base = header;
+      connection->iov[0].iov_len = header_left;
+      connection->iov[1].iov_base = response->body + response->body_offset;
+      connection->iov[1].iov_len = response->body_length;
+      memset(&connection->message, 0, sizeof(connection->message));
+      connection->message.msg_iov = connection->iov;
+      connection->message.msg_iovlen = 2;
+      struct io_uring_sqe *sqe = uring_prepare(ring, IORING_OP_SENDMSG, connection->fd,
+          connection, URING_OP_SEND);
+      sqe->addr = (uintptr_t) &connection->message;
+      sqe->msg_flags = MSG_NOSIGNAL;
+    } else {
+      int more = response->body_length > 0 || response->produce != NULL ? MSG_MORE : 0;
+      connection_post_send(ring, connection, header, header_left, more);
+    }
+    return 0;
+  }
+
+  if (connection->body_sent < response->body_length) {
+    size_t body_left = response->body_length - connection->body_sent;
+    if (response->body_fd == -1) {
+      connection_post_send(ring, connection,
+          response->body + response->body_offset + connection->body_sent, body_left, 0);
+    } else if (connection->piped > 0) {
+      connection_post_splice(ring, connection, connection->pipe[0], -1, connection->fd,
+          connection->piped, URING_OP_SPLICE_OUT);
+    } else {
+      if (connection->pipe[0] == -1) {
+        if (pipe2(connection->pipe, O_CLOEXEC) == -1) {
+          connection->pipe[0] = -1;
+          return -1;
+        }
+        /* Fewer, larger splices; the default 64KB if the limit is lower. */
+        int pipe_size = fcntl(connection->pipe[1], F_SETPIPE_SZ, URING_PIPE_SIZE);
+        if (pipe_size == -1) pipe_size = fcntl(connection->pipe[1], F_GETPIPE_SZ);
+        connection->pipe_size = pipe_size > 0 ? pipe_size : 65536;
+      }
+      connection_post_splice(ring, connection, response->body_fd,
+          response->body_offset + connection->body_sent, connection->pipe[1],
+          body_left < connection->pipe_size ? body_left : connection->pipe_size,
+          URING_OP_SPLICE_IN);
+    }
+    return 0;
+  }
+
+  if (response->produce != NULL) {
+    if (connection->chunk_sent == connection->chunk_length) {
+      if (connection->chunk == NULL
+          && (connection->chunk = malloc(LIBHTTP_CHUNK_SIZE)) == NULL) return -1;
+      connection->chunk_length = http_response_next_chunk(response, connection->chunk,
+          LIBHTTP_CHUNK_SIZE);
+      connection->chunk_sent = 0;
+      if (connection->chunk_length == 0) return 1;
+    }
+    connection_post_send(ring, connection, connection->chunk + connection->chunk_sent,
+        connection->chunk_length - connection->chunk_sent, 0);
+    return 0;
+  }
+
+  return 1;
+}
+
+static void connection_process(struct uring *ring, struct uring_connection *connection);
+
+/* Called once a response is fully sent. */
+static void connection_finish_response(struct uring *ring,
+    struct uring_connection *connection) {
+  if (connection->logging)
+    access_log_finish(&connection->log_entry, connection->response.status_code,
+        connection->bytes_sent);
+  if (!connection->response.keep_alive) {
+    connection_close(ring, connection);
+    return;
+  }
+
+  http_response_free(&connection->response);
+  connection->header_sent = connection->header_length = 0;
+  connection->body_sent = connection->bytes_sent = 0;
+  connection->chunk_length = connection->chunk_sent = 0;
+  connection->writing = 0;
+  /* Pipelined bytes are the start of the next request head. */
+  connection->idle = connection->request_buffer->length == 0;
+  connection_deadline(ring, connection, connection->idle
+      ? http_keep_alive_timeout_ms : http_header_timeout_ms);
+  connection_process(ring, connection);
+}
+
+static void connection_continue(struct uring *ring, struct uring_connection *connection) {
+  int flushed = connection_flush(ring, connection);
+  if (flushed < 0) {
+    connection_close(ring, connection);
+  } else if (flushed > 0) {
+    connection_finish_response(ring, connection);
+  }
+}
+
+/* Builds the response for the parsed request (STATUS is HTTP_PARSE_COMPLETE
+ * or HTTP_PARSE_ERROR) and starts sending it. */
+static void connection_respond(struct uring *ring, struct uring_connection *connection,
+    enum http_parse_status status) {
+  struct http_request *request = &connection->request;
+  if (status == HTTP_PARSE_COMPLETE
+      && ++connection->requests_served >= http_keep_alive_max_requests)
+    request->keep_alive = 0;
+  int parsed = status == HTTP_PARSE_COMPLETE;
+  connection->logging = access_log_start(&connection->log_entry, &connection->peer,
+      parsed ? &request->method : NULL, parsed ? &request->path : NULL);
+  /* The first request was paid for when the connection was admitted. */
+  if (!parsed || connection->requests_served == 1
+      || admission_allow_request(&connection->peer, &connection->response))
+    ring->handler(parsed ? request : NULL, &connection->response);
+  http_request_consume(connection->request_buffer, request);
+
+  if (connection->response.header != NULL) {
+    connection->header = connection->response.header;
+    connection->header_length = connection->response.header_length;
+  } else {
+    int header_length = http_format_headers(&connection->response,
+        connection->header_buffer, sizeof(connection->header_buffer));
+    if (header_length < 0) {
+      connection_close(ring, connection);
+      return;
+    }
+    connection->header = connection->header_buffer;
+    connection->header_length = header_length;
+  }
+  connection->writing = 1;
+  connection_deadline(ring, connection, http_body_timeout_ms);
+  connection_continue(ring, connection);
+}
+
+/* Answers the next complete request in the buffer, or reads more. */
+static void connection_process(struct uring *ring, struct uring_connection *connection) {
+  struct http_request_buffer *buffer = connection->request_buffer;
+  enum http_parse_status status = http_request_parse_more(&connection->request,
+      buffer->data, buffer->length);
+  if (status == HTTP_PARSE_NEED_MORE) {
+    if (buffer->length == LIBHTTP_REQUEST_MAX_SIZE) {
+      status = HTTP_PARSE_ERROR;
+    } else if (connection->peer_closed && buffer->length > 0) {
+      /* Answer whatever the client sent before hanging up. */
+      status = http_request_parse_finish(&connection->request, buffer->data, buffer->length);
+    } else if (connection->peer_closed) {
+      connection_close(ring, connection);
+      return;
+    } else {
+      connection_post_read(ring, connection);
+      return;
+    }
+  }
+  connection_respond(ring, connection, status);
+}
+
+static void uring_open_connection(struct uring *ring, int fd) {
+  struct sockaddr_in peer;
+  socklen_t peer_length = sizeof(peer);
+  memset(&peer, 0, sizeof(peer));
+  if (access_log_enabled() || admission_enabled())
+    getpeername(fd, (struct sockaddr *) &peer, &peer_length);
+  if (!admission_allow(&peer)) {
+    metrics_count(METRICS_CONNECTIONS, 1);
+    admission_reject(fd, 429);
+    return;
+  }
+
+  struct uring_connection *connection = ring->free_connections;
+  if (connection == NULL) {
+    close(fd);
+    return;
+  }
+  ring->free_connections = connection->next_free;
+  metrics_count(METRICS_CONNECTIONS, 1);
+
+  struct http_request_buffer *buffer = connection->request_buffer;
+  memset(connection, 0, sizeof(struct uring_connection));
+  connection->fd = fd;
+  connection->pipe[0] = connection->pipe[1] = -1;
+  connection->request_buffer = buffer;
+  connection->request_buffer->length = 0;
+  http_request_init(&connection->request);
+  /* A new client gets as long for its first request as for any head. */
+  timer_init(&connection->timer, connection_expire, connection);
+  connection_deadline(ring, connection, http_header_timeout_ms);
+  connection->peer = peer;
+  connection_post_read(ring, connection);
+}
+
+static void uring_complete(struct uring *ring, uint64_t user_data, int result,
+    unsigned flags) {
+  struct uring_connection *connection = (struct uring_connection *) (uintptr_t)
+      (user_data & ~(uint64_t) URING_OP_MASK);
+  enum uring_op op = user_data & URING_OP_MASK;
+
+  switch (op) {
+    case URING_OP_ACCEPT:
+      if (result == -EINVAL && ring->multishot) {
+        /* Older kernel: accept one connection at a time. */
+        ring->multishot = 0;
+      } else if (result >= 0) {
+        uring_open_connection(ring, result);
+      } else if (result != -EAGAIN && result != -EINTR && result != -ECONNABORTED) {
+        errno = -result;
+        perror("Error accepting socket");
+      }
+      if (!(flags & IORING_CQE_F_MORE)) uring_post_accept(ring);
+      return;
+
+    case URING_OP_TICK:
+      timer_wheel_advance(&ring->wheel, now_ms());
+      uring_post_tick(ring);
+      return;
+
+    case URING_OP_READ:
+      if (result < 0 || connection->expired) {
+        connection_close(ring, connection);
+        return;
+      }
+      if (result == 0) {
+        connection->peer_closed = 1;
+      } else {
+        connection->request_buffer->length += result;
+        if (connection->idle) {
+          connection->idle = 0;
+          connection_deadline(ring, connection, http_header_timeout_ms);
+        }
+      }
+      connection_process(ring, connection);
+      return;
+
+    case URING_OP_SEND:
+    case URING_OP_SPLICE_OUT:
+      if (result <= 0) {
+        connection_close(ring, connection);
+        return;
+      }
+      metrics_count(METRICS_BYTES_SENT, result);
+      connection->bytes_sent += result;
+      connection_deadline(ring, connection, http_body_timeout_ms);
+      if (op == URING_OP_SPLICE_OUT) {
+        connection->piped -= result;
+        connection->body_sent += result;
+      } else if (connection->header_sent < connection->header_length) {
+        size_t header_left = connection->header_length - connection->header_sent;
+        if ((size_t) result > header_left) {
+          connection->body_sent += result - header_left;
+          result = header_left;
+        }
+        connection->header_sent += result;
+      } else if (connection->body_sent < connection->response.body_length) {
+        connection->body_sent += result;
+      } else {
+        connection->chunk_sent += result;
+      }
+      connection_continue(ring, connection);
+      return;
+
+    case URING_OP_SPLICE_IN:
+      /* Nothing at all means the file shrank under us. */
+      if (result <= 0) {
+        connection_close(ring, connection);
+        return;
+      }
+      connection->piped = result;
+      connection_continue(ring, connection);
+      return;
+  }
+}
+
+static void *uring_loop(void *args) {
+  struct uring *ring = args;
+  uring_post_accept(ring);
+  uring_post_tick(ring);
+
+  while (1) {
+    uring_submit(ring, 1);
+
+    unsigned head = *ring->cq_head;
+    unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+      struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+      uint64_t user_data = cqe->user_data;
+      int result = cqe->res;
+      unsigned flags = cqe->flags;
+      __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+      uring_complete(ring, user_data, result, flags);
+    }
+  }
+
+  return NULL;
+}
+
+static struct uring *uring_create(int server_socket, reactor_handler_t handler) {
+  struct uring *ring = calloc(1, sizeof(struct uring));
+  if (ring == NULL) uring_fatal_error("Failed to allocate io_uring");
+  if (uring_setup(ring, URING_ENTRIES, 2 * URING_MAX_CONNECTIONS) == -1)
+    uring_fatal_error("Failed to set up io_uring");
+
+  ring->server_socket = server_socket;
+  ring->multishot = 1;
+  ring->handler = handler;
+  ring->tick_interval.tv_sec = URING_TICK_MS / 1000;
+  ring->tick_interval.tv_nsec = (URING_TICK_MS % 1000) * 1000000L;
+  timer_wheel_init(&ring->wheel, now_ms());
+
+  size_t buffers_size = sizeof(struct http_request_buffer) * URING_MAX_CONNECTIONS;
+  ring->buffers = mmap(NULL, buffers_size, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  ring->connections = calloc(URING_MAX_CONNECTIONS, sizeof(struct uring_connection));
+  if (ring->buffers == MAP_FAILED || ring->connections == NULL)
+    uring_fatal_error("Failed to allocate io_uring connections");
+
+  /* Registration pins the buffers; without it (RLIMIT_MEMLOCK on older
+   * kernels) requests are read with plain READs. */
+  struct iovec buffers = { ring->buffers, buffers_size };
+  ring->fixed_buffers = io_uring_register(ring->fd, IORING_REGISTER_BUFFERS, &buffers, 1) == 0;
+
+  int i;
+  for (i = URING_MAX_CONNECTIONS - 1; i >= 0; i--) {
+    struct uring_connection *connection = &ring->connections[i];
+    connection->fd = -1;
+    connection->request_buffer = &ring->buffers[i];
+    connection->next_free = ring->free_connections;
+    ring->free_connections = connection;
+  }
+  return ring;
+}
+
+int uring_available() {
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  int fd = io_uring_setup(4, &params);
+  if (fd == -1) return 0;
+
+  static int needed[] = {
+    IORING_OP_ACCEPT, IORING_OP_TIMEOUT, IORING_OP_READ_FIXED, IORING_OP_READ,
+    IORING_OP_SEND, IORING_OP_SENDMSG, IORING_OP_SPLICE,
+  };
+  size_t probe_size = sizeof(struct io_uring_probe)
+      + IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+  struct io_uring_probe *probe = calloc(1, probe_size);
+  int available = probe != NULL
+      && io_uring_register(fd, IORING_REGISTER_PROBE, probe, IORING_OP_LAST) == 0;
+  size_t i;
+  for (i = 0; available && i < sizeof(needed) / sizeof(needed[0]); i++)
+    available = needed[i] <= probe->last_op
+        && (probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED);
+  free(probe);
+  close(fd);
+  return available;
+}
+
+/* What a uring thread is started with: it sets up its ring only once it is
+ * on its own CPUs, so that registering the buffers faults them in there. */
+struct uring_start {
+  int server_socket;
+  int index;
+  int count;
+  reactor_handler_t handler;
+};
+
+static void *uring_start(void *args) {
+  struct uring_start *start = args;
+  affinity_pin(start->index, start->count);
+  return uring_loop(uring_create(start->server_socket, start->handler));
+}
+
+void uring_serve_forever(int *server_sockets, int num_rings, reactor_handler_t handler) {
+  if (num_rings < 1) num_rings = 1;
+  struct uring_start *starts = malloc(sizeof(struct uring_start) * num_rings);
+  if (starts == NULL) uring_fatal_error("Failed to allocate io_uring threads");
+
+  int i;
+  for (i = 0; i < num_rings; i++) {
+    starts[i].server_socket = server_sockets[i];
+    starts[i].index = i;
+    starts[i].count = num_rings;
+    starts[i].handler = handler;
+  }
+
+  for (i = 1; i < num_rings; i++) {
+    pthread_t thread;
+    pthread_create(&thread, NULL, uring_start, &starts[i]);
+  }
+  uring_start(&starts[0]);
+}
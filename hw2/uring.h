@@ -0,0 +1,35 @@
+#ifndef __URING__
+#define __URING__
+
+#include "reactor.h"
+
+/* URING serves HTTP connections like the epoll reactor, with io_uring doing
+ * the I/O instead of non-blocking syscalls. Every uring thread owns a ring
+ * (set up with raw syscalls, no liburing) and a fixed table of connections:
+ *
+ *  - one multishot accept delivers all new connections of the thread;
+ *  - requests are read with READ_FIXED into buffers registered with the
+ *    ring once, so the kernel does not map them again on every read;
+ *  - responses go out with SEND / SENDMSG, file bodies are spliced from the
+ *    file to the socket through a per-connection pipe, also on the ring;
+ *  - everything prepared while handling a batch of completions is submitted
+ *    with the same io_uring_enter that waits for the next batch;
+ *  - a TIMEOUT completing every URING_TICK_MS advances the ring's timer
+ *    wheel, on which every connection has its deadline (see timer_wheel.h).
+ *
+ * A request thus costs no syscall of its own in the common case. */
+
+#define URING_ENTRIES 512
+#define URING_MAX_CONNECTIONS 1024    /* Per thread; more are turned away. */
+#define URING_PIPE_SIZE (1024 * 1024)
+#define URING_TICK_MS 100          /* How often the timer wheel is advanced. */
+
+/* Whether this kernel lets us create rings that support every operation the
+ * server needs (Linux 5.7 or later, not forbidden by a seccomp filter). */
+int uring_available();
+
+/* Runs NUM_RINGS uring threads, like reactor_serve_forever. uring_available
+ * must have returned 1. Never returns. */
+void uring_serve_forever(int *server_sockets, int num_rings, reactor_handler_t handler);
+
+#endif
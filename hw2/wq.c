@@ -1,46 +1,178 @@
+#include <errno.h>
+#include <linux/futex.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#include "metrics.h"
 #include "wq.h"
-#include "utlist.h"
+
+/* The ring follows Dmitry Vyukov's bounded MPMC queue: every cell carries a
+ * sequence number telling whether it is ready to be written (sequence ==
+ * position) or read (sequence == position + 1) for a given ring position. */
+
+static int futex_wait(int *address, int value, struct timespec *timeout) {
+  return syscall(SYS_futex, address, FUTEX_WAIT_PRIVATE, value, timeout, NULL, 0);
+}
+
+static void futex_wake(int *address, int count) {
+  syscall(SYS_futex, address, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+void wq_event_init(wq_event_t *event) {
+  event->sequence = 0;
+  event->waiters = 0;
+}
+
+/* Registers the caller as a waiter and returns the current sequence. The
+ * caller must re-check its condition afterwards and then either
+ * wq_event_cancel or wq_event_wait, so that a concurrent signal is never
+ * lost: it either sees the waiter or happened before the re-check. */
+int wq_event_prepare(wq_event_t *event) {
+  __atomic_add_fetch(&event->waiters, 1, __ATOMIC_SEQ_CST);
+  return __atomic_load_n(&event->sequence, __ATOMIC_SEQ_CST);
+}
+
+void wq_event_cancel(wq_event_t *event) {
+  __atomic_sub_fetch(&event->waiters, 1, __ATOMIC_SEQ_CST);
+}
+
+void wq_event_wait(wq_event_t *event, int sequence) {
+  futex_wait(&event->sequence, sequence, NULL);
+  __atomic_sub_fetch(&event->waiters, 1, __ATOMIC_SEQ_CST);
+}
+
+/* Like wq_event_wait, for at most TIMEOUT_MS. Returns 0 if that ran out
+ * without a signal. */
+int wq_event_wait_timeout(wq_event_t *event, int sequence, long timeout_ms) {
+  struct timespec timeout = { timeout_ms / 1000, (timeout_ms % 1000) * 1000000 };
+  int timed_out = futex_wait(&event->sequence, sequence, &timeout) == -1
+      && errno == ETIMEDOUT;
+  __atomic_sub_fetch(&event->waiters, 1, __ATOMIC_SEQ_CST);
+  return !timed_out;
+}
+
+/* Wakes one thread sleeping on EVENT, if any. The fence orders the caller's
+ * publishing store (a release store of a cell sequence, say) before the load
+ * of WAITERS; without it the load can be satisfied first, miss a waiter that
+ * has just registered, and leave it asleep on a queue that has work. */
+void wq_event_signal(wq_event_t *event) {
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&event->waiters, __ATOMIC_SEQ_CST) == 0) return;
+  __atomic_add_fetch(&event->sequence, 1, __ATOMIC_SEQ_CST);
+  futex_wake(&event->sequence, 1);
+}
+
+int wq_try_push(wq_t *wq, int client_socket_fd) {
+  size_t position = __atomic_load_n(&wq->push_position, __ATOMIC_RELAXED);
+  while (1) {
+    /* Below capacity the ring itself cannot tell, so the pop position has to
+     * be looked at (POSITION may be stale, hence the signed difference); at
+     * capacity, the cell sequence says it all. */
+    if (wq->high_water <= wq->mask
+        && (long) (position - __atomic_load_n(&wq->pop_position, __ATOMIC_RELAXED))
+            >= (long) wq->high_water)
+      return 0; /* At the high-water mark. */
+    wq_cell_t *cell = &wq->cells[position & wq->mask];
+    size_t sequence = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+    long difference = (long) sequence - (long) position;
+    if (difference == 0) {
+      if (__atomic_compare_exchange_n(&wq->push_position, &position, position + 1, 1,
+            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        cell->client_socket_fd = client_socket_fd;
+        cell->push_time_us = metrics_now_us();
+        __atomic_store_n(&cell->sequence, position + 1, __ATOMIC_RELEASE);
+        return 1;
+      }
+    } else if (difference < 0) {
+      return 0; /* Full. */
+    } else {
+      position = __atomic_load_n(&wq->push_position, __ATOMIC_RELAXED);
+    }
+  }
+}
+
+int wq_try_pop(wq_t *wq, int *client_socket_fd, long *push_time_us) {
+  size_t position = __atomic_load_n(&wq->pop_position, __ATOMIC_RELAXED);
+  while (1) {
+    wq_cell_t *cell = &wq->cells[position & wq->mask];
+    size_t sequence = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+    long difference = (long) sequence - (long) (position + 1);
+    if (difference == 0) {
+      if (__atomic_compare_exchange_n(&wq->pop_position, &position, position + 1, 1,
+            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        *client_socket_fd = cell->client_socket_fd;
+        if (push_time_us != NULL) *push_time_us = cell->push_time_us;
+        __atomic_store_n(&cell->sequence, position + wq->mask + 1, __ATOMIC_RELEASE);
+        return 1;
+      }
+    } else if (difference < 0) {
+      return 0; /* Empty. */
+    } else {
+      position = __atomic_load_n(&wq->pop_position, __ATOMIC_RELAXED);
+    }
+  }
+}
 
 /* Initializes a work queue WQ. */
 void wq_init(wq_t *wq) {
+  if (posix_memalign((void **) &wq->cells, WQ_CACHE_LINE,
+        sizeof(wq_cell_t) * WQ_CAPACITY) != 0) {
+    perror("Failed to allocate work queue");
+    exit(EXIT_FAILURE);
+  }
+  wq->mask = WQ_CAPACITY - 1;
+  wq->high_water = WQ_CAPACITY;
 
-  /* TODO: Make me thread-safe! */
-  pthread_mutex_init(&wq->mutex, NULL);
-  pthread_cond_init(&wq->con, NULL);
-  wq->size = 0;
-  wq->head = NULL;
+  size_t i;
+  for (i = 0; i < WQ_CAPACITY; i++)
+    wq->cells[i].sequence = i;
+  wq->push_position = wq->pop_position = 0;
+  wq_event_init(&wq->pop_event);
+  wq_event_init(&wq->push_event);
+}
+
+/* Caps the number of items WQ holds at HIGH_WATER (at least 1, at most
+ * WQ_CAPACITY). */
+void wq_set_high_water(wq_t *wq, size_t high_water) {
+  wq->high_water = high_water < 1 ? 1 : high_water > WQ_CAPACITY ? WQ_CAPACITY : high_water;
+}
+
+/* Number of queued items; only a snapshot under concurrent use. */
+size_t wq_size(wq_t *wq) {
+  size_t push_position = __atomic_load_n(&wq->push_position, __ATOMIC_RELAXED);
+  size_t pop_position = __atomic_load_n(&wq->pop_position, __ATOMIC_RELAXED);
+  return push_position > pop_position ? push_position - pop_position : 0;
 }
 
 /* Remove an item from the WQ. This function should block until there
  * is at least one item on the queue. */
 int wq_pop(wq_t *wq) {
-
-  /* TODO: Make me blocking and thread-safe! */
-
-  pthread_mutex_lock(&wq->mutex);
-  while (wq->size == 0) {
-    pthread_cond_wait(&wq->con, &wq->mutex);
+  int client_socket_fd;
+  while (!wq_try_pop(wq, &client_socket_fd, NULL)) {
+    int sequence = wq_event_prepare(&wq->pop_event);
+    if (wq_try_pop(wq, &client_socket_fd, NULL)) {
+      wq_event_cancel(&wq->pop_event);
+      break;
+    }
+    wq_event_wait(&wq->pop_event, sequence);
   }
-  wq_item_t *wq_item = wq->head;
-  int client_socket_fd = wq->head->client_socket_fd;
-  wq->size--;
-  DL_DELETE(wq->head, wq->head);
-  pthread_mutex_unlock(&wq->mutex);
 
-  free(wq_item);
+  wq_event_signal(&wq->push_event);
   return client_socket_fd;
 }
 
-/* Add ITEM to WQ. */
+/* Add ITEM to WQ. Blocks while the queue is full. */
 void wq_push(wq_t *wq, int client_socket_fd) {
+  while (!wq_try_push(wq, client_socket_fd)) {
+    int sequence = wq_event_prepare(&wq->push_event);
+    if (wq_try_push(wq, client_socket_fd)) {
+      wq_event_cancel(&wq->push_event);
+      break;
+    }
+    wq_event_wait(&wq->push_event, sequence);
+  }
 
-  /* TODO: Make me thread-safe! */
-  wq_item_t *wq_item = calloc(1, sizeof(wq_item_t));
-  pthread_mutex_lock(&wq->mutex);
-  wq_item->client_socket_fd = client_socket_fd;
-  DL_APPEND(wq->head, wq_item);
-  wq->size++;
-  pthread_cond_signal(&wq->con);
-  pthread_mutex_unlock(&wq->mutex);
+  wq_event_signal(&wq->pop_event);
 }
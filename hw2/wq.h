@@ -1,26 +1,67 @@
 #ifndef __WQ__
 #define __WQ__
 
-#include <pthread.h>
+#include <stddef.h>
 
 /* WQ defines a work queue which will be used to store accepted client sockets
- * waiting to be served. */
+ * waiting to be served.
+ *
+ * It is a bounded multi-producer / multi-consumer ring buffer. Pushes and pops
+ * claim a slot with a single compare-and-swap and never allocate or take a
+ * lock; threads only sleep (on a futex) when the queue is empty or full.
+ *
+ * A queue counts as full once it holds its high-water mark, WQ_CAPACITY
+ * unless lowered with wq_set_high_water: a short queue bounds how long its
+ * last item waits, so that an overloaded server can turn work away instead
+ * of letting every item wait for longer than it is worth. */
 
-typedef struct wq_item {
+#define WQ_CAPACITY 4096 /* Must be a power of two. */
+#define WQ_CACHE_LINE 64
+
+/* A futex-based event threads can sleep on until another thread signals it.
+ * Signalling is a no-op syscall-wise unless somebody is actually waiting. */
+typedef struct wq_event {
+  int sequence;
+  int waiters;
+} wq_event_t;
+
+void wq_event_init(wq_event_t *event);
+int wq_event_prepare(wq_event_t *event);
+void wq_event_cancel(wq_event_t *event);
+void wq_event_wait(wq_event_t *event, int sequence);
+int wq_event_wait_timeout(wq_event_t *event, int sequence, long timeout_ms);
+void wq_event_signal(wq_event_t *event);
+
+typedef struct wq_cell {
+  size_t sequence;     // Ring position this cell is ready for.
   int client_socket_fd; // Client socket to be served.
-  struct wq_item *next;
-  struct wq_item *prev;
-} wq_item_t;
+  long push_time_us;    // When it was pushed, on the metrics_now_us clock.
+} wq_cell_t;
 
 typedef struct wq {
-  int size;
-  wq_item_t *head;
-  pthread_mutex_t mutex; 	
-  pthread_cond_t con; 
+  wq_cell_t *cells;
+  size_t mask;
+  size_t high_water;
+  char pad0[WQ_CACHE_LINE];
+  size_t push_position;
+  char pad1[WQ_CACHE_LINE - sizeof(size_t)];
+  size_t pop_position;
+  char pad2[WQ_CACHE_LINE - sizeof(size_t)];
+  wq_event_t pop_event;   // Signalled when an item is pushed.
+  char pad3[WQ_CACHE_LINE - sizeof(wq_event_t)];
+  wq_event_t push_event;  // Signalled when an item is popped.
 } wq_t;
 
 void wq_init(wq_t *wq);
+void wq_set_high_water(wq_t *wq, size_t high_water);
 void wq_push(wq_t *wq, int client_socket_fd);
 int wq_pop(wq_t *wq);
 
+/* Non-blocking variants; they return 0 if the queue is full / empty and do
+ * not signal anybody. wq_try_pop also reports when the socket was pushed, if
+ * PUSH_TIME_US is not NULL. */
+int wq_try_push(wq_t *wq, int client_socket_fd);
+int wq_try_pop(wq_t *wq, int *client_socket_fd, long *push_time_us);
+size_t wq_size(wq_t *wq);
+
 #endif